@@ -1,127 +1,479 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cstdint>
+#include <deque>
+#include <fcntl.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <unistd.h>
+#include <poll.h>
 #include <string>
 #include <cstring>
 #include <iostream>
+#include <memory_resource>
 #include <filesystem>
+#include <fstream>
+#include <optional>
+#include <span>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 #include "utils/utils.h"
+#include "utils/chunker.h"
+#include "utils/chunk_index.h"
+#include "utils/compression.h"
+#include "utils/digest_set.h"
+#include "utils/delta.h"
+#include "utils/sha256.h"
 #include "protocol/protocol.h"
 #include "protocol/serialization.h"
 
+// File bodies are moved from the socket to disk in chunks of this size
+constexpr size_t kFileChunkSize = 64 * 1024;
+// How long to wait for the server to answer HELLO before assuming a v1 server
+constexpr int kHandshakeTimeoutMs = 2000;
+// Smaller stale copies are cheaper to replace with a plain PULL than to DELTA
+constexpr uint64_t kMinDeltaFileSize = 64 * 1024;
+// Chunks requested per FETCH; the next batch is requested while one is received
+constexpr size_t kFetchBatchChunks = 1024;
+// CHUNKS requests kept outstanding while chunk lists are received
+constexpr size_t kChunkListWindow = 64;
+// How often a download records its progress, i.e. how much a dropped connection can cost
+constexpr uint64_t kProgressInterval = 1024 * 1024;
+// Files with at least this much new content are fetched over several connections
+constexpr uint64_t kParallelMinBytes = 64 * 1024 * 1024;
+// Parallel downloads go in segments of this size, two in flight per connection
+constexpr uint64_t kSegmentSize = 8 * 1024 * 1024;
+constexpr size_t kInitialConnections = 2;
+constexpr size_t kMaxConnections = 8;
+// How often a parallel download measures throughput to decide on another connection
+constexpr std::chrono::milliseconds kProbeInterval{250};
+// The server's catalog as of the last LIST_SINCE, kept in the data directory (hidden, so never listed)
+constexpr const char* kCatalogCacheName = ".server_catalog";
+constexpr const char* kCatalogCacheMagic = "# server catalog v2";
+// The local files' chunks as of the last chunked PULL, next to the catalog cache
+constexpr const char* kChunkIndexName = ".chunk_index";
+
+static_assert(kMaxChunkSize <= kFileChunkSize, "a chunk must fit in the transfer buffer");
+
 enum class State { Fresh, Listed, Diffed, Pulled };
 
+static int ConnectToServer(const sockaddr_in& server_address) {
+  int client_socket;
+
+  // Create a new TCP socket
+  if ((client_socket = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0) {
+    FatalError("socket() failed");
+  }
+
+  // Connect to the server
+  if (connect(client_socket, (sockaddr *)&server_address, sizeof(server_address)) < 0) {
+    FatalError("connect() failed");
+  }
+
+  return client_socket;
+}
+
 class ClientApp {
  public:
-  ClientApp(unsigned int client_socket) : client_socket_(client_socket) {}
+  ClientApp(unsigned int client_socket, const sockaddr_in& server_address)
+      : client_socket_(client_socket), server_address_(server_address) {}
+  void Handshake();
   void HandleList();
   void HandleDiff();
   void HandlePull();
+  void HandlePush();
   void HandleLeave();
 
  private:
+  static std::filesystem::path DataDir();
+  void SendAll(const std::vector<uint8_t>& buffer, const std::string& what);
+  void SendAll(const uint8_t* buffer, size_t size, const std::string& what);
+  void SendAll(iovec* iov, int count, const std::string& what);
+  void SendMessage(protocol::Command command, const std::vector<uint8_t>& payload, const std::string& what);
+  protocol::MessageHeader ReceiveHeader(const std::string& what);
+  void ReceiveAll(void* buffer, size_t size, const std::string& what);
+  uint64_t ReceiveListBatches();
+  void SyncCatalog();
+  void ApplyCatalogChanges(bool copy_names);
+  void LoadCatalog(const std::filesystem::path& cache_path);
+  void SaveCatalog(const std::filesystem::path& cache_path);
+  void ReceiveSocket(void* buffer, size_t size, const std::string& what);
+  void Inflate(uint8_t* buffer, size_t size, const std::string& what);
+  void ReceiveCompressedBlock(const std::string& what);
+  size_t ReceiveHash(protocol::Digest& hash);
+  // A file being received into a hidden .part file. Every kProgressInterval
+  // bytes the length written so far and the hash of that prefix are recorded
+  // in a sidecar, so a later run can verify the prefix and fetch only the rest.
+  struct Download {
+    protocol::FileHeader file;
+    std::filesystem::path part_path;
+    std::ofstream out;
+    SHA256 sha256;
+    uint64_t written = 0;
+    uint64_t checkpoint = 0;
+  };
+
+  // One file fetched over several connections, each taking the next segment
+  // and writing it at its offset, so segments land in any order
+  struct ParallelDownload {
+    protocol::FileHeader file;
+    uint64_t size;
+    int fd;
+    uint64_t segment_count;
+    std::atomic<uint64_t> next_segment{0};
+    std::atomic<uint64_t> received{0};
+    // Set once a segment is completely written
+    std::vector<std::atomic<bool>> segment_done;
+  };
+
+  uint64_t ReceiveFilePrefix(protocol::FileHeader& file_header, uint64_t& file_size, const std::string& what);
+  size_t ReceiveRange(uint64_t& offset, uint64_t& length);
+  void ReceiveFile(const protocol::MessageHeader& header, const std::filesystem::path& data_dir, Download* resume = nullptr);
+  void ReceiveDelta(uint64_t payload_size, const std::filesystem::path& data_dir, uint32_t block_size);
+  Download StartDownload(const protocol::FileHeader& file, const std::filesystem::path& data_dir);
+  std::optional<Download> ResumeDownload(const protocol::FileHeader& file, const std::filesystem::path& data_dir);
+  void WriteChunk(Download& download, size_t size);
+  void SaveProgress(Download& download);
+  static void WriteProgress(const std::filesystem::path& part_path, const protocol::Digest& file_hash, uint64_t written, SHA256& sha256);
+  void CommitFile(Download& download);
+  void SendFile(const protocol::FileHeader& file_header, const std::filesystem::path& data_dir);
+  void SendPullRequest(const std::vector<protocol::FileHeader>& files, size_t first, size_t last);
+  void PullDelta(const protocol::FileHeader& file, const std::filesystem::path& data_dir, uint64_t local_size);
+  void PullRanges(std::vector<Download>& downloads, const std::filesystem::path& data_dir);
+  void PlanChunkedPulls(const std::vector<protocol::FileHeader>& files, const std::filesystem::path& data_dir,
+                        std::pmr::memory_resource* arena, std::vector<protocol::FileHeader>& full_files,
+                        std::vector<protocol::pmr::ChunkList>& chunked_files,
+                        std::vector<protocol::pmr::ChunkList>& parallel_files);
+  void PullChunks(const protocol::pmr::ChunkList& list, const std::filesystem::path& data_dir);
+  void PullParallel(const protocol::FileHeader& file, uint64_t size, const std::filesystem::path& data_dir);
+  void ReceiveSegments(ParallelDownload& download);
+  void IndexLocalChunks(const std::filesystem::path& data_dir);
+  void IndexChunks(std::span<const protocol::ChunkInfo> chunks, const std::filesystem::path& path);
+  void ReindexFile(std::span<const protocol::ChunkInfo> chunks, const std::filesystem::path& file_path, const std::filesystem::path& part_path);
+
+  struct ChunkLocation {
+    std::filesystem::path path;
+    uint64_t offset;
+  };
+
   State state_ = State::Fresh;
   int client_socket_;
+  sockaddr_in server_address_;
+  uint8_t protocol_version_ = protocol::kProtocolV1;
+  // Set when HELLO negotiated compression. While a compressed payload is being
+  // read, ReceiveAll() takes its bytes from the current block through it
+  std::unique_ptr<Decompressor> decompressor_;
+  uint64_t inflate_remaining_ = 0;
+  std::vector<uint8_t> inflate_block_;
+  size_t inflate_offset_ = 0;
+  // Set when HELLO negotiated batched LIST responses. Such a LIST already
+  // computes the DIFF, batch by batch, and DIFF only shows its result
+  bool list_batches_ = false;
+  bool list_diffed_ = false;
+  // Set when HELLO negotiated LIST_SINCE. LIST then only receives what changed
+  // since catalog_version_ and applies it to catalog_, which outlives the run.
+  // Names point into catalog_buffer_, the last full catalog (received or
+  // loaded from the cache), or into catalog_names_ for files added since
+  bool list_since_ = false;
+  bool catalog_loaded_ = false;
+  uint64_t catalog_epoch_ = 0;
+  uint64_t catalog_version_ = 0;
+  std::unordered_map<std::string_view, protocol::Digest> catalog_;
+  std::vector<uint8_t> catalog_buffer_;
+  std::deque<std::string> catalog_names_;
+  std::vector<protocol::CatalogChangeView> catalog_changes_;
   std::vector<protocol::FileHeader> client_files_;
-  std::vector<protocol::FileHeader> server_files_;
+  // The last LIST payload (or batch); server_files_ points into it until the next one
+  std::vector<uint8_t> list_buffer_;
+  std::vector<protocol::FileHeaderView> server_files_;
   std::vector<protocol::FileHeader> diff_files_;
+  std::vector<protocol::FileHeader> upload_files_;
+  std::vector<uint8_t> chunk_buffer_ = std::vector<uint8_t>(kFileChunkSize);
+  // Where each chunk of the local files can be read from, so a chunked PULL
+  // only fetches chunks that no local file holds yet. Built from chunk_index_,
+  // which keeps the local files' chunks across runs
+  std::unordered_map<protocol::Digest, ChunkLocation, DigestHash> local_chunks_;
+  ChunkIndex chunk_index_{DataDir() / kChunkIndexName};
+  bool chunk_index_loaded_ = false;
 };
 
 void ClientApp::HandleList() {
-  protocol::MessageHeader header {
-    .command = protocol::Command::LIST,
-    .payload_size = 0
-  };
-  std::array<uint8_t, 5> serialized_header = protocol::SerializeHeader(header);
-  
-  if (send(this->client_socket_, serialized_header.data(), serialized_header.size(), 0) != serialized_header.size()) {
-    FatalError("send() failed for LIST command");
+  // Only the changes travel; the files shown and diffed are the updated catalog_
+  this->list_diffed_ = this->list_batches_ && !this->list_since_;
+  if (this->list_since_) {
+    SyncCatalog();
+    std::cout << "Received LIST response with " << this->server_files_.size() << " files." << "\n";
+    for (const auto &file : this->server_files_) {
+      std::cout << "File: " << file.name << "\nHash: " << DigestToHex(file.hash) << "\n";
+    }
+    std::cout << "LIST completed." << "\n";
+    this->state_ = State::Listed;
+    return;
   }
 
-  // Receive number of files
-  std::array<uint8_t, 5> received_serialized_header;
-  uint32_t total_size;
-  uint32_t total_bytes_received = 0;
-  uint32_t bytes_received;
-  std::vector<uint8_t> receive_buffer;
+  SendMessage(protocol::Command::LIST, {}, "LIST command");
 
-  // Receive header bytes from server
-  if (recv(this->client_socket_, received_serialized_header.data(), received_serialized_header.size(), 0) != received_serialized_header.size()) {
-    FatalError("recv() failed for LIST header");
+  if (this->list_batches_) {
+    uint64_t file_count = ReceiveListBatches();
+    std::cout << "Received LIST response with " << file_count << " files." << "\n";
+    std::cout << "LIST completed." << "\n";
+    this->state_ = State::Listed;
+    return;
   }
 
-  protocol::MessageHeader received_header = protocol::DeserializeHeader(received_serialized_header);
-  total_size = received_header.payload_size;
-  receive_buffer.resize(total_size);
+  // Receive header and payload bytes from server
+  protocol::MessageHeader received_header = ReceiveHeader("LIST header");
+  this->list_buffer_.resize(received_header.payload_size);
+  ReceiveAll(this->list_buffer_.data(), this->list_buffer_.size(), "LIST payload");
 
-  // Receive payload bytes from server
-  while (total_bytes_received < total_size) {
-    bytes_received = recv(this->client_socket_, receive_buffer.data() + total_bytes_received, total_size - total_bytes_received, 0);
+  // Parse in place: names stay in list_buffer_, which both vectors keep reusing
+  std::optional<uint32_t> file_count = protocol::DeserializeListView(this->list_buffer_, this->protocol_version_, this->server_files_);
+  if (!file_count) {
+    FatalError("Malformed LIST response");
+  }
 
-    if (bytes_received < 0) {
-      FatalError("recv() failed for LIST payload");
-    } else if (bytes_received == 0) {
-      FatalError("Server disconnected while sending LIST response.");
+  // Show the list of files
+  std::cout << "Received LIST response with " << *file_count << " files." << "\n";
+  for (const auto &file : this->server_files_) {
+    std::cout << "File: " << file.name << "\nHash: " << DigestToHex(file.hash) << "\n";
+  }
+
+  std::cout << "LIST completed." << "\n";
+  this->state_ = State::Listed;
+}
+
+// Receives a batched LIST and diffs every batch against the local files as it
+// arrives, so only one batch of the server's catalog is held at a time and
+// the local side is hashed while the server is still sending. Returns the
+// number of files listed
+uint64_t ClientApp::ReceiveListBatches() {
+  this->client_files_ = ListFilesWithHashes(DataDir());
+
+  // What the client holds, and which of it the server turned out to have as
+  // well; both stay bounded by the local side however long the catalog is
+  DigestSet local_hashes(this->client_files_.size());
+  for (const auto& file : this->client_files_) {
+    local_hashes.Insert(file.hash);
+  }
+  DigestSet on_server;
+  this->diff_files_.clear();
+  uint64_t file_count = 0;
+
+  while (true) {
+    protocol::MessageHeader batch_header = ReceiveHeader("LIST batch header");
+    if (batch_header.command != protocol::Command::LIST) {
+      FatalError("Unexpected reply to LIST");
     }
 
-    total_bytes_received += bytes_received;
+    this->list_buffer_.resize(batch_header.payload_size);
+    ReceiveAll(this->list_buffer_.data(), this->list_buffer_.size(), "LIST batch");
+    std::optional<uint32_t> batch_count = protocol::DeserializeListView(this->list_buffer_, this->protocol_version_, this->server_files_);
+    if (!batch_count) {
+      FatalError("Malformed LIST batch");
+    }
+    if (*batch_count == 0) {
+      break;
+    }
+
+    for (const auto &file : this->server_files_) {
+      std::cout << "File: " << file.name << "\nHash: " << DigestToHex(file.hash) << "\n";
+
+      if (!local_hashes.Contains(file.hash)) {
+        this->diff_files_.push_back(protocol::ToFileHeader(file));
+      } else {
+        on_server.Insert(file.hash);
+      }
+    }
+    file_count += this->server_files_.size();
+  }
+
+  this->upload_files_.clear();
+  for (const auto& file : this->client_files_) {
+    if (!on_server.Contains(file.hash)) {
+      this->upload_files_.push_back(file);
+    }
   }
 
-  // Deserialize the received data
-  protocol::ListResponse response = protocol::DeserializeList(receive_buffer);
+  return file_count;
+}
+
+// Brings catalog_ up to date with one LIST_SINCE and points server_files_ at
+// it. The catalog is loaded from the data directory on first use and saved
+// back whenever it changed, so a later run only receives what changed since
+void ClientApp::SyncCatalog() {
+  std::filesystem::path cache_path = DataDir() / kCatalogCacheName;
+  if (!this->catalog_loaded_) {
+    LoadCatalog(cache_path);
+    this->catalog_loaded_ = true;
+  }
+
+  protocol::ListSinceRequest request { .epoch = this->catalog_epoch_, .version = this->catalog_version_ };
+  SendMessage(protocol::Command::LIST_SINCE, protocol::SerializeListSinceRequest(request), "LIST_SINCE command");
+
+  protocol::MessageHeader header = ReceiveHeader("LIST_SINCE header");
+  if (header.command != protocol::Command::LIST_SINCE) {
+    FatalError("Unexpected reply to LIST_SINCE");
+  }
+  this->list_buffer_.resize(header.payload_size);
+  ReceiveAll(this->list_buffer_.data(), this->list_buffer_.size(), "LIST_SINCE payload");
+
+  std::optional<protocol::ListSincePrefix> parsed = protocol::DeserializeListSinceView(this->list_buffer_, this->catalog_changes_);
+  if (!parsed) {
+    FatalError("Malformed LIST_SINCE response");
+  }
+  protocol::ListSincePrefix prefix = *parsed;
+  bool full = prefix.kind == protocol::ListSinceKind::FULL;
+
+  if (full) {
+    std::cout << "Received the full catalog at version " << prefix.version << "\n";
+    // Its names stay where they were received
+    this->catalog_.clear();
+    this->catalog_names_.clear();
+    this->catalog_buffer_.swap(this->list_buffer_);
+  } else {
+    std::cout << "Received " << this->catalog_changes_.size() << " catalog changes since version " << this->catalog_version_ << "\n";
+    for (const auto& change : this->catalog_changes_) {
+      const char* what = change.op == protocol::ChangeOp::ADDED ? "Added" : change.op == protocol::ChangeOp::MODIFIED ? "Modified" : "Removed";
+      std::cout << what << ": " << change.file.name << "\n";
+    }
+  }
+  ApplyCatalogChanges(!full);
+
+  bool changed = full || !this->catalog_changes_.empty() || prefix.version != this->catalog_version_;
+  this->catalog_epoch_ = prefix.epoch;
+  this->catalog_version_ = prefix.version;
+  if (changed) {
+    SaveCatalog(cache_path);
+  }
 
-  // Show the list of files and store in app state
   this->server_files_.clear();
-  std::cout << "Received LIST response with " << static_cast<int>(response.file_count) << " files." << "\n";
-  for (const auto &file : response.files) {
-    std::cout << "File: " << file.name << "\nHash: " << file.hash << "\n";
-    this->server_files_.push_back(file);
+  this->server_files_.reserve(this->catalog_.size());
+  for (const auto& [name, hash] : this->catalog_) {
+    this->server_files_.push_back({ .name = name, .hash = hash });
   }
+}
 
-  std::cout << "LIST completed." << "\n";
-  this->state_ = State::Listed;
+// Changes come oldest first and each one states its outcome, so applying them
+// in order is all it takes. Names are copied unless their buffer is kept
+void ClientApp::ApplyCatalogChanges(bool copy_names) {
+  this->catalog_.reserve(this->catalog_.size() + this->catalog_changes_.size());
+
+  for (const auto& change : this->catalog_changes_) {
+    if (change.op == protocol::ChangeOp::REMOVED) {
+      this->catalog_.erase(change.file.name);
+      continue;
+    }
+
+    auto it = this->catalog_.find(change.file.name);
+    if (it != this->catalog_.end()) {
+      it->second = change.file.hash;
+    } else {
+      std::string_view name = copy_names ? std::string_view(this->catalog_names_.emplace_back(change.file.name)) : change.file.name;
+      this->catalog_.emplace(name, change.file.hash);
+    }
+  }
 }
 
-void ClientApp::HandleDiff() {
-  if (this->state_ != State::Listed || this->state_ == State::Diffed || this->state_ == State::Pulled) {
-    std::cout << "You must LIST files before performing DIFF." << "\n";
+// The cache is a CHANGES response that adds every file, so loading it is
+// applying it. Without one the catalog starts out empty at version 0, which
+// the server answers with all of it
+void ClientApp::LoadCatalog(const std::filesystem::path& cache_path) {
+  std::ifstream in(cache_path, std::ios::binary);
+  std::string magic;
+  if (!in || !std::getline(in, magic) || magic != kCatalogCacheMagic) {
     return;
   }
 
-  // Initialize data directory
-  const char *run_files = std::getenv("RUNFILES_DIR");
-  std::filesystem::path data_dir = run_files
-      ? std::filesystem::path(run_files) / "client_server_sockets" / "client" / "files"
-      : std::filesystem::current_path() / "client" / "files";
+  std::error_code ec;
+  uint64_t size = std::filesystem::file_size(cache_path, ec);
+  size_t offset = magic.size() + 1;
+  this->catalog_buffer_.resize(!ec && size > offset ? size - offset : 0);
 
-  this->client_files_ = ListFilesWithHashes(data_dir);
-  std::vector<protocol::FileHeader> client_missing_files;
+  if (this->catalog_buffer_.empty() || !in.read(reinterpret_cast<char *>(this->catalog_buffer_.data()), this->catalog_buffer_.size())) {
+    std::cerr << "Unable to read catalog cache: " << cache_path << "\n";
+    this->catalog_buffer_.clear();
+    return;
+  }
 
-  for (const auto& server_file : this->server_files_) {
-    bool found = false;
+  std::optional<protocol::ListSincePrefix> prefix = protocol::DeserializeListSinceView(this->catalog_buffer_, this->catalog_changes_);
+  if (!prefix) {
+    // Only a cache; starting from version 0 gets the whole catalog, which then replaces it
+    std::cerr << "Discarding malformed catalog cache: " << cache_path << "\n";
+    this->catalog_buffer_.clear();
+    this->catalog_changes_.clear();
+    return;
+  }
+  ApplyCatalogChanges(false);
+  this->catalog_epoch_ = prefix->epoch;
+  this->catalog_version_ = prefix->version;
 
-    for (const auto& client_file : this->client_files_) {
-      if (server_file.hash == client_file.hash) {
-        found = true;
-        break;
-      }
-    }
+  std::cout << "Loaded " << this->catalog_.size() << " files of catalog version " << this->catalog_version_ << " from " << cache_path << "\n";
+}
 
-    if (!found) {
-      client_missing_files.push_back(server_file);
-    }
+// Written next to the cache and renamed over it, so a crash never leaves a torn catalog behind
+void ClientApp::SaveCatalog(const std::filesystem::path& cache_path) {
+  std::vector<uint8_t> cache;
+  protocol::AppendListSincePrefix(cache, { .epoch = this->catalog_epoch_, .version = this->catalog_version_, .kind = protocol::ListSinceKind::CHANGES });
+  std::vector<uint8_t> count = protocol::SerializeCount(this->catalog_.size(), protocol::kProtocolV2);
+  cache.insert(cache.end(), count.begin(), count.end());
+  for (const auto& [name, hash] : this->catalog_) {
+    protocol::AppendCatalogChange(cache, protocol::ChangeOp::ADDED, { .name = name, .hash = hash });
   }
 
-  this->diff_files_ = client_missing_files;
+  std::filesystem::path temp_path = cache_path;
+  temp_path += ".tmp";
+
+  std::ofstream out(temp_path, std::ios::binary | std::ios::trunc);
+  out << kCatalogCacheMagic << "\n";
+  out.write(reinterpret_cast<const char *>(cache.data()), cache.size());
+  out.close();
+
+  if (!out) {
+    std::cerr << "Failed to write catalog cache: " << temp_path << "\n";
+    return;
+  }
 
-  // Show the DIFF of files (for now, just files missing on the client that the server has)
-  // TODO: make DIFF 2-way
+  std::error_code ec;
+  std::filesystem::rename(temp_path, cache_path, ec);
+  if (ec) {
+    std::cerr << "Failed to replace catalog cache: " << ec.message() << "\n";
+  }
+}
+
+void ClientApp::HandleDiff() {
+  if (this->state_ != State::Listed || this->state_ == State::Diffed || this->state_ == State::Pulled) {
+    std::cout << "You must LIST files before performing DIFF." << "\n";
+    return;
+  }
+
+  if (!this->list_diffed_) {
+    this->client_files_ = ListFilesWithHashes(DataDir());
+
+    // Linear in the size of both lists, see FilesMissingFrom()
+    // Only the files to pull are copied out of the LIST payload
+    std::vector<protocol::FileHeaderView> missing = FilesMissingFrom(this->server_files_, this->client_files_);
+    this->diff_files_.clear();
+    this->diff_files_.reserve(missing.size());
+    for (const auto &file : missing) {
+      this->diff_files_.push_back(protocol::ToFileHeader(file));
+    }
+    this->upload_files_ = FilesMissingFrom(this->client_files_, this->server_files_);
+  }
+
+  // Show the DIFF of files in both directions
   std::cout << "DIFF completed. Found " << this->diff_files_.size() << " files missing on the client." << "\n";
   for (const auto &file : this->diff_files_) {
-    std::cout << "Missing File: " << file.name << "\nHash: " << file.hash << "\n";
+    std::cout << "Missing File: " << file.name << "\nHash: " << DigestToHex(file.hash) << "\n";
+  }
+
+  std::cout << "Found " << this->upload_files_.size() << " files missing on the server." << "\n";
+  for (const auto &file : this->upload_files_) {
+    std::cout << "Missing File: " << file.name << "\nHash: " << DigestToHex(file.hash) << "\n";
   }
 
   this->state_ = State::Diffed;
@@ -133,93 +485,1157 @@ void ClientApp::HandlePull() {
     return;
   }
 
-  // Prepare PULL request
+  std::filesystem::path data_dir = DataDir();
+
+  // Interrupted downloads resume where they stopped and files we hold an older
+  // copy of under the same name only need a delta. Of the rest, v2 servers send
+  // files that may share content with local ones by chunks, the others whole
+  // in one pipelined PULL; v1 servers only know PULL
+  std::vector<protocol::FileHeader> full_files;
+  std::vector<Download> resumed_files;
+  std::vector<protocol::FileHeader> new_files;
+  std::vector<std::pair<protocol::FileHeader, uint64_t>> delta_files;
+
+  for (const auto &file : this->diff_files_) {
+    std::error_code ec;
+    uint64_t local_size = IsValidFileName(file.name) ? std::filesystem::file_size(data_dir / file.name, ec) : 0;
+    std::optional<Download> download;
+
+    if (this->protocol_version_ < protocol::kProtocolV2) {
+      full_files.push_back(file);
+    } else if (IsValidFileName(file.name) && (download = ResumeDownload(file, data_dir))) {
+      resumed_files.push_back(std::move(*download));
+    } else if (!ec && local_size >= kMinDeltaFileSize) {
+      delta_files.emplace_back(file, local_size);
+    } else {
+      new_files.push_back(file);
+    }
+  }
+
+  // The chunk lists and the payloads they point into all die with this PULL
+  std::pmr::monotonic_buffer_resource arena;
+  std::vector<protocol::pmr::ChunkList> chunked_files;
+  std::vector<protocol::pmr::ChunkList> parallel_files;
+  if (!new_files.empty()) {
+    PlanChunkedPulls(new_files, data_dir, &arena, full_files, chunked_files, parallel_files);
+  }
+
+  // v1 requests count files in a single byte, so larger pulls go out in batches
+  size_t batch_size = this->protocol_version_ >= protocol::kProtocolV2 ? full_files.size() : UINT8_MAX;
+
+  if (!full_files.empty()) {
+    SendPullRequest(full_files, 0, std::min(batch_size, full_files.size()));
+  }
+
+  for (size_t first = 0; first < full_files.size(); first += batch_size) {
+    size_t last = std::min(first + batch_size, full_files.size());
+
+    // Keep the next batch queued at the server so it never idles between batches
+    if (last < full_files.size()) {
+      SendPullRequest(full_files, last, std::min(last + batch_size, full_files.size()));
+    }
+
+    // Receive PULL response from server, one message per file
+    for (size_t i = first; i < last; i++) {
+      protocol::MessageHeader response_header = ReceiveHeader("PULL response header");
+      ReceiveFile(response_header, data_dir);
+    }
+  }
+
+  if (!resumed_files.empty()) {
+    PullRanges(resumed_files, data_dir);
+  }
+
+  for (const auto &list : chunked_files) {
+    PullChunks(list, data_dir);
+  }
+
+  // A large file that is mostly new comes faster over several streams than through FETCH
+  for (const auto &list : parallel_files) {
+    protocol::FileHeader header = protocol::ToFileHeader(list.header);
+    PullParallel(header, list.size, data_dir);
+    ReindexFile(list.chunks, data_dir / header.name, data_dir / header.name);
+  }
+
+  for (const auto &[file, local_size] : delta_files) {
+    PullDelta(file, data_dir, local_size);
+  }
+
+  this->chunk_index_.Save();
+}
+
+// Sorts files the client holds no copy of by how they are best pulled. Only a
+// file whose type matches a large local file is likely to share content with
+// one, so only those are chunked by the server; their chunk lists are requested
+// a window at a time, so the server keeps sending while the client reads. Those
+// that turn out to be small or mostly new join `full_files` (or `parallel_files`
+// when large) after all; the rest go to `chunked_files` to be FETCHed.
+void ClientApp::PlanChunkedPulls(const std::vector<protocol::FileHeader>& files, const std::filesystem::path& data_dir,
+                                 std::pmr::memory_resource* arena, std::vector<protocol::FileHeader>& full_files,
+                                 std::vector<protocol::pmr::ChunkList>& chunked_files,
+                                 std::vector<protocol::pmr::ChunkList>& parallel_files) {
+  IndexLocalChunks(data_dir);
+
+  std::unordered_set<std::string> local_types;
+  for (const auto &[name, file] : this->chunk_index_.files()) {
+    if (file.size >= kMinChunkedFileSize) {
+      local_types.insert(std::filesystem::path(name).extension().string());
+    }
+  }
+
+  std::vector<protocol::FileHeader> candidates;
+  for (const auto &file : files) {
+    if (local_types.count(std::filesystem::path(file.name).extension().string()) > 0) {
+      candidates.push_back(file);
+    } else {
+      full_files.push_back(file);
+    }
+  }
+
+  size_t requested = 0;
+  for (; requested < std::min(candidates.size(), kChunkListWindow); requested++) {
+    SendMessage(protocol::Command::CHUNKS, protocol::SerializeFileHeader(candidates[requested], this->protocol_version_), "CHUNKS request");
+  }
+
+  for (size_t received = 0; received < candidates.size(); received++) {
+    protocol::MessageHeader list_header = ReceiveHeader("CHUNKS response header");
+    if (list_header.command != protocol::Command::CHUNKS) {
+      FatalError("Unexpected reply to CHUNKS");
+    }
+
+    std::span<uint8_t> list_buffer(static_cast<uint8_t*>(arena->allocate(list_header.payload_size)), list_header.payload_size);
+    ReceiveAll(list_buffer.data(), list_buffer.size(), "CHUNKS response");
+
+    if (requested < candidates.size()) {
+      SendMessage(protocol::Command::CHUNKS, protocol::SerializeFileHeader(candidates[requested++], this->protocol_version_), "CHUNKS request");
+    }
+
+    std::optional<protocol::pmr::ChunkList> list = protocol::DeserializeChunkList(list_buffer, this->protocol_version_, arena);
+    if (!list) {
+      FatalError("Malformed CHUNKS response");
+    }
+    std::string name(list->header.name);
+    if (!IsValidFileName(name)) {
+      FatalError("CHUNKS response carries an invalid file name: " + name);
+    }
+
+    uint64_t total_size = 0;
+    uint64_t local_size = 0;
+    for (const auto &chunk : list->chunks) {
+      if (chunk.length == 0 || chunk.length > kMaxChunkSize) {
+        FatalError("CHUNKS response carries an invalid chunk length for " + name);
+      }
+      total_size += chunk.length;
+      local_size += this->local_chunks_.count(chunk.hash) > 0 ? chunk.length : 0;
+    }
+    if (total_size != list->size) {
+      FatalError("CHUNKS response size mismatch for " + name);
+    }
+
+    // FETCH takes a round trip per file, worth it only when local copies cover a good part of it
+    if (list->size >= kMinChunkedFileSize && local_size * 10 >= list->size) {
+      chunked_files.push_back(std::move(*list));
+    } else if (list->size >= kParallelMinBytes) {
+      parallel_files.push_back(std::move(*list));
+    } else {
+      full_files.push_back(protocol::ToFileHeader(list->header));
+    }
+  }
+
+  std::cout << "Pulling " << chunked_files.size() << " of " << files.size() << " new files by chunks" << "\n";
+}
+
+// Rebuilds a file from its chunk list: chunks some local file already holds
+// are copied from it, the rest are FETCHed, each distinct chunk only once.
+// Chunks written earlier in the same file serve later repeats of them.
+void ClientApp::PullChunks(const protocol::pmr::ChunkList& list, const std::filesystem::path& data_dir) {
+  protocol::FileHeader header = protocol::ToFileHeader(list.header);
+
+  // Chunks no local file holds, in the order they first appear
+  std::vector<protocol::ChunkInfo> missing;
+  DigestSet requested;
+
+  for (const auto &chunk : list.chunks) {
+    if (this->local_chunks_.count(chunk.hash) == 0 && !requested.Contains(chunk.hash)) {
+      requested.Insert(chunk.hash);
+      missing.push_back(chunk);
+    }
+  }
+
+  std::filesystem::path file_path = data_dir / header.name;
+
+  Download download = StartDownload(header, data_dir);
+  std::ifstream source;
+  std::filesystem::path source_path;
+  size_t next = 0;
+
+  // Appends list.chunks[next], read from the socket or from wherever it is held locally
+  auto write_next = [&](bool fetched) {
+    const protocol::ChunkInfo& chunk = list.chunks[next++];
+
+    if (fetched) {
+      ReceiveAll(this->chunk_buffer_.data(), chunk.length, "FETCH chunk bytes");
+      this->local_chunks_.emplace(chunk.hash, ChunkLocation{ .path = download.part_path, .offset = download.written });
+    } else {
+      const ChunkLocation& location = this->local_chunks_.at(chunk.hash);
+      if (location.path == download.part_path) {
+        download.out.flush();
+      }
+      if (location.path != source_path) {
+        source = std::ifstream(location.path, std::ios::binary);
+        source_path = location.path;
+      }
+
+      source.clear();
+      source.seekg(location.offset);
+      if (!source.read(reinterpret_cast<char *>(this->chunk_buffer_.data()), chunk.length)) {
+        FatalError("Failed to read from file: " + location.path.string());
+      }
+    }
+
+    WriteChunk(download, chunk.length);
+  };
+
+  auto send_fetch = [&](size_t first) {
+    protocol::FetchRequest request;
+    for (size_t i = first; i < std::min(first + kFetchBatchChunks, missing.size()); i++) {
+      request.chunks.push_back(missing[i].hash);
+    }
+    SendMessage(protocol::Command::FETCH, protocol::SerializeFetchRequest(request), "FETCH request");
+  };
+
+  if (!missing.empty()) {
+    send_fetch(0);
+  }
+
+  uint64_t fetched_bytes = 0;
+  for (size_t first = 0; first < missing.size(); first += kFetchBatchChunks) {
+    size_t last = std::min(first + kFetchBatchChunks, missing.size());
+
+    // Keep the next batch queued at the server so it never idles between batches
+    if (last < missing.size()) {
+      send_fetch(last);
+    }
+
+    uint64_t batch_size = 0;
+    for (size_t i = first; i < last; i++) {
+      batch_size += missing[i].length;
+    }
+
+    protocol::MessageHeader fetch_header = ReceiveHeader("FETCH response header");
+    if (fetch_header.command != protocol::Command::FETCH || fetch_header.payload_size != batch_size) {
+      FatalError("Unexpected reply to FETCH for " + header.name);
+    }
+
+    // The batch arrives in file order: write everything up to its last chunk
+    for (size_t i = first; i < last;) {
+      bool fetched = list.chunks[next].hash == missing[i].hash;
+      write_next(fetched);
+      i += fetched;
+    }
+    fetched_bytes += batch_size;
+  }
+
+  while (next < list.chunks.size()) {
+    write_next(false);
+  }
+
+  source.close();
+  CommitFile(download);
+  ReindexFile(list.chunks, file_path, download.part_path);
+
+  std::cout << "Received file by chunks: " << header.name << " (" << fetched_bytes << " of " << list.size << " bytes fetched)" << "\n";
+}
+
+// Only files that changed since the last run are read; the rest come from the chunk index
+void ClientApp::IndexLocalChunks(const std::filesystem::path& data_dir) {
+  if (!this->chunk_index_loaded_) {
+    this->chunk_index_.Load();
+    this->chunk_index_loaded_ = true;
+  }
+  this->chunk_index_.Update(data_dir);
+  this->chunk_index_.Save();
+
+  this->local_chunks_.clear();
+  for (const auto &[name, file] : this->chunk_index_.files()) {
+    IndexChunks(file.chunks, data_dir / name);
+  }
+}
+
+// The old copy of a replaced file is gone and the new one holds all its chunks
+void ClientApp::ReindexFile(std::span<const protocol::ChunkInfo> chunks, const std::filesystem::path& file_path, const std::filesystem::path& part_path) {
+  for (auto it = this->local_chunks_.begin(); it != this->local_chunks_.end();) {
+    if (it->second.path == part_path || it->second.path == file_path) {
+      it = this->local_chunks_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+  IndexChunks(chunks, file_path);
+  this->chunk_index_.Record(file_path, std::vector<protocol::ChunkInfo>(chunks.begin(), chunks.end()));
+}
+
+void ClientApp::IndexChunks(std::span<const protocol::ChunkInfo> chunks, const std::filesystem::path& path) {
+  uint64_t offset = 0;
+
+  for (const auto &chunk : chunks) {
+    this->local_chunks_.emplace(chunk.hash, ChunkLocation{ .path = path, .offset = offset });
+    offset += chunk.length;
+  }
+}
+
+void ClientApp::PullDelta(const protocol::FileHeader& file, const std::filesystem::path& data_dir, uint64_t local_size) {
+  uint32_t block_size = DeltaBlockSize(local_size);
+
+  protocol::DeltaRequest request {
+    .header = file,
+    .block_size = block_size,
+    .blocks = ComputeSignatures(data_dir / file.name, block_size)
+  };
+
+  SendMessage(protocol::Command::DELTA, protocol::SerializeDeltaRequest(request, this->protocol_version_), "DELTA request");
+
+  protocol::MessageHeader response_header = ReceiveHeader("DELTA response header");
+  if (response_header.command != protocol::Command::DELTA) {
+    FatalError("Unexpected reply to DELTA");
+  }
+  ReceiveDelta(response_header.payload_size, data_dir, block_size);
+}
+
+// Requests the missing tail of every resumed download in one PULL_RANGE
+void ClientApp::PullRanges(std::vector<Download>& downloads, const std::filesystem::path& data_dir) {
+  protocol::PullRangeRequest request;
+
+  for (const auto &download : downloads) {
+    std::cout << "Resuming " << download.file.name << " at " << download.written << " bytes" << "\n";
+    request.files.push_back({ .header = download.file, .offset = download.written, .length = 0 });
+  }
+
+  SendMessage(protocol::Command::PULL_RANGE, protocol::SerializePullRangeRequest(request, this->protocol_version_), "PULL_RANGE request");
+
+  for (auto &download : downloads) {
+    protocol::MessageHeader response_header = ReceiveHeader("PULL_RANGE response header");
+    if (response_header.command != protocol::Command::PULL_RANGE) {
+      FatalError("Unexpected reply to PULL_RANGE");
+    }
+    ReceiveFile(response_header, data_dir, &download);
+  }
+}
+
+void ClientApp::SendPullRequest(const std::vector<protocol::FileHeader>& files, size_t first, size_t last) {
   protocol::PullRequest pull_request {
-    .file_count = static_cast<uint8_t>(this->diff_files_.size()),
-    .files = this->diff_files_
+    .file_count = static_cast<uint32_t>(last - first),
+    .files = std::vector<protocol::FileHeader>(files.begin() + first, files.begin() + last)
   };
 
-  std::vector<uint8_t> serialized_request = protocol::SerializePullRequest(pull_request);
-  uint32_t total_size = serialized_request.size();
+  SendMessage(protocol::Command::PULL, protocol::SerializePullRequest(pull_request, this->protocol_version_), "PULL request");
+}
 
-  // Send message header to server
-  protocol::MessageHeader header {
-    .command = protocol::Command::PULL,
-    .payload_size = total_size
+void ClientApp::HandlePush() {
+  if (this->state_ != State::Diffed) {
+    std::cout << "You must DIFF files before performing PUSH." << "\n";
+    return;
+  }
+
+  if (this->protocol_version_ < protocol::kProtocolV2) {
+    std::cout << "Server does not support PUSH." << "\n";
+    return;
+  }
+
+  std::filesystem::path data_dir = DataDir();
+
+  // One message per file, each acknowledged before the next one is sent
+  for (const auto &file : this->upload_files_) {
+    SendFile(file, data_dir);
+
+    protocol::MessageHeader reply = ReceiveHeader("PUSH reply");
+    if (reply.command != protocol::Command::PUSH || reply.payload_size != sizeof(protocol::PushStatus)) {
+      FatalError("Unexpected reply to PUSH");
+    }
+
+    protocol::PushStatus status;
+    ReceiveAll(&status, sizeof(status), "PUSH status");
+
+    if (status == protocol::PushStatus::OK) {
+      std::cout << "Uploaded file: " << file.name << "\n";
+    } else {
+      std::cout << "Server rejected file: " << file.name << "\n";
+    }
+  }
+
+  std::cout << "PUSH completed." << "\n";
+}
+
+void ClientApp::Handshake() {
+  // HELLO is sent in v1 framing with our highest version and the features we
+  // offer in payload_size, and no payload
+  protocol::MessageHeader hello {
+    .command = protocol::Command::HELLO,
+    .payload_size = protocol::kProtocolVersion | protocol::kHelloZstd | protocol::kHelloListBatches | protocol::kHelloListSince
   };
-  std::array<uint8_t, 5> serialized_header = protocol::SerializeHeader(header);
+  SendAll(protocol::SerializeHeader(hello, protocol::kProtocolV1), "HELLO");
+
+  // v1 servers skip HELLO without answering. A slow v2 server may still answer
+  // after the timeout, and that reply would be read as the start of the next
+  // response, so v1 continues on a fresh connection that never sent HELLO
+  pollfd poll_fd { .fd = this->client_socket_, .events = POLLIN, .revents = 0 };
+  if (poll(&poll_fd, 1, kHandshakeTimeoutMs) <= 0) {
+    std::cout << "Server did not answer HELLO, reconnecting with protocol v1" << "\n";
+    close(this->client_socket_);
+    this->client_socket_ = ConnectToServer(this->server_address_);
+    return;
+  }
+
+  protocol::MessageHeader reply = ReceiveHeader("HELLO reply");
+  uint64_t version = reply.payload_size & protocol::kHelloVersionMask;
+  uint64_t features = reply.payload_size & ~protocol::kHelloVersionMask;
+  if (reply.command != protocol::Command::HELLO || version < protocol::kProtocolV1 || version > protocol::kProtocolVersion ||
+      (features & ~(protocol::kHelloZstd | protocol::kHelloListBatches | protocol::kHelloListSince)) != 0 || (features != 0 && version < protocol::kProtocolV2)) {
+    FatalError("Unexpected reply to HELLO");
+  }
 
-  if (send(this->client_socket_, serialized_header.data(), serialized_header.size(), 0) != serialized_header.size()) {
-    FatalError("send() failed for PULL command header");
+  this->protocol_version_ = static_cast<uint8_t>(version);
+  if (features & protocol::kHelloZstd) {
+    this->decompressor_ = std::make_unique<Decompressor>();
   }
+  this->list_batches_ = (features & protocol::kHelloListBatches) != 0;
+  this->list_since_ = (features & protocol::kHelloListSince) != 0;
+  std::cout << "Using protocol version " << static_cast<int>(this->protocol_version_) << (this->decompressor_ ? " with compression" : "") << "\n";
+}
+
+std::filesystem::path ClientApp::DataDir() {
+  const char *run_files = std::getenv("RUNFILES_DIR");
+  return run_files
+      ? std::filesystem::path(run_files) / "client_server_sockets" / "client" / "files"
+      : std::filesystem::current_path() / "client" / "files";
+}
+
+void ClientApp::SendAll(const std::vector<uint8_t>& buffer, const std::string& what) {
+  SendAll(buffer.data(), buffer.size(), what);
+}
 
-  // Send PULL request payload to server
-  unsigned int total_bytes_sent = 0;
-  int bytes_sent;
+void ClientApp::SendAll(const uint8_t* buffer, size_t size, const std::string& what) {
+  size_t total_bytes_sent = 0;
 
-  while (total_bytes_sent < total_size) {
-    bytes_sent = send(this->client_socket_, serialized_request.data() + total_bytes_sent, total_size - total_bytes_sent, 0);
+  while (total_bytes_sent < size) {
+    ssize_t bytes_sent = send(this->client_socket_, buffer + total_bytes_sent, size - total_bytes_sent, 0);
 
     if (bytes_sent < 0) {
-      FatalError("send() failed for PULL request payload");
-    } else if (bytes_sent == 0) {
-      FatalError("Server disconnected while sending PULL request.");
+      FatalError("send() failed for " + what);
     }
 
     total_bytes_sent += bytes_sent;
   }
+}
+
+// Sends every buffer in order; the array is used up as it goes
+void ClientApp::SendAll(iovec* iov, int count, const std::string& what) {
+  while (count > 0) {
+    msghdr message {};
+    message.msg_iov = iov;
+    message.msg_iovlen = count;
+    ssize_t bytes_sent = sendmsg(this->client_socket_, &message, 0);
+
+    if (bytes_sent < 0) {
+      FatalError("sendmsg() failed for " + what);
+    }
+
+    // Skip the buffers that went out whole, and the sent part of the next one
+    size_t left = bytes_sent;
+    while (count > 0 && left >= iov->iov_len) {
+      left -= iov->iov_len;
+      iov++;
+      count--;
+    }
+    if (count > 0) {
+      iov->iov_base = static_cast<uint8_t*>(iov->iov_base) + left;
+      iov->iov_len -= left;
+    }
+  }
+}
+
+void ClientApp::SendMessage(protocol::Command command, const std::vector<uint8_t>& payload, const std::string& what) {
+  protocol::MessageHeader header {
+    .command = command,
+    .payload_size = payload.size()
+  };
+
+  // Header and payload leave in one sendmsg() instead of being copied together first
+  std::array<uint8_t, protocol::kMaxHeaderSize> header_buffer;
+  protocol::SerializeHeader(header, this->protocol_version_, header_buffer.data());
+
+  std::array<iovec, 2> iov {{
+    { header_buffer.data(), protocol::HeaderSize(this->protocol_version_) },
+    { const_cast<uint8_t*>(payload.data()), payload.size() }
+  }};
+  SendAll(iov.data(), iov.size(), what);
+}
+
+protocol::MessageHeader ClientApp::ReceiveHeader(const std::string& what) {
+  std::array<uint8_t, protocol::kMaxHeaderSize> header_buffer;
+  ReceiveAll(header_buffer.data(), protocol::HeaderSize(this->protocol_version_), what);
+  protocol::MessageHeader header = protocol::DeserializeHeader(header_buffer.data(), this->protocol_version_);
+
+  uint8_t command = static_cast<uint8_t>(header.command);
+  if (command & protocol::kCompressedFlag) {
+    if (!this->decompressor_) {
+      FatalError("Server sent a compressed " + what + " without negotiating compression");
+    }
+
+    header.command = static_cast<protocol::Command>(command & ~protocol::kCompressedFlag);
+    this->inflate_remaining_ = header.payload_size;
+    this->inflate_block_.clear();
+    this->inflate_offset_ = 0;
+  }
+
+  return header;
+}
+
+void ClientApp::ReceiveAll(void* buffer, size_t size, const std::string& what) {
+  if (this->inflate_remaining_ > 0) {
+    Inflate(static_cast<uint8_t*>(buffer), size, what);
+  } else {
+    ReceiveSocket(buffer, size, what);
+  }
+}
+
+// Reads the next `size` bytes of a compressed payload, and once the payload is
+// complete makes sure its frame ends with it
+void ClientApp::Inflate(uint8_t* buffer, size_t size, const std::string& what) {
+  if (size > this->inflate_remaining_) {
+    FatalError("Compressed payload is shorter than " + what);
+  }
+
+  size_t produced = 0;
+  bool frame_done = false;
+  while (produced < size) {
+    size_t last_offset = this->inflate_offset_;
+    size_t last_produced = produced;
+    frame_done = this->decompressor_->Decompress(this->inflate_block_.data(), this->inflate_block_.size(), this->inflate_offset_, buffer, size, produced);
 
-  // Receive PULL response from server
-  unsigned int n_files = this->diff_files_.size();
+    // No progress means zstd has used up the block
+    if (produced == last_produced && this->inflate_offset_ == last_offset) {
+      ReceiveCompressedBlock(what);
+    }
+  }
 
-  for (unsigned int i = 0; i < n_files; i++) {
-    std::array<uint8_t, 5> response_header_buffer;
+  this->inflate_remaining_ -= size;
+  if (this->inflate_remaining_ > 0) {
+    return;
+  }
 
-    // Receive response header
-    if (recv(this->client_socket_, response_header_buffer.data(), response_header_buffer.size(), 0) != response_header_buffer.size()) {
-      FatalError("recv() failed for PULL response header");
+  // The end of the frame (and its checksum) may still be on the way
+  uint8_t extra;
+  size_t extra_size = 0;
+  while (!frame_done) {
+    frame_done = this->decompressor_->Decompress(this->inflate_block_.data(), this->inflate_block_.size(), this->inflate_offset_, &extra, 1, extra_size);
+    if (extra_size > 0) {
+      FatalError("Compressed payload is longer than announced for " + what);
+    } else if (!frame_done && this->inflate_offset_ == this->inflate_block_.size()) {
+      ReceiveCompressedBlock(what);
     }
+  }
 
-    protocol::MessageHeader response_header = protocol::DeserializeHeader(response_header_buffer);
-    uint32_t payload_size = response_header.payload_size;
+  if (extra_size > 0 || this->inflate_offset_ != this->inflate_block_.size()) {
+    FatalError("Compressed payload is longer than announced for " + what);
+  }
+}
 
-    // Receive response payload
-    std::vector<uint8_t> receive_buffer(payload_size);
-    unsigned int total_bytes_received = 0;
-    int bytes_received;
-    
-    while (total_bytes_received < payload_size) {
-      bytes_received = recv(this->client_socket_, receive_buffer.data() + total_bytes_received, payload_size - total_bytes_received, 0);
+void ClientApp::ReceiveCompressedBlock(const std::string& what) {
+  std::array<uint8_t, sizeof(uint32_t)> length_buffer;
+  ReceiveSocket(length_buffer.data(), length_buffer.size(), what + " block length");
 
-      if (bytes_received < 0) {
-        FatalError("recv() failed for PULL response file bytes");
-      } else if (bytes_received == 0) {
-        FatalError("Server disconnected while sending PULL response file bytes.");
+  uint32_t length = 0;
+  for (uint8_t byte : length_buffer) {
+    length = (length << 8) | byte;
+  }
+  if (length == 0 || length > protocol::kMaxCompressedBlockSize) {
+    FatalError("Malformed compressed block in " + what);
+  }
+
+  this->inflate_block_.resize(length);
+  this->inflate_offset_ = 0;
+  ReceiveSocket(this->inflate_block_.data(), length, what);
+}
+
+void ClientApp::ReceiveSocket(void* buffer, size_t size, const std::string& what) {
+  size_t total_bytes_received = 0;
+
+  while (total_bytes_received < size) {
+    ssize_t bytes_received = recv(this->client_socket_, static_cast<uint8_t*>(buffer) + total_bytes_received, size - total_bytes_received, 0);
+
+    if (bytes_received < 0) {
+      FatalError("recv() failed for " + what);
+    } else if (bytes_received == 0) {
+      FatalError("Server disconnected while sending " + what);
+    }
+
+    total_bytes_received += bytes_received;
+  }
+}
+
+// Reads a file hash in the connection's wire format and returns how many bytes it took
+size_t ClientApp::ReceiveHash(protocol::Digest& hash) {
+  if (this->protocol_version_ >= protocol::kProtocolV2) {
+    ReceiveAll(hash.data(), hash.size(), "PULL file hash");
+    return hash.size();
+  }
+
+  uint8_t hash_length;
+  ReceiveAll(&hash_length, sizeof(hash_length), "PULL file hash length");
+  std::string hex(hash_length, '\0');
+  ReceiveAll(hex.data(), hash_length, "PULL file hash");
+
+  if (!DigestFromHex(hex, hash)) {
+    FatalError("PULL response carries a malformed hash");
+  }
+  return 1 + hash_length;
+}
+
+// Reads the name, hash and size that start PULL and DELTA responses and
+// returns how many bytes they took
+uint64_t ClientApp::ReceiveFilePrefix(protocol::FileHeader& file_header, uint64_t& file_size, const std::string& what) {
+  std::array<uint8_t, sizeof(uint64_t)> file_size_buffer;
+  size_t file_size_width = this->protocol_version_ >= protocol::kProtocolV2 ? sizeof(uint64_t) : sizeof(uint32_t);
+
+  ReceiveAll(&file_header.name_length, sizeof(file_header.name_length), what + " file name length");
+  file_header.name.resize(file_header.name_length);
+  ReceiveAll(file_header.name.data(), file_header.name_length, what + " file name");
+  size_t hash_width = ReceiveHash(file_header.hash);
+  ReceiveAll(file_size_buffer.data(), file_size_width, what + " file size");
+
+  file_size = 0;
+  for (size_t i = 0; i < file_size_width; i++) {
+    file_size = (file_size << 8) | file_size_buffer[i];
+  }
+
+  if (!IsValidFileName(file_header.name)) {
+    FatalError(what + " response carries an invalid file name: " + file_header.name);
+  }
+
+  return 1 + file_header.name_length + hash_width + file_size_width;
+}
+
+// Reads the offset and length that follow the file prefix in PULL_RANGE responses
+size_t ClientApp::ReceiveRange(uint64_t& offset, uint64_t& length) {
+  std::array<uint8_t, 2 * sizeof(uint64_t)> range_buffer;
+  ReceiveAll(range_buffer.data(), range_buffer.size(), "PULL_RANGE range");
+
+  offset = length = 0;
+  for (size_t i = 0; i < sizeof(uint64_t); i++) {
+    offset = (offset << 8) | range_buffer[i];
+    length = (length << 8) | range_buffer[sizeof(uint64_t) + i];
+  }
+
+  return range_buffer.size();
+}
+
+// Streams one PULL or PULL_RANGE response to disk through a fixed-size buffer,
+// so memory use does not depend on the file size. The body goes to a .part file
+// that is only renamed into place once its hash matches the one announced by
+// the server. A range continues `resume` unless the server restarted at 0.
+void ClientApp::ReceiveFile(const protocol::MessageHeader& header, const std::filesystem::path& data_dir, Download* resume) {
+  bool ranged = header.command == protocol::Command::PULL_RANGE;
+  std::string what = ranged ? "PULL_RANGE" : "PULL";
+  protocol::FileHeader file_header;
+  uint64_t file_size;
+  uint64_t prefix_size = ReceiveFilePrefix(file_header, file_size, what);
+  uint64_t offset = 0;
+  uint64_t length = file_size;
+
+  if (ranged) {
+    prefix_size += ReceiveRange(offset, length);
+  }
+
+  if (prefix_size + length != header.payload_size || offset + length != file_size) {
+    FatalError(what + " response size mismatch for " + file_header.name);
+  }
+
+  Download download;
+  if (offset == 0) {
+    if (resume) {
+      resume->out.close();
+    }
+    download = StartDownload(file_header, data_dir);
+  } else if (resume && resume->file.name == file_header.name && resume->written == offset) {
+    download = std::move(*resume);
+  } else {
+    FatalError("PULL_RANGE response resumes " + file_header.name + " at an unexpected offset");
+  }
+  download.file = file_header;
+
+  // Body: socket -> chunk buffer -> file, hashing along the way
+  uint64_t remaining = length;
+
+  while (remaining > 0) {
+    size_t chunk_size = std::min<size_t>(remaining, this->chunk_buffer_.size());
+    ReceiveAll(this->chunk_buffer_.data(), chunk_size, what + " file bytes");
+    WriteChunk(download, chunk_size);
+    remaining -= chunk_size;
+  }
+
+  CommitFile(download);
+  std::cout << "Received and wrote file: " << file_header.name << " (" << length << " of " << file_size << " bytes)" << "\n";
+}
+
+// Rebuilds a file from a DELTA response: COPY instructions read blocks of the
+// stale local copy, LITERAL ones stream their bytes from the socket. The result
+// is verified and committed exactly like a PULLed file.
+void ClientApp::ReceiveDelta(uint64_t payload_size, const std::filesystem::path& data_dir, uint32_t block_size) {
+  protocol::FileHeader file_header;
+  uint64_t file_size;
+  uint64_t prefix_size = ReceiveFilePrefix(file_header, file_size, "DELTA");
+
+  std::array<uint8_t, sizeof(uint32_t)> count_buffer;
+  ReceiveAll(count_buffer.data(), count_buffer.size(), "DELTA instruction count");
+  uint32_t instruction_count = (count_buffer[0] << 24) | (count_buffer[1] << 16) | (count_buffer[2] << 8) | count_buffer[3];
+
+  // Every instruction rebuilds at least one byte and is part of the payload,
+  // so a count beyond either bound is rejected before anything is allocated
+  uint64_t instructions_size = static_cast<uint64_t>(instruction_count) * protocol::kDeltaInstructionSize;
+  if (instruction_count > file_size || prefix_size + count_buffer.size() + instructions_size > payload_size) {
+    FatalError("DELTA response announces too many instructions for " + file_header.name);
+  }
+
+  std::vector<uint8_t> instruction_buffer(static_cast<size_t>(instruction_count) * protocol::kDeltaInstructionSize);
+  ReceiveAll(instruction_buffer.data(), instruction_buffer.size(), "DELTA instructions");
+  std::optional<std::vector<protocol::DeltaInstruction>> parsed = protocol::DeserializeDeltaInstructions(instruction_buffer);
+  if (!parsed) {
+    FatalError("Malformed DELTA instructions");
+  }
+  std::vector<protocol::DeltaInstruction>& instructions = *parsed;
+
+  std::filesystem::path base_path = data_dir / file_header.name;
+  uint64_t base_blocks = std::filesystem::file_size(base_path) / block_size;
+  uint64_t literal_bytes = 0;
+  uint64_t rebuilt_size = 0;
+
+  // Lengths are checked against what is left of the file as they are added up, so no sum can overflow
+  for (const auto &instruction : instructions) {
+    if (instruction.op == protocol::DeltaOp::LITERAL) {
+      if (instruction.length > file_size - rebuilt_size) {
+        FatalError("DELTA response rebuilds more than the size of " + file_header.name);
       }
+      literal_bytes += instruction.length;
+      rebuilt_size += instruction.length;
+    } else if (instruction.offset > base_blocks || instruction.length > base_blocks - instruction.offset) {
+      FatalError("DELTA response copies past the end of " + file_header.name);
+    } else if (instruction.length * block_size > file_size - rebuilt_size) {
+      FatalError("DELTA response rebuilds more than the size of " + file_header.name);
+    } else {
+      rebuilt_size += instruction.length * block_size;
+    }
+  }
+
+  if (prefix_size + count_buffer.size() + instruction_buffer.size() + literal_bytes != payload_size || rebuilt_size != file_size) {
+    FatalError("DELTA response size mismatch for " + file_header.name);
+  }
+
+  std::ifstream base(base_path, std::ios::binary);
+  if (!base) {
+    FatalError("Failed to open file for reading: " + base_path.string());
+  }
 
-      total_bytes_received += bytes_received;
+  Download download = StartDownload(file_header, data_dir);
+
+  for (const auto &instruction : instructions) {
+    bool copy = instruction.op == protocol::DeltaOp::COPY;
+    uint64_t remaining = copy ? instruction.length * block_size : instruction.length;
+
+    if (copy) {
+      base.seekg(instruction.offset * block_size);
     }
 
-    protocol::FileContents file = protocol::DeserializeFileContents(receive_buffer);
+    while (remaining > 0) {
+      size_t chunk_size = std::min<size_t>(remaining, this->chunk_buffer_.size());
 
-    // Initialize data directory
-    std::filesystem::path data_dir = std::filesystem::current_path() / "client" / "files";
-    WriteFileBytes(file, data_dir);
+      if (!copy) {
+        ReceiveAll(this->chunk_buffer_.data(), chunk_size, "DELTA literal bytes");
+      } else if (!base.read(reinterpret_cast<char *>(this->chunk_buffer_.data()), chunk_size)) {
+        FatalError("Failed to read from file: " + base_path.string());
+      }
 
-    std::cout << "Received and wrote file: " << file.header.name << "\n";
+      WriteChunk(download, chunk_size);
+      remaining -= chunk_size;
+    }
   }
+
+  base.close();
+  CommitFile(download);
+  std::cout << "Rebuilt file from delta: " << file_header.name << " (" << literal_bytes << " of " << file_size << " bytes transferred)" << "\n";
 }
 
-void ClientApp::HandleLeave() {
+static std::filesystem::path ProgressPath(const std::filesystem::path& part_path) {
+  std::filesystem::path progress_path = part_path;
+  progress_path += ".progress";
+  return progress_path;
+}
+
+// Starts receiving `file` from its first byte, dropping any earlier partial download
+ClientApp::Download ClientApp::StartDownload(const protocol::FileHeader& file, const std::filesystem::path& data_dir) {
+  std::filesystem::create_directories(data_dir);
+
+  Download download;
+  download.file = file;
+  download.part_path = data_dir / ("." + file.name + ".part");
+
+  std::error_code ec;
+  std::filesystem::remove(ProgressPath(download.part_path), ec);
+
+  download.out.open(download.part_path, std::ios::binary | std::ios::trunc);
+  if (!download.out) {
+    FatalError("Failed to open file for writing: " + download.part_path.string());
+  }
+  return download;
+}
+
+// Picks up an interrupted download of `file`. The .part file must still start
+// with the prefix its sidecar vouches for; anything written after the last
+// checkpoint is cut off. Returns nothing (and cleans up) if there is nothing
+// usable to resume, including when the server's file changed since.
+std::optional<ClientApp::Download> ClientApp::ResumeDownload(const protocol::FileHeader& file, const std::filesystem::path& data_dir) {
+  Download download;
+  download.file = file;
+  download.part_path = data_dir / ("." + file.name + ".part");
+  std::filesystem::path progress_path = ProgressPath(download.part_path);
+
+  std::ifstream progress(progress_path);
+  if (!progress) {
+    return std::nullopt;
+  }
+
+  // Sidecar: file hash, verified length, hash of that many leading bytes
+  std::string file_hash_hex;
+  std::string prefix_hash_hex;
+  protocol::Digest file_hash;
+  protocol::Digest prefix_hash;
+  uint64_t written = 0;
+  bool usable = (progress >> file_hash_hex >> written >> prefix_hash_hex) && DigestFromHex(file_hash_hex, file_hash) &&
+                DigestFromHex(prefix_hash_hex, prefix_hash) && file_hash == file.hash && written > 0;
+  progress.close();
+
+  std::ifstream part(download.part_path, std::ios::binary);
+  for (uint64_t remaining = written; usable && remaining > 0;) {
+    size_t chunk_size = std::min<size_t>(remaining, this->chunk_buffer_.size());
+    usable = static_cast<bool>(part.read(reinterpret_cast<char *>(this->chunk_buffer_.data()), chunk_size));
+    download.sha256.add(this->chunk_buffer_.data(), chunk_size);
+    remaining -= chunk_size;
+  }
+  part.close();
+
+  protocol::Digest digest;
+  download.sha256.getHash(digest.data());
+
+  std::error_code ec;
+  if (!usable || digest != prefix_hash) {
+    std::filesystem::remove(download.part_path, ec);
+    std::filesystem::remove(progress_path, ec);
+    return std::nullopt;
+  }
+
+  std::filesystem::resize_file(download.part_path, written, ec);
+  download.out.open(download.part_path, std::ios::binary | std::ios::app);
+  if (ec || !download.out) {
+    FatalError("Failed to reopen partial download: " + download.part_path.string());
+  }
+
+  download.written = download.checkpoint = written;
+  return download;
+}
+
+// Hashes and appends the first `size` bytes of the chunk buffer to the download
+void ClientApp::WriteChunk(Download& download, size_t size) {
+  download.sha256.add(this->chunk_buffer_.data(), size);
+
+  if (!download.out.write(reinterpret_cast<const char *>(this->chunk_buffer_.data()), size)) {
+    FatalError("Failed to write to file: " + download.part_path.string());
+  }
+
+  download.written += size;
+  if (download.written - download.checkpoint >= kProgressInterval) {
+    SaveProgress(download);
+  }
+}
+
+// Flushes the .part file and records how much of it is complete. The sidecar
+// is replaced atomically so a crash leaves either the old or the new checkpoint.
+void ClientApp::SaveProgress(Download& download) {
+  if (!download.out.flush()) {
+    FatalError("Failed to write to file: " + download.part_path.string());
+  }
+
+  WriteProgress(download.part_path, download.file.hash, download.written, download.sha256);
+  download.checkpoint = download.written;
+}
+
+// Records that the first `written` bytes of a .part file are complete and hash
+// to what `sha256` has seen so far
+void ClientApp::WriteProgress(const std::filesystem::path& part_path, const protocol::Digest& file_hash, uint64_t written, SHA256& sha256) {
+  protocol::Digest prefix_hash;
+  sha256.getHash(prefix_hash.data());
+
+  std::filesystem::path progress_path = ProgressPath(part_path);
+  std::filesystem::path temp_path = progress_path;
+  temp_path += ".tmp";
+
+  std::ofstream progress(temp_path, std::ios::trunc);
+  progress << DigestToHex(file_hash) << " " << written << " " << DigestToHex(prefix_hash) << "\n";
+  progress.close();
+
+  std::error_code ec;
+  if (progress) {
+    std::filesystem::rename(temp_path, progress_path, ec);
+  }
+}
+
+// Moves a fully written .part file into place once its hash checks out
+void ClientApp::CommitFile(Download& download) {
+  download.out.close();
+  if (!download.out) {
+    FatalError("Failed to write to file: " + download.part_path.string());
+  }
+
+  protocol::Digest digest;
+  download.sha256.getHash(digest.data());
+
+  std::error_code ec;
+  std::filesystem::remove(ProgressPath(download.part_path), ec);
+
+  if (digest != download.file.hash) {
+    std::filesystem::remove(download.part_path);
+    FatalError("Hash mismatch for received file: " + download.file.name);
+  }
+
+  std::filesystem::rename(download.part_path, download.part_path.parent_path() / download.file.name);
+}
+
+// Downloads a file as PULL_RANGE segments over extra connections into a
+// preallocated .part file. It starts with kInitialConnections and keeps adding
+// one per probe while that still raises throughput by a tenth, which finds
+// roughly how many streams the path needs. Meanwhile the prefix whose segments
+// have all landed is hashed and checkpointed like a sequential download, so an
+// interrupted parallel download resumes from there.
+void ClientApp::PullParallel(const protocol::FileHeader& file, uint64_t size, const std::filesystem::path& data_dir) {
+  std::filesystem::create_directories(data_dir);
+  std::filesystem::path part_path = data_dir / ("." + file.name + ".part");
+  std::error_code ec;
+  std::filesystem::remove(ProgressPath(part_path), ec);
+
+  ParallelDownload download {
+    .file = file,
+    .size = size,
+    .fd = open(part_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644),
+    .segment_count = (size + kSegmentSize - 1) / kSegmentSize,
+    .segment_done = std::vector<std::atomic<bool>>((size + kSegmentSize - 1) / kSegmentSize)
+  };
+
+  if (download.fd < 0) {
+    FatalError("Failed to open file for writing: " + part_path.string());
+  }
+
+  // Reserve the whole file up front so out-of-order writes neither fragment it
+  // nor run out of space halfway through
+#if defined(__linux__)
+  if (fallocate(download.fd, 0, 0, download.size) < 0 && errno != EOPNOTSUPP) {
+    FatalError("fallocate() failed for " + part_path.string());
+  }
+#elif defined(F_PREALLOCATE)
+  fstore_t store { .fst_flags = F_ALLOCATEALL, .fst_posmode = F_PEOFPOSMODE, .fst_offset = 0, .fst_length = static_cast<off_t>(download.size), .fst_bytesalloc = 0 };
+  fcntl(download.fd, F_PREALLOCATE, &store);
+#endif
+  if (ftruncate(download.fd, download.size) < 0) {
+    FatalError("ftruncate() failed for " + part_path.string());
+  }
+
+  std::vector<std::thread> connections;
+  auto add_connection = [this, &connections, &download]() {
+    connections.emplace_back([this, &download]() {
+      ClientApp connection(ConnectToServer(this->server_address_), this->server_address_);
+      connection.Handshake();
+      connection.ReceiveSegments(download);
+      connection.SendMessage(protocol::Command::LEAVE, {}, "LEAVE command");
+      close(connection.client_socket_);
+    });
+  };
+
+  auto start = std::chrono::steady_clock::now();
+  while (connections.size() < kInitialConnections) {
+    add_connection();
+  }
+
+  // Hashes the segments that now continue the complete prefix, reading them back from the page cache
+  SHA256 sha256;
+  uint64_t verified = 0;
+  uint64_t checkpoint = 0;
+  uint64_t contiguous = 0;
+  auto advance = [&]() {
+    while (contiguous < download.segment_count && download.segment_done[contiguous].load(std::memory_order_acquire)) {
+      contiguous++;
+    }
+
+    uint64_t end = std::min(contiguous * kSegmentSize, size);
+    while (verified < end) {
+      size_t chunk_size = std::min<uint64_t>(end - verified, this->chunk_buffer_.size());
+      ssize_t bytes_read = pread(download.fd, this->chunk_buffer_.data(), chunk_size, verified);
+      if (bytes_read <= 0) {
+        if (bytes_read < 0 && errno == EINTR) {
+          continue;
+        }
+        FatalError("pread() failed for " + part_path.string());
+      }
+      sha256.add(this->chunk_buffer_.data(), bytes_read);
+      verified += bytes_read;
+    }
+
+    if (verified - checkpoint >= kProgressInterval && verified < size) {
+      WriteProgress(part_path, file.hash, verified, sha256);
+      checkpoint = verified;
+    }
+  };
+
+  uint64_t last_received = 0;
+  uint64_t last_rate = 0;
+  bool growing = true;
+
+  while (download.received.load() < download.size) {
+    std::this_thread::sleep_for(kProbeInterval);
+    advance();
+    uint64_t received = download.received.load();
+    uint64_t rate = received - last_received;
+
+    if (growing && connections.size() < kMaxConnections && download.next_segment.load() < download.segment_count) {
+      if (rate > last_rate + last_rate / 10) {
+        add_connection();
+      } else {
+        growing = false;
+      }
+    }
+
+    last_received = received;
+    last_rate = rate;
+  }
+
+  for (auto &connection : connections) {
+    connection.join();
+  }
+  advance();
+  close(download.fd);
+
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+  protocol::Digest digest;
+  sha256.getHash(digest.data());
+  std::filesystem::remove(ProgressPath(part_path), ec);
+
+  if (digest != file.hash) {
+    std::filesystem::remove(part_path);
+    FatalError("Hash mismatch for received file: " + file.name);
+  }
+
+  std::filesystem::rename(part_path, data_dir / file.name);
+  std::cout << "Received file over " << connections.size() << " connections: " << file.name << " (" << size << " bytes, "
+            << static_cast<uint64_t>(size / elapsed.count() / (1024 * 1024)) << " MiB/s)" << "\n";
+}
+
+// Fetches segments of a parallel download until none are left, keeping the
+// next request queued at the server while the current segment is received
+void ClientApp::ReceiveSegments(ParallelDownload& download) {
+  auto request_next = [this, &download]() -> std::optional<uint64_t> {
+    uint64_t segment = download.next_segment.fetch_add(1);
+    if (segment >= download.segment_count) {
+      return std::nullopt;
+    }
+
+    uint64_t offset = segment * kSegmentSize;
+    protocol::PullRangeRequest request;
+    request.files.push_back({ .header = download.file, .offset = offset, .length = std::min(kSegmentSize, download.size - offset) });
+    SendMessage(protocol::Command::PULL_RANGE, protocol::SerializePullRangeRequest(request, this->protocol_version_), "PULL_RANGE request");
+    return segment;
+  };
+
+  std::optional<uint64_t> current = request_next();
+
+  while (current) {
+    std::optional<uint64_t> next = request_next();
+
+    protocol::MessageHeader header = ReceiveHeader("PULL_RANGE response header");
+    protocol::FileHeader file_header;
+    uint64_t file_size;
+    uint64_t offset;
+    uint64_t length;
+    uint64_t prefix_size = ReceiveFilePrefix(file_header, file_size, "PULL_RANGE");
+    prefix_size += ReceiveRange(offset, length);
+
+    uint64_t expected_offset = *current * kSegmentSize;
+    if (header.command != protocol::Command::PULL_RANGE || prefix_size + length != header.payload_size ||
+        file_header.hash != download.file.hash || file_size != download.size || offset != expected_offset ||
+        length != std::min(kSegmentSize, download.size - expected_offset)) {
+      FatalError(download.file.name + " changed on the server during a parallel download");
+    }
+
+    for (uint64_t done = 0; done < length;) {
+      size_t chunk_size = std::min<uint64_t>(length - done, this->chunk_buffer_.size());
+      ReceiveAll(this->chunk_buffer_.data(), chunk_size, "PULL_RANGE file bytes");
+
+      for (size_t written = 0; written < chunk_size;) {
+        ssize_t bytes_written = pwrite(download.fd, this->chunk_buffer_.data() + written, chunk_size - written, offset + done + written);
+        if (bytes_written < 0 && errno != EINTR) {
+          FatalError("pwrite() failed for " + download.file.name);
+        }
+        written += std::max<ssize_t>(bytes_written, 0);
+      }
+
+      done += chunk_size;
+      download.received.fetch_add(chunk_size);
+    }
+
+    download.segment_done[*current].store(true, std::memory_order_release);
+    current = next;
+  }
+}
+
+// Streams one local file to the server as a PUSH message through the chunk
+// buffer. The hash is the one computed during DIFF; the server verifies it.
+void ClientApp::SendFile(const protocol::FileHeader& file_header, const std::filesystem::path& data_dir) {
+  std::filesystem::path file_path = data_dir / file_header.name;
+  std::ifstream in(file_path, std::ios::binary);
+  if (!in) {
+    FatalError("Failed to open file for reading: " + file_path.string());
+  }
+
+  uint64_t file_size = std::filesystem::file_size(file_path);
+  std::vector<uint8_t> prefix = protocol::SerializeFileContentsPrefix(file_header, file_size, this->protocol_version_);
+
   protocol::MessageHeader header {
-    .command = protocol::Command::LEAVE,
-    .payload_size = 0
+    .command = protocol::Command::PUSH,
+    .payload_size = prefix.size() + file_size
   };
-  std::array<uint8_t, 5> serialized_header = protocol::SerializeHeader(header);
 
-  if (send(this->client_socket_, serialized_header.data(), serialized_header.size(), 0) != serialized_header.size()) {
-    FatalError("send() failed for LEAVE command");
+  std::array<uint8_t, protocol::kMaxHeaderSize> header_buffer;
+  protocol::SerializeHeader(header, this->protocol_version_, header_buffer.data());
+
+  std::array<iovec, 2> iov {{
+    { header_buffer.data(), protocol::HeaderSize(this->protocol_version_) },
+    { prefix.data(), prefix.size() }
+  }};
+  SendAll(iov.data(), iov.size(), "PUSH header");
+
+  // Body: file -> chunk buffer -> socket
+  uint64_t remaining = file_size;
+
+  while (remaining > 0) {
+    size_t chunk_size = std::min<size_t>(remaining, this->chunk_buffer_.size());
+
+    if (!in.read(reinterpret_cast<char *>(this->chunk_buffer_.data()), chunk_size)) {
+      FatalError("Failed to read from file: " + file_path.string());
+    }
+    SendAll(this->chunk_buffer_.data(), chunk_size, "PUSH file bytes");
+    remaining -= chunk_size;
   }
+}
+
+void ClientApp::HandleLeave() {
+  SendMessage(protocol::Command::LEAVE, {}, "LEAVE command");
 
   if (close(this->client_socket_) < 0) {
     FatalError("close() failed");
@@ -230,34 +1646,24 @@ void ClientApp::HandleLeave() {
 }
 
 int main(int argc, char *argv[]) {
-  unsigned int client_socket;
   sockaddr_in server_address;
   const std::string server_ip_address = "127.0.0.1";
   const unsigned int server_port = 9090;
   int option;
 
-  // Create a new TCP socket
-  if ((client_socket = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0) {
-    FatalError("socket() failed");
-  }
-
-  // Initialize the client application
-  ClientApp client = ClientApp(client_socket);
-
   // Construct the server address structure
   server_address.sin_family      = AF_INET;
   server_address.sin_port        = htons(server_port);
   server_address.sin_addr.s_addr = inet_addr(server_ip_address.c_str());
 
-  // Connect to the server
-  if (connect(client_socket, (sockaddr *)&server_address, sizeof(server_address)) < 0) {
-    FatalError("connect() failed");
-  }
+  // Initialize the client application; parallel downloads open more connections to the same address
+  ClientApp client = ClientApp(ConnectToServer(server_address), server_address);
 
+  client.Handshake();
   std::cout << "Welcome to MyMusic!" << "\n";
 
   while (true) {
-    std::cout << "\nSelect an option:\n1. LIST\n2. DIFF\n3. PULL\n4. LEAVE" << "\n";
+    std::cout << "\nSelect an option:\n1. LIST\n2. DIFF\n3. PULL\n4. LEAVE\n5. PUSH" << "\n";
     std::cin >> option;
 
     switch (option) {
@@ -281,6 +1687,11 @@ int main(int argc, char *argv[]) {
         client.HandleLeave();
         break;
       }
+      case 5: {
+        // PUSH
+        client.HandlePush();
+        break;
+      }
       default:
         std::cout << "Invalid option. Please try again." << "\n";
         continue;
@@ -1,53 +1,315 @@
 #pragma once
 
 #include <iostream>
+#include <memory_resource>
 #include <string>
+#include <string_view>
+#include <span>
 #include <array>
 #include <vector>
+#include <cstdint>
 #include <sys/types.h>
 
+// Wire format
+//
+// Every message starts with a header: command (1 byte) followed by the payload
+// size, big endian. All other multi-byte integers are big endian as well.
+//
+//   v1: 4-byte payload size, 1-byte file counts, 4-byte file sizes,
+//       hashes as a length byte followed by 64 hex characters
+//   v2: 8-byte payload size, 4-byte file counts, 8-byte file sizes,
+//       hashes as the raw 32-byte SHA-256 digest
+//
+// Connections start out in v1. A client that speaks v2 opens with a HELLO whose
+// payload_size field carries its highest version and which has no payload, so
+// a v1 server simply skips it. A server that understands HELLO answers with a
+// v1 HELLO carrying the negotiated version, and both sides switch framing after
+// that exchange. Names stay limited to 255 bytes (NAME_MAX) in both versions.
+//
+// PUSH (v2 only) uploads one file per message, laid out like a PULL response.
+// The server answers each one with a PUSH message whose one-byte payload is a
+// PushStatus.
+//
+// DELTA (v2 only) pulls a file the client holds an older copy of. The request
+// is the file header, a 4-byte block size, a 4-byte block count and one
+// BlockSignature per full block of the client's copy (4-byte weak checksum,
+// truncated SHA-256). The response is the file header, its 8-byte size, a
+// 4-byte instruction count, 9-byte instructions (op, then two 4-byte fields
+// for COPY or an 8-byte length for LITERAL) and finally all literal bytes.
+//
+// CHUNKS and FETCH (v2 only) transfer a file by content-defined chunks. A
+// CHUNKS request is a file header; the response is the file header, its 8-byte
+// size, a 4-byte chunk count and per chunk its digest and 4-byte length. The
+// client then sends FETCH with a 4-byte count and the digests of the chunks it
+// does not hold yet; the response payload is those chunks' bytes, concatenated
+// in request order. A file the server has not chunked (yet) comes back with
+// size 0 and no chunks, and the client PULLs it instead.
+//
+// PULL_RANGE (v2 only) is a PULL that asks for part of each file: every file
+// header is followed by an 8-byte offset and an 8-byte length (0 means up to
+// the end). Each file comes back as its own PULL_RANGE message: the file header
+// and full 8-byte size, then the offset and length actually sent and those
+// bytes. The server only honours an offset when the requested hash is still the
+// file's content, so a client resuming a stale download starts over at 0.
+//
+// Compression (v2 only) is offered by setting kHelloZstd in the HELLO
+// payload_size, above the version byte, and is on when the server's reply
+// echoes it. The server then sets kCompressedFlag in the command byte of LIST,
+// LIST_SINCE, PULL, PULL_RANGE, DELTA and FETCH responses it compresses. Such a message's payload_size is
+// still the size of the plain payload, which travels as a single zstd frame
+// cut into blocks: a 4-byte length, then that many bytes of the frame.
+//
+// Batched LIST (v2 only) is negotiated the same way with kHelloListBatches. The
+// server then answers LIST with a series of LIST messages, each an ordinary
+// LIST payload holding the next batch of entries (compressed on its own where
+// compression is on), and ends the series with one that has no entries. All
+// batches come from one catalog snapshot, so a client can diff each of them
+// as it arrives instead of holding the whole catalog.
+//
+// LIST_SINCE (v2 only, negotiated with kHelloListSince) asks for what changed
+// in the catalog since an earlier LIST_SINCE response. The request is the
+// 8-byte epoch and 8-byte version of that response (zeroes for a first sync).
+// The response starts with the server's current epoch and version and a
+// ListSinceKind byte. CHANGES is followed by a 4-byte count and that many
+// changes, oldest first: a ChangeOp byte and a file header (a removed file
+// with the hash it had). FULL is followed by a LIST payload of the whole
+// catalog; the server falls back to it when the epoch differs (it restarted)
+// or its change log no longer reaches back to the requested version.
 namespace protocol {
   constexpr uint16_t kReceiveBufferSize = 512;
   constexpr uint16_t kSendBufferSize    = 512;
   constexpr uint8_t  kSha256HexLen      = 64;
+  constexpr size_t   kSha256Bytes       = 32;
+  constexpr size_t   kDeltaStrongBytes  = 8;
+  constexpr size_t   kDeltaInstructionSize = 9;
+
+  // Raw SHA-256 digest; converted to hex only for display and v1 peers
+  using Digest = std::array<uint8_t, kSha256Bytes>;
+
+  constexpr uint8_t kProtocolV1      = 1;
+  constexpr uint8_t kProtocolV2      = 2;
+  constexpr uint8_t kProtocolVersion = kProtocolV2;
+
+  constexpr size_t kHeaderSizeV1 = 5;
+  constexpr size_t kHeaderSizeV2 = 9;
+  constexpr size_t kMaxHeaderSize = kHeaderSizeV2;
+
+  constexpr size_t HeaderSize(uint8_t version) {
+    return version >= kProtocolV2 ? kHeaderSizeV2 : kHeaderSizeV1;
+  }
+
+  constexpr uint64_t kHelloVersionMask = 0xff;
+  constexpr uint64_t kHelloZstd        = 1 << 8;
+  constexpr uint64_t kHelloListBatches = 1 << 9;
+  constexpr uint64_t kHelloListSince   = 1 << 10;
+  constexpr uint8_t  kCompressedFlag   = 0x80;
+  constexpr uint32_t kMaxCompressedBlockSize = 1 << 20;
 
   enum class Command : uint8_t {
     LIST = 1,
     DIFF = 2,
     PULL = 3,
-    LEAVE = 4
+    LEAVE = 4,
+    HELLO = 5,
+    PUSH = 6,
+    DELTA = 7,
+    CHUNKS = 8,
+    FETCH = 9,
+    PULL_RANGE = 10,
+    LIST_SINCE = 11
+  };
+
+  // Command byte of a response whose payload is compressed
+  constexpr Command Compressed(Command command) {
+    return static_cast<Command>(static_cast<uint8_t>(command) | kCompressedFlag);
+  }
+
+  enum class PushStatus : uint8_t {
+    OK = 0,
+    REJECTED = 1
   };
 
   struct FileHeader {
     uint8_t name_length;
     std::string name;
-    uint8_t hash_length;
-    std::string hash;
+    Digest hash;
   };
 
   struct FileContents {
     FileHeader header;
-    uint32_t size;
+    uint64_t size;
     std::vector<uint8_t> bytes;
   };
 
+  // Counterparts of FileHeader and FileContents that point into the payload
+  // they were parsed from, valid only as long as that buffer is left untouched
+  struct FileHeaderView {
+    std::string_view name;
+    Digest hash;
+  };
+
+  struct FileContentsView {
+    FileHeaderView header;
+    uint64_t size;
+    std::span<const uint8_t> bytes;
+  };
+
+  inline FileHeader ToFileHeader(const FileHeaderView& view) {
+    return { .name_length = static_cast<uint8_t>(view.name.size()), .name = std::string(view.name), .hash = view.hash };
+  }
+
+  inline FileHeaderView ToFileHeaderView(const FileHeader& file) {
+    return { .name = file.name, .hash = file.hash };
+  }
+
   struct MessageHeader {
     Command command;
-    uint32_t payload_size;
+    uint64_t payload_size;
   };
 
-  struct ListResponse {\
-    uint8_t file_count;
+  struct ListResponse {
+    uint32_t file_count;
     std::vector<FileHeader> files;
   };
 
   struct PullRequest {
-    uint8_t file_count;
+    uint32_t file_count;
     std::vector<FileHeader> files;
   };
 
+  struct ListSinceRequest {
+    uint64_t epoch;
+    uint64_t version;
+  };
+
+  enum class ListSinceKind : uint8_t {
+    FULL = 0,
+    CHANGES = 1
+  };
+
+  // Everything in a LIST_SINCE response that precedes the files or changes
+  struct ListSincePrefix {
+    uint64_t epoch;
+    uint64_t version;
+    ListSinceKind kind;
+  };
+
+  enum class ChangeOp : uint8_t {
+    ADDED = 0,
+    MODIFIED = 1,
+    REMOVED = 2
+  };
+
+  struct CatalogChangeView {
+    ChangeOp op;
+    FileHeaderView file;
+  };
+
+  // Part of a file, [offset, offset + length); a length of 0 runs to the end
+  struct FileSpan {
+    FileHeader header;
+    uint64_t offset;
+    uint64_t length;
+  };
+
+  struct PullRangeRequest {
+    std::vector<FileSpan> files;
+  };
+
   struct PullResponse {
-    uint8_t file_count;
+    uint32_t file_count;
     std::vector<FileContents> files;
   };
-}
\ No newline at end of file
+
+  // rsync-style signature of one block: a rolling checksum that is cheap to
+  // slide over the server's file, confirmed by a truncated SHA-256
+  struct BlockSignature {
+    uint32_t weak;
+    std::array<uint8_t, kDeltaStrongBytes> strong;
+  };
+
+  struct DeltaRequest {
+    FileHeader header;
+    uint32_t block_size;
+    std::vector<BlockSignature> blocks;
+  };
+
+  enum class DeltaOp : uint8_t {
+    COPY = 0,
+    LITERAL = 1
+  };
+
+  struct DeltaInstruction {
+    DeltaOp op;
+    // COPY: first block of the client's copy; LITERAL: offset in the server's file (not sent)
+    uint64_t offset;
+    // COPY: number of blocks; LITERAL: number of bytes
+    uint64_t length;
+  };
+
+  // Literal bytes follow the instructions on the wire
+  struct DeltaResponse {
+    FileHeader header;
+    uint64_t size;
+    std::vector<DeltaInstruction> instructions;
+  };
+
+  struct ChunkInfo {
+    Digest hash;
+    uint32_t length;
+  };
+
+  // A file as the sequence of its content-defined chunks
+  struct ChunkList {
+    FileHeader header;
+    uint64_t size;
+    std::vector<ChunkInfo> chunks;
+  };
+
+  struct FetchRequest {
+    std::vector<Digest> chunks;
+  };
+
+  // Request-scoped counterparts of the structs above, for objects that all die
+  // together once a request is served. Names point into the request's payload
+  // and sequences allocate from the memory resource given to the parser,
+  // usually an arena that is released in one go afterwards.
+  namespace pmr {
+    struct FileSpan {
+      FileHeaderView header;
+      uint64_t offset;
+      uint64_t length;
+    };
+
+    struct PullRequest {
+      uint32_t file_count;
+      std::pmr::vector<FileHeaderView> files;
+    };
+
+    struct PullRangeRequest {
+      std::pmr::vector<FileSpan> files;
+    };
+
+    struct DeltaRequest {
+      FileHeaderView header;
+      uint32_t block_size;
+      std::pmr::vector<BlockSignature> blocks;
+    };
+
+    struct DeltaResponse {
+      FileHeaderView header;
+      uint64_t size;
+      std::pmr::vector<DeltaInstruction> instructions;
+    };
+
+    struct ChunkList {
+      FileHeaderView header;
+      uint64_t size;
+      std::pmr::vector<ChunkInfo> chunks;
+    };
+
+    struct FetchRequest {
+      std::pmr::vector<Digest> chunks;
+    };
+  }
+}
@@ -2,274 +2,729 @@
 #include "protocol.h"
 
 namespace protocol {
-  std::array<uint8_t, 5> SerializeHeader(const MessageHeader& header) {
-    std::array<uint8_t, 5> buffer;
-    buffer[0] = static_cast<uint8_t>(header.command);
-    uint32_t payload_size = htonl(header.payload_size);
-    std::memcpy(buffer.data() + 1, &payload_size, sizeof(payload_size));
-    return buffer;
-  }
+  namespace {
+    size_t PayloadSizeWidth(uint8_t version) {
+      return version >= kProtocolV2 ? sizeof(uint64_t) : sizeof(uint32_t);
+    }
+
+    size_t CountWidth(uint8_t version) {
+      return version >= kProtocolV2 ? sizeof(uint32_t) : sizeof(uint8_t);
+    }
 
-  MessageHeader DeserializeHeader(const std::array<uint8_t, 5>& in) {
-    if (in.size() != 5) {
-      FatalError("Invalid input size for MessageHeader deserialization");
+    size_t FileSizeWidth(uint8_t version) {
+      return version >= kProtocolV2 ? sizeof(uint64_t) : sizeof(uint32_t);
     }
 
+    // Writes the low `width` bytes of value in big endian order
+    void WriteInteger(uint8_t* out, uint64_t value, size_t width, const char* what) {
+      if (width < sizeof(value) && value >> (8 * width) != 0) {
+        FatalError(std::string(what) + " " + std::to_string(value) + " does not fit in " + std::to_string(width) + " bytes");
+      }
+
+      for (size_t i = width; i > 0; i--) {
+        *out++ = static_cast<uint8_t>(value >> (8 * (i - 1)));
+      }
+    }
+
+    void AppendInteger(std::vector<uint8_t>& out, uint64_t value, size_t width, const char* what) {
+      out.resize(out.size() + width);
+      WriteInteger(out.data() + out.size() - width, value, width, what);
+    }
+
+    uint64_t ReadInteger(const uint8_t* in, size_t width) {
+      uint64_t value = 0;
+      for (size_t i = 0; i < width; i++) {
+        value = (value << 8) | in[i];
+      }
+      return value;
+    }
+
+    void AppendFileHeader(std::vector<uint8_t>& out, const FileHeaderView& file, uint8_t version) {
+      out.push_back(static_cast<uint8_t>(file.name.size()));
+      out.insert(out.end(), file.name.begin(), file.name.end());
+
+      if (version >= kProtocolV2) {
+        out.insert(out.end(), file.hash.begin(), file.hash.end());
+      } else {
+        static const char kHexDigits[] = "0123456789abcdef";
+        out.push_back(kSha256HexLen);
+        for (uint8_t byte : file.hash) {
+          out.push_back(kHexDigits[byte >> 4]);
+          out.push_back(kHexDigits[byte & 0x0f]);
+        }
+      }
+    }
+
+    void AppendFileHeader(std::vector<uint8_t>& out, const FileHeader& file, uint8_t version) {
+      AppendFileHeader(out, ToFileHeaderView(file), version);
+    }
+
+    // Cursor over a payload received from the peer. The first problem found is
+    // reported and sticks: later reads return zeroes and empty views, so a
+    // parser only needs to check ok() once it is done
+    class Reader {
+     public:
+      Reader(std::span<const uint8_t> in, const char* what) : in_(in), what_(what) {}
+
+      bool ok() const { return !failed_; }
+      // Everything was read, or reading stopped at a problem
+      bool done() const { return failed_ || offset_ == in_.size(); }
+      size_t remaining() const { return failed_ ? 0 : in_.size() - offset_; }
+
+      void Fail(const std::string& reason) {
+        if (!failed_) {
+          std::cerr << "Invalid input for " << what_ << " deserialization: " << reason << "\n";
+          failed_ = true;
+        }
+      }
+
+      uint64_t Integer(size_t width) {
+        if (!Need(width, "not enough data")) {
+          return 0;
+        }
+
+        uint64_t value = ReadInteger(in_.data() + offset_, width);
+        offset_ += width;
+        return value;
+      }
+
+      std::span<const uint8_t> Bytes(size_t size, const char* reason) {
+        if (!Need(size, reason)) {
+          return {};
+        }
+
+        std::span<const uint8_t> bytes = in_.subspan(offset_, size);
+        offset_ += size;
+        return bytes;
+      }
+
+      void Hash(Digest& hash) {
+        std::span<const uint8_t> bytes = Bytes(kSha256Bytes, "not enough data for hash");
+        std::copy(bytes.begin(), bytes.end(), hash.begin());
+      }
+
+      FileHeaderView Header(uint8_t version) {
+        FileHeaderView file_header {};
+        std::span<const uint8_t> name_length = Bytes(1, "not enough data for file name");
+        std::span<const uint8_t> name = Bytes(name_length.empty() ? 0 : name_length[0], "file name length exceeds input size");
+        file_header.name = std::string_view(reinterpret_cast<const char*>(name.data()), name.size());
+
+        if (version >= kProtocolV2) {
+          Hash(file_header.hash);
+          return file_header;
+        }
+
+        std::span<const uint8_t> hash_length = Bytes(1, "not enough data for file hash");
+        std::span<const uint8_t> hash = Bytes(hash_length.empty() ? 0 : hash_length[0], "file hash length exceeds input size");
+        if (ok() && !DigestFromHex(std::string_view(reinterpret_cast<const char*>(hash.data()), hash.size()), file_header.hash)) {
+          Fail("malformed file hash");
+        }
+
+        return file_header;
+      }
+
+     private:
+      bool Need(size_t size, const char* reason) {
+        if (failed_) {
+          return false;
+        }
+        if (size > in_.size() - offset_) {
+          Fail(reason);
+          return false;
+        }
+        return true;
+      }
+
+      std::span<const uint8_t> in_;
+      size_t offset_ = 0;
+      const char* what_;
+      bool failed_ = false;
+    };
+
+    // A file count followed by that many file headers, as in LIST responses and PULL requests
+    template <typename Views>
+    std::optional<uint32_t> ReadFileHeaderViews(std::span<const uint8_t> in, uint8_t version, const char* what, Views& files) {
+      Reader reader(in, what);
+      files.clear();
+
+      if (in.empty()) {
+        reader.Fail("empty input");
+        return std::nullopt;
+      }
+
+      uint32_t file_count = reader.Integer(CountWidth(version));
+
+      // The count comes from the peer; never reserve more entries than the input could hold
+      size_t min_entry_size = version >= kProtocolV2 ? 1 + kSha256Bytes : 2 + kSha256HexLen;
+      files.reserve(std::min<size_t>(file_count, reader.remaining() / min_entry_size));
+
+      while (!reader.done()) {
+        files.push_back(reader.Header(version));
+      }
+
+      if (reader.ok() && files.size() != file_count) {
+        reader.Fail("expected " + std::to_string(file_count) + " files, got " + std::to_string(files.size()));
+      }
+
+      return reader.ok() ? std::optional<uint32_t>(file_count) : std::nullopt;
+    }
+
+    std::optional<std::vector<FileHeader>> ReadFileHeaders(std::span<const uint8_t> in, uint32_t& file_count, uint8_t version, const char* what) {
+      std::vector<FileHeaderView> views;
+      std::optional<uint32_t> count = ReadFileHeaderViews(in, version, what, views);
+      if (!count) {
+        return std::nullopt;
+      }
+
+      file_count = *count;
+      std::vector<FileHeader> files;
+      files.reserve(views.size());
+      for (const auto& view : views) {
+        files.push_back(ToFileHeader(view));
+      }
+      return files;
+    }
+  }
+
+  std::vector<uint8_t> SerializeHeader(const MessageHeader& header, uint8_t version) {
+    std::vector<uint8_t> out(HeaderSize(version));
+    SerializeHeader(header, version, out.data());
+    return out;
+  }
+
+  void SerializeHeader(const MessageHeader& header, uint8_t version, uint8_t* out) {
+    out[0] = static_cast<uint8_t>(header.command);
+    WriteInteger(out + 1, header.payload_size, PayloadSizeWidth(version), "Payload size");
+  }
+
+  MessageHeader DeserializeHeader(const uint8_t* in, uint8_t version) {
     MessageHeader header;
     header.command = static_cast<Command>(in[0]);
-    uint32_t payload_size;
-    std::memcpy(&payload_size, in.data() + 1, sizeof(payload_size));
-    header.payload_size = ntohl(payload_size);
-    
+    header.payload_size = ReadInteger(in + 1, PayloadSizeWidth(version));
     return header;
   }
 
-  std::vector<uint8_t> SerializeList(const ListResponse& response) {
+  std::vector<uint8_t> SerializeCount(uint32_t count, uint8_t version) {
+    std::vector<uint8_t> out;
+    AppendCount(out, count, version);
+    return out;
+  }
+
+  void AppendCount(std::vector<uint8_t>& out, uint32_t count, uint8_t version) {
+    // v1 counts are a single byte; larger catalogs wrap, as they always did
+    uint32_t wire_count = version >= kProtocolV2 ? count : count & UINT8_MAX;
+    AppendInteger(out, wire_count, CountWidth(version), "File count");
+  }
+
+  std::vector<uint8_t> SerializeListEntry(const FileHeader& file, uint8_t version) {
     std::vector<uint8_t> out;
-    out.push_back(response.file_count);
+    AppendFileHeader(out, file, version);
+    return out;
+  }
+
+  void AppendListEntry(std::vector<uint8_t>& out, const FileHeaderView& file, uint8_t version) {
+    AppendFileHeader(out, file, version);
+  }
+
+  std::vector<uint8_t> SerializeList(const ListResponse& response, uint8_t version) {
+    std::vector<uint8_t> out = SerializeCount(response.file_count, version);
 
     for (const auto& file : response.files) {
-      out.push_back(file.name_length);
-      out.insert(out.end(), file.name.begin(), file.name.end());
-      out.push_back(file.hash_length);
-      out.insert(out.end(), file.hash.begin(), file.hash.end());
+      std::vector<uint8_t> entry = SerializeListEntry(file, version);
+      out.insert(out.end(), entry.begin(), entry.end());
     }
 
     return out;
   }
 
-  ListResponse DeserializeList(const std::vector<uint8_t>& in) {
+  std::optional<ListResponse> DeserializeList(const std::vector<uint8_t>& in, uint8_t version) {
     ListResponse response;
-    
-    if (in.empty()) {
-      FatalError("Empty input for ListResponse deserialization");
+    std::optional<std::vector<FileHeader>> files = ReadFileHeaders(in, response.file_count, version, "ListResponse");
+    if (!files) {
+      return std::nullopt;
     }
+    response.files = std::move(*files);
+    return response;
+  }
 
-    size_t offset = 0;
-    uint8_t current_file_count = 0;
-    response.file_count = in[offset++];
-    response.files = std::vector<FileHeader>();
-    
-    while (offset < in.size()) {
-        uint8_t file_name_length = in[offset++];
+  std::optional<uint32_t> DeserializeListView(std::span<const uint8_t> in, uint8_t version, std::vector<FileHeaderView>& files) {
+    return ReadFileHeaderViews(in, version, "ListResponse", files);
+  }
 
-        if (offset + file_name_length > in.size()) {
-          FatalError("Invalid input for ListResponse deserialization: file name length exceeds input size");
-        }
+  std::vector<uint8_t> SerializeListSinceRequest(const ListSinceRequest& request) {
+    std::vector<uint8_t> out;
+    AppendInteger(out, request.epoch, sizeof(uint64_t), "Catalog epoch");
+    AppendInteger(out, request.version, sizeof(uint64_t), "Catalog version");
+    return out;
+  }
 
-        std::string file_name(in.begin() + offset, in.begin() + offset + file_name_length);
-        offset += file_name_length;
+  std::optional<ListSinceRequest> DeserializeListSinceRequest(std::span<const uint8_t> in) {
+    Reader reader(in, "ListSinceRequest");
+    ListSinceRequest request;
+    request.epoch = reader.Integer(sizeof(uint64_t));
+    request.version = reader.Integer(sizeof(uint64_t));
 
-        if (offset >= in.size()) {
-          FatalError("Invalid input for ListResponse deserialization: not enough data for file hash");
-        }
+    if (!reader.done()) {
+      reader.Fail("trailing data");
+    }
 
-        uint8_t file_hash_length = in[offset++];
+    return reader.ok() ? std::optional<ListSinceRequest>(request) : std::nullopt;
+  }
 
-        if (offset + file_hash_length > in.size()) {
-          FatalError("Invalid input for ListResponse deserialization: file hash length exceeds input size");
-        }
+  void AppendListSincePrefix(std::vector<uint8_t>& out, const ListSincePrefix& prefix) {
+    AppendInteger(out, prefix.epoch, sizeof(uint64_t), "Catalog epoch");
+    AppendInteger(out, prefix.version, sizeof(uint64_t), "Catalog version");
+    out.push_back(static_cast<uint8_t>(prefix.kind));
+  }
 
-        std::string file_hash(in.begin() + offset, in.begin() + offset + file_hash_length);
-        offset += file_hash_length;
+  void AppendCatalogChange(std::vector<uint8_t>& out, ChangeOp op, const FileHeaderView& file) {
+    out.push_back(static_cast<uint8_t>(op));
+    AppendFileHeader(out, file, kProtocolV2);
+  }
 
-        FileHeader file_header{
-            .name_length = file_name_length,
-            .name = file_name,
-            .hash_length = file_hash_length,
-            .hash = file_hash
-        };
+  std::optional<ListSincePrefix> DeserializeListSinceView(std::span<const uint8_t> in, std::vector<CatalogChangeView>& changes) {
+    Reader reader(in, "ListSinceResponse");
+    ListSincePrefix prefix;
+    prefix.epoch = reader.Integer(sizeof(uint64_t));
+    prefix.version = reader.Integer(sizeof(uint64_t));
+    uint8_t kind = reader.Integer(sizeof(uint8_t));
+    uint32_t count = reader.Integer(CountWidth(kProtocolV2));
 
-        response.files.push_back(file_header);
-        current_file_count++;
+    if (kind > static_cast<uint8_t>(ListSinceKind::CHANGES)) {
+      reader.Fail("unknown kind " + std::to_string(kind));
+    }
+    prefix.kind = static_cast<ListSinceKind>(kind);
+
+    // The count comes from the peer; never reserve more entries than the input could hold
+    changes.clear();
+    changes.reserve(std::min<size_t>(count, reader.remaining() / (1 + kSha256Bytes)));
+
+    while (!reader.done()) {
+      CatalogChangeView change { .op = ChangeOp::ADDED, .file = {} };
+      if (prefix.kind == ListSinceKind::CHANGES) {
+        uint8_t op = reader.Integer(sizeof(uint8_t));
+        if (op > static_cast<uint8_t>(ChangeOp::REMOVED)) {
+          reader.Fail("unknown change " + std::to_string(op));
+        }
+        change.op = static_cast<ChangeOp>(op);
+      }
+      change.file = reader.Header(kProtocolV2);
+      changes.push_back(change);
     }
 
-    if (current_file_count != response.file_count) {
-      FatalError("File count mismatch in ListResponse deserialization:"
-                 " expected " + std::to_string(response.file_count) +
-                 ", got " + std::to_string(current_file_count));
+    if (reader.ok() && changes.size() != count) {
+      reader.Fail("expected " + std::to_string(count) + " changes, got " + std::to_string(changes.size()));
     }
 
-    return response;
+    return reader.ok() ? std::optional<ListSincePrefix>(prefix) : std::nullopt;
   }
 
-  std::vector<uint8_t> SerializePullRequest(const PullRequest& request) {
+  std::vector<uint8_t> SerializePullRequest(const PullRequest& request, uint8_t version) {
     std::vector<uint8_t> out;
-    out.push_back(request.file_count);
+    AppendInteger(out, request.file_count, CountWidth(version), "File count");
 
     for (const auto& file : request.files) {
-      out.push_back(file.name_length);
-      out.insert(out.end(), file.name.begin(), file.name.end());
-      out.push_back(file.hash_length);
-      out.insert(out.end(), file.hash.begin(), file.hash.end());
+      std::vector<uint8_t> entry = SerializeListEntry(file, version);
+      out.insert(out.end(), entry.begin(), entry.end());
     }
 
     return out;
   }
 
-  PullRequest DeserializePullRequest(const std::vector<uint8_t> &in) {
+  std::optional<PullRequest> DeserializePullRequest(const std::vector<uint8_t> &in, uint8_t version) {
     PullRequest request;
-    
-    if (in.empty()) {
-      FatalError("Empty input for PullRequest deserialization");
+    std::optional<std::vector<FileHeader>> files = ReadFileHeaders(in, request.file_count, version, "PullRequest");
+    if (!files) {
+      return std::nullopt;
     }
+    request.files = std::move(*files);
+    return request;
+  }
 
-    size_t offset = 0;
-    uint8_t current_file_count = 0;
-    request.file_count = in[offset++];
-    request.files = std::vector<FileHeader>();
-    
-    while (offset < in.size()) {
-        uint8_t file_name_length = in[offset++];
+  std::optional<uint32_t> DeserializePullRequestView(std::span<const uint8_t> in, uint8_t version, std::vector<FileHeaderView>& files) {
+    return ReadFileHeaderViews(in, version, "PullRequest", files);
+  }
 
-        if (offset + file_name_length > in.size()) {
-          FatalError("Invalid input for PullRequest deserialization: file name length exceeds input size");
-        }
+  std::optional<pmr::PullRequest> DeserializePullRequest(std::span<const uint8_t> in, uint8_t version, std::pmr::memory_resource* resource) {
+    pmr::PullRequest request { .file_count = 0, .files = std::pmr::vector<FileHeaderView>(resource) };
+    std::optional<uint32_t> file_count = ReadFileHeaderViews(in, version, "PullRequest", request.files);
+    if (!file_count) {
+      return std::nullopt;
+    }
+    request.file_count = *file_count;
+    return request;
+  }
 
-        std::string file_name(in.begin() + offset, in.begin() + offset + file_name_length);
-        offset += file_name_length;
+  std::vector<uint8_t> SerializePullRangeRequest(const PullRangeRequest& request, uint8_t version) {
+    std::vector<uint8_t> out;
+    AppendInteger(out, request.files.size(), CountWidth(version), "File count");
 
-        if (offset >= in.size()) {
-          FatalError("Invalid input for PullRequest deserialization: not enough data for file hash");
-        }
+    for (const auto& span : request.files) {
+      AppendFileHeader(out, span.header, version);
+      AppendInteger(out, span.offset, sizeof(uint64_t), "Range offset");
+      AppendInteger(out, span.length, sizeof(uint64_t), "Range length");
+    }
 
-        uint8_t file_hash_length = in[offset++];
+    return out;
+  }
 
-        if (offset + file_hash_length > in.size()) {
-          FatalError("Invalid input for PullRequest deserialization: file hash length exceeds input size");
-        }
+  std::optional<PullRangeRequest> DeserializePullRangeRequest(const std::vector<uint8_t>& in, uint8_t version) {
+    std::optional<pmr::PullRangeRequest> views = DeserializePullRangeRequest(in, version, std::pmr::get_default_resource());
+    if (!views) {
+      return std::nullopt;
+    }
 
-        std::string file_hash(in.begin() + offset, in.begin() + offset + file_hash_length);
-        offset += file_hash_length;
+    PullRangeRequest request;
+    request.files.reserve(views->files.size());
+    for (const auto& span : views->files) {
+      request.files.push_back({ .header = ToFileHeader(span.header), .offset = span.offset, .length = span.length });
+    }
 
-        FileHeader file_header{
-            .name_length = file_name_length,
-            .name = file_name,
-            .hash_length = file_hash_length,
-            .hash = file_hash
-        };
+    return request;
+  }
 
-        request.files.push_back(file_header);
-        current_file_count++;
+  std::optional<pmr::PullRangeRequest> DeserializePullRangeRequest(std::span<const uint8_t> in, uint8_t version, std::pmr::memory_resource* resource) {
+    Reader reader(in, "PullRangeRequest");
+    pmr::PullRangeRequest request { .files = std::pmr::vector<pmr::FileSpan>(resource) };
+    uint64_t file_count = reader.Integer(CountWidth(version));
+
+    while (!reader.done()) {
+      pmr::FileSpan span;
+      span.header = reader.Header(version);
+      span.offset = reader.Integer(sizeof(uint64_t));
+      span.length = reader.Integer(sizeof(uint64_t));
+      request.files.push_back(span);
     }
 
-    if (current_file_count != request.file_count) {
-      FatalError("File count mismatch in ListResponse deserialization:"
-                 " expected " + std::to_string(request.file_count) +
-                 ", got " + std::to_string(current_file_count));
+    if (reader.ok() && request.files.size() != file_count) {
+      reader.Fail("file count mismatch");
     }
 
-    return request;
+    return reader.ok() ? std::optional<pmr::PullRangeRequest>(std::move(request)) : std::nullopt;
+  }
+
+  std::vector<uint8_t> SerializeRangePrefix(const FileSpan& span, uint64_t size, uint8_t version) {
+    std::vector<uint8_t> out;
+    AppendRangePrefix(out, span, size, version);
+    return out;
+  }
+
+  void AppendRangePrefix(std::vector<uint8_t>& out, const FileSpan& span, uint64_t size, uint8_t version) {
+    AppendRangePrefix(out, { .header = ToFileHeaderView(span.header), .offset = span.offset, .length = span.length }, size, version);
+  }
+
+  void AppendRangePrefix(std::vector<uint8_t>& out, const pmr::FileSpan& span, uint64_t size, uint8_t version) {
+    AppendFileContentsPrefix(out, span.header, size, version);
+    AppendInteger(out, span.offset, sizeof(uint64_t), "Range offset");
+    AppendInteger(out, span.length, sizeof(uint64_t), "Range length");
   }
 
   // Avoid serializing/deserializing all files at once, go one file at a time
-  std::vector<uint8_t> SerializePullResponse(const PullResponse& response) {
+  std::vector<uint8_t> SerializePullResponse(const PullResponse& response, uint8_t version) {
     std::vector<uint8_t> out;
-    out.push_back(response.file_count);
+    AppendInteger(out, response.file_count, CountWidth(version), "File count");
 
     for (const auto& file : response.files) {
-      out.push_back(file.header.name_length);
-      out.insert(out.end(), file.header.name.begin(), file.header.name.end());
-      out.push_back(file.header.hash_length);
-      out.insert(out.end(), file.header.hash.begin(), file.header.hash.end());
-      uint64_t file_size = htonll(file.size);
-      out.insert(out.end(), reinterpret_cast<uint8_t*>(&file_size), reinterpret_cast<uint8_t*>(&file_size) + sizeof(file_size));
-      out.insert(out.end(), file.bytes.begin(), file.bytes.end());
+      std::vector<uint8_t> contents = SerializeFileContents(file, version);
+      out.insert(out.end(), contents.begin(), contents.end());
     }
 
     return out;
   }
 
-  std::vector<uint8_t> SerializeFileContents(const FileContents& file) {
+  // Everything in a serialized FileContents that precedes the file bytes
+  std::vector<uint8_t> SerializeFileContentsPrefix(const FileHeader& header, uint64_t size, uint8_t version) {
     std::vector<uint8_t> out;
+    AppendFileContentsPrefix(out, header, size, version);
+    return out;
+  }
 
-    out.push_back(file.header.name_length);
-    out.insert(out.end(), file.header.name.begin(), file.header.name.end());
-    out.push_back(file.header.hash_length);
-    out.insert(out.end(), file.header.hash.begin(), file.header.hash.end());
-    uint32_t file_size = htonl(file.size);
-    out.insert(out.end(), reinterpret_cast<uint8_t*>(&file_size), reinterpret_cast<uint8_t*>(&file_size) + sizeof(file_size));
-    out.insert(out.end(), file.bytes.begin(), file.bytes.end());
+  void AppendFileContentsPrefix(std::vector<uint8_t>& out, const FileHeader& header, uint64_t size, uint8_t version) {
+    AppendFileContentsPrefix(out, ToFileHeaderView(header), size, version);
+  }
+
+  void AppendFileContentsPrefix(std::vector<uint8_t>& out, const FileHeaderView& header, uint64_t size, uint8_t version) {
+    AppendFileHeader(out, header, version);
+    AppendInteger(out, size, FileSizeWidth(version), "File size");
+  }
 
+  std::vector<uint8_t> SerializeFileContents(const FileContents& file, uint8_t version) {
+    std::vector<uint8_t> out = SerializeFileContentsPrefix(file.header, file.size, version);
+    out.insert(out.end(), file.bytes.begin(), file.bytes.end());
     return out;
   }
 
-  FileContents DeserializeFileContents(const std::vector<uint8_t>& in) {
+  std::optional<FileContents> DeserializeFileContents(const std::vector<uint8_t>& in, uint8_t version) {
+    std::optional<FileContentsView> view = DeserializeFileContentsView(in, version);
+    if (!view) {
+      return std::nullopt;
+    }
+    return FileContents { .header = ToFileHeader(view->header), .size = view->size,
+                          .bytes = std::vector<uint8_t>(view->bytes.begin(), view->bytes.end()) };
+  }
+
+  std::optional<FileContentsView> DeserializeFileContentsView(std::span<const uint8_t> in, uint8_t version) {
+    Reader reader(in, "FileContents");
+    FileContentsView file;
+
+    file.header = reader.Header(version);
+    file.size = reader.Integer(FileSizeWidth(version));
+
+    if (reader.ok() && reader.remaining() != file.size) {
+      reader.Fail("file size mismatch");
+    }
+
+    file.bytes = reader.Bytes(reader.remaining(), "not enough data for file bytes");
+    return reader.ok() ? std::optional<FileContentsView>(file) : std::nullopt;
+  }
+
+  std::optional<FileContents> DeserializeFileContentsPrefix(const std::vector<uint8_t>& in, uint8_t version) {
+    Reader reader(in, "FileContents prefix");
     FileContents file;
-    FileHeader file_header;
-    size_t offset = 0;
 
-    if (in.empty()) {
-      FatalError("Empty input for FileContents deserialization");
+    file.header = ToFileHeader(reader.Header(version));
+    file.size = reader.Integer(FileSizeWidth(version));
+
+    if (!reader.done()) {
+      reader.Fail("trailing bytes");
     }
 
-    file_header.name_length = in[offset++];
-    file_header.name = std::string(in.begin() + offset, in.begin() + offset + file_header.name_length);
-    offset += file_header.name_length;
-    file_header.hash_length = in[offset++];
-    file_header.hash = std::string(in.begin() + offset, in.begin() + offset + file_header.hash_length);
-    offset += file_header.hash_length;
+    return reader.ok() ? std::optional<FileContents>(std::move(file)) : std::nullopt;
+  }
 
-    file.size = ntohl(*reinterpret_cast<const uint32_t*>(in.data() + offset));
-    offset += sizeof(file.size);
+  std::vector<uint8_t> SerializeDeltaRequest(const DeltaRequest& request, uint8_t version) {
+    std::vector<uint8_t> out;
+    out.reserve(1 + request.header.name_length + kSha256Bytes + 8 + request.blocks.size() * (4 + kDeltaStrongBytes));
 
-    file.bytes = std::vector<uint8_t>(in.begin() + offset, in.end());
-    file.header = file_header;
+    AppendFileHeader(out, request.header, version);
+    AppendInteger(out, request.block_size, sizeof(uint32_t), "Block size");
+    AppendInteger(out, request.blocks.size(), sizeof(uint32_t), "Block count");
 
-    return file;
+    for (const auto& block : request.blocks) {
+      AppendInteger(out, block.weak, sizeof(uint32_t), "Weak checksum");
+      out.insert(out.end(), block.strong.begin(), block.strong.end());
+    }
+
+    return out;
   }
 
-  PullResponse DeserializePullResponse(const std::vector<uint8_t> &in) {
-    PullResponse response;
-    
-    if (in.empty()) {
-      FatalError("Empty input for PullResponse deserialization");
+  std::optional<DeltaRequest> DeserializeDeltaRequest(const std::vector<uint8_t>& in, uint8_t version) {
+    std::optional<pmr::DeltaRequest> views = DeserializeDeltaRequest(in, version, std::pmr::get_default_resource());
+    if (!views) {
+      return std::nullopt;
     }
+    return DeltaRequest { .header = ToFileHeader(views->header), .block_size = views->block_size,
+                          .blocks = std::vector<BlockSignature>(views->blocks.begin(), views->blocks.end()) };
+  }
 
-    size_t offset = 0;
-    uint8_t current_file_count = 0;
-    response.file_count = in[offset++];
-    response.files = std::vector<FileContents>();
-    
-    while (offset < in.size()) {
-      uint8_t file_name_length = in[offset++];
+  std::optional<pmr::DeltaRequest> DeserializeDeltaRequest(std::span<const uint8_t> in, uint8_t version, std::pmr::memory_resource* resource) {
+    Reader reader(in, "DeltaRequest");
+    pmr::DeltaRequest request { .header = {}, .block_size = 0, .blocks = std::pmr::vector<BlockSignature>(resource) };
 
-      if (offset + file_name_length > in.size()) {
-        FatalError("Invalid input for PullResponse deserialization: file name length exceeds input size");
-      }
+    request.header = reader.Header(version);
+    request.block_size = reader.Integer(sizeof(uint32_t));
+    uint64_t block_count = reader.Integer(sizeof(uint32_t));
+
+    if (reader.ok() && reader.remaining() != block_count * (sizeof(uint32_t) + kDeltaStrongBytes)) {
+      reader.Fail("block count mismatch");
+      return std::nullopt;
+    }
+
+    request.blocks.resize(block_count);
+    for (auto& block : request.blocks) {
+      block.weak = reader.Integer(sizeof(uint32_t));
+      std::span<const uint8_t> strong = reader.Bytes(kDeltaStrongBytes, "not enough data for block");
+      std::copy(strong.begin(), strong.end(), block.strong.begin());
+    }
+
+    return reader.ok() ? std::optional<pmr::DeltaRequest>(std::move(request)) : std::nullopt;
+  }
+
+  std::vector<uint8_t> SerializeDeltaResponsePrefix(const DeltaResponse& response, uint8_t version) {
+    std::vector<uint8_t> out;
+    AppendDeltaResponsePrefix(out, response, version);
+    return out;
+  }
 
-      std::string file_name(in.begin() + offset, in.begin() + offset + file_name_length);
-      offset += file_name_length;
+  void AppendDeltaResponsePrefix(std::vector<uint8_t>& out, const DeltaResponse& response, uint8_t version) {
+    AppendDeltaResponsePrefix(out, ToFileHeaderView(response.header), response.size, response.instructions, version);
+  }
+
+  void AppendDeltaResponsePrefix(std::vector<uint8_t>& out, const pmr::DeltaResponse& response, uint8_t version) {
+    AppendDeltaResponsePrefix(out, response.header, response.size, response.instructions, version);
+  }
+
+  void AppendDeltaResponsePrefix(std::vector<uint8_t>& out, const FileHeaderView& header, uint64_t size,
+                                 std::span<const DeltaInstruction> instructions, uint8_t version) {
+    AppendFileContentsPrefix(out, header, size, version);
+    out.reserve(out.size() + sizeof(uint32_t) + instructions.size() * kDeltaInstructionSize);
+    AppendInteger(out, instructions.size(), sizeof(uint32_t), "Instruction count");
 
-      if (offset >= in.size()) {
-        FatalError("Invalid input for PullResponse deserialization: not enough data for file hash");
+    for (const auto& instruction : instructions) {
+      out.push_back(static_cast<uint8_t>(instruction.op));
+
+      if (instruction.op == DeltaOp::COPY) {
+        AppendInteger(out, instruction.offset, sizeof(uint32_t), "Copy block");
+        AppendInteger(out, instruction.length, sizeof(uint32_t), "Copy block count");
+      } else {
+        AppendInteger(out, instruction.length, sizeof(uint64_t), "Literal length");
       }
+    }
+  }
 
-      uint8_t file_hash_length = in[offset++];
+  std::optional<std::vector<DeltaInstruction>> DeserializeDeltaInstructions(const std::vector<uint8_t>& in) {
+    Reader reader(in, "DeltaInstruction");
+    if (in.size() % kDeltaInstructionSize != 0) {
+      reader.Fail("truncated instruction");
+      return std::nullopt;
+    }
 
-      if (offset + file_hash_length > in.size()) {
-        FatalError("Invalid input for PullResponse deserialization: file hash length exceeds input size");
+    std::vector<DeltaInstruction> instructions(in.size() / kDeltaInstructionSize);
+    for (auto& instruction : instructions) {
+      instruction.op = static_cast<DeltaOp>(reader.Integer(sizeof(uint8_t)));
+
+      if (instruction.op == DeltaOp::COPY) {
+        instruction.offset = reader.Integer(sizeof(uint32_t));
+        instruction.length = reader.Integer(sizeof(uint32_t));
+      } else if (instruction.op == DeltaOp::LITERAL) {
+        instruction.offset = 0;
+        instruction.length = reader.Integer(sizeof(uint64_t));
+      } else {
+        reader.Fail("unknown op");
       }
+    }
 
-      std::string file_hash(in.begin() + offset, in.begin() + offset + file_hash_length);
-      offset += file_hash_length;
+    return reader.ok() ? std::optional<std::vector<DeltaInstruction>>(std::move(instructions)) : std::nullopt;
+  }
 
-      uint32_t file_size;
-      std::memcpy(&file_size, in.data() + offset, sizeof(file_size));
-      file_size = ntohll(file_size);
-      offset += sizeof(file_size);
+  std::vector<uint8_t> SerializeFileHeader(const FileHeader& header, uint8_t version) {
+    std::vector<uint8_t> out;
+    AppendFileHeader(out, header, version);
+    return out;
+  }
 
-      FileContents file_contents{
-        .header = {file_name_length, file_name, file_hash_length, file_hash},
-        .size = file_size,
-        .bytes = std::vector<uint8_t>(in.begin() + offset, in.begin() + offset + file_size)
-      };
+  std::optional<FileHeader> DeserializeFileHeader(const std::vector<uint8_t>& in, uint8_t version) {
+    Reader reader(in, "FileHeader");
+    FileHeader header = ToFileHeader(reader.Header(version));
 
-      offset = in.size();
-      response.files.push_back(file_contents);
-      current_file_count++;
+    if (!reader.done()) {
+      reader.Fail("trailing bytes");
     }
 
-    return response;
+    return reader.ok() ? std::optional<FileHeader>(std::move(header)) : std::nullopt;
+  }
+
+  std::vector<uint8_t> SerializeChunkList(const ChunkList& list, uint8_t version) {
+    std::vector<uint8_t> out;
+    AppendChunkList(out, list, version);
+    return out;
+  }
+
+  void AppendChunkList(std::vector<uint8_t>& out, const ChunkList& list, uint8_t version) {
+    AppendFileContentsPrefix(out, list.header, list.size, version);
+    out.reserve(out.size() + sizeof(uint32_t) + list.chunks.size() * (kSha256Bytes + sizeof(uint32_t)));
+    AppendInteger(out, list.chunks.size(), sizeof(uint32_t), "Chunk count");
+
+    for (const auto& chunk : list.chunks) {
+      out.insert(out.end(), chunk.hash.begin(), chunk.hash.end());
+      AppendInteger(out, chunk.length, sizeof(uint32_t), "Chunk length");
+    }
+  }
+
+  std::optional<ChunkList> DeserializeChunkList(const std::vector<uint8_t>& in, uint8_t version) {
+    std::optional<pmr::ChunkList> views = DeserializeChunkList(in, version, std::pmr::get_default_resource());
+    if (!views) {
+      return std::nullopt;
+    }
+    return ChunkList { .header = ToFileHeader(views->header), .size = views->size,
+                       .chunks = std::vector<ChunkInfo>(views->chunks.begin(), views->chunks.end()) };
+  }
+
+  std::optional<pmr::ChunkList> DeserializeChunkList(std::span<const uint8_t> in, uint8_t version, std::pmr::memory_resource* resource) {
+    Reader reader(in, "ChunkList");
+    pmr::ChunkList list { .header = {}, .size = 0, .chunks = std::pmr::vector<ChunkInfo>(resource) };
+
+    list.header = reader.Header(version);
+    list.size = reader.Integer(FileSizeWidth(version));
+    uint64_t chunk_count = reader.Integer(sizeof(uint32_t));
+
+    if (reader.ok() && reader.remaining() != chunk_count * (kSha256Bytes + sizeof(uint32_t))) {
+      reader.Fail("chunk count mismatch");
+      return std::nullopt;
+    }
+
+    list.chunks.resize(chunk_count);
+    for (auto& chunk : list.chunks) {
+      reader.Hash(chunk.hash);
+      chunk.length = reader.Integer(sizeof(uint32_t));
+    }
+
+    return reader.ok() ? std::optional<pmr::ChunkList>(std::move(list)) : std::nullopt;
+  }
+
+  std::vector<uint8_t> SerializeFetchRequest(const FetchRequest& request) {
+    std::vector<uint8_t> out;
+    out.reserve(sizeof(uint32_t) + request.chunks.size() * kSha256Bytes);
+    AppendInteger(out, request.chunks.size(), sizeof(uint32_t), "Chunk count");
+
+    for (const auto& chunk : request.chunks) {
+      out.insert(out.end(), chunk.begin(), chunk.end());
+    }
+
+    return out;
+  }
+
+  std::optional<FetchRequest> DeserializeFetchRequest(const std::vector<uint8_t>& in) {
+    std::optional<pmr::FetchRequest> views = DeserializeFetchRequest(in, std::pmr::get_default_resource());
+    if (!views) {
+      return std::nullopt;
+    }
+    return FetchRequest { .chunks = std::vector<Digest>(views->chunks.begin(), views->chunks.end()) };
+  }
+
+  std::optional<pmr::FetchRequest> DeserializeFetchRequest(std::span<const uint8_t> in, std::pmr::memory_resource* resource) {
+    Reader reader(in, "FetchRequest");
+    pmr::FetchRequest request { .chunks = std::pmr::vector<Digest>(resource) };
+    uint64_t chunk_count = reader.Integer(sizeof(uint32_t));
+
+    if (reader.ok() && reader.remaining() != chunk_count * kSha256Bytes) {
+      reader.Fail("chunk count mismatch");
+      return std::nullopt;
+    }
+
+    request.chunks.resize(chunk_count);
+    for (auto& chunk : request.chunks) {
+      reader.Hash(chunk);
+    }
+
+    return reader.ok() ? std::optional<pmr::FetchRequest>(std::move(request)) : std::nullopt;
+  }
+
+  std::optional<PullResponse> DeserializePullResponse(const std::vector<uint8_t> &in, uint8_t version) {
+    Reader reader(in, "PullResponse");
+    PullResponse response;
+
+    if (in.empty()) {
+      reader.Fail("empty input");
+      return std::nullopt;
+    }
+
+    response.file_count = reader.Integer(CountWidth(version));
+
+    while (!reader.done()) {
+      FileContents file_contents;
+      file_contents.header = ToFileHeader(reader.Header(version));
+      file_contents.size = reader.Integer(FileSizeWidth(version));
+
+      std::span<const uint8_t> bytes = reader.Bytes(file_contents.size, "file size exceeds input size");
+      file_contents.bytes.assign(bytes.begin(), bytes.end());
+      response.files.push_back(std::move(file_contents));
+    }
+
+    if (reader.ok() && response.files.size() != response.file_count) {
+      reader.Fail("expected " + std::to_string(response.file_count) + " files, got " + std::to_string(response.files.size()));
+    }
+
+    return reader.ok() ? std::optional<PullResponse>(std::move(response)) : std::nullopt;
   }
-}
\ No newline at end of file
+}
@@ -1,16 +1,80 @@
+#include <optional>
 #include <vector>
 #include "protocol.h"
 #include "utils/utils.h"
 
+// All functions take the protocol version negotiated for the connection (see protocol.h).
+// The Append* variants add to the end of a caller's buffer instead of returning a
+// new one, so a buffer that is cleared and reused stops allocating once it has grown.
+// The overloads taking a memory resource parse into the request-scoped protocol::pmr
+// structs: names point into `in` and everything allocated comes from `resource`.
+// Deserializers return nothing for malformed input, after logging what is wrong
+// with it, so a server can drop the one peer that sent it.
 namespace protocol {
-    std::array<uint8_t, 5> SerializeHeader(const MessageHeader& header);
-    MessageHeader DeserializeHeader(const std::array<uint8_t, 5>& in);
-    std::vector<uint8_t> SerializeList(const ListResponse& response);
-    ListResponse DeserializeList(const std::vector<uint8_t>& in);
-    std::vector<uint8_t> SerializePullRequest(const PullRequest& request);
-    PullRequest DeserializePullRequest(const std::vector<uint8_t>& in);
-    std::vector<uint8_t> SerializePullResponse(const PullResponse& response);
-    PullResponse DeserializePullResponse(const std::vector<uint8_t>& in);
-    std::vector<uint8_t> SerializeFileContents(const FileContents& file);
-    FileContents DeserializeFileContents(const std::vector<uint8_t>& in);
-}
\ No newline at end of file
+    std::vector<uint8_t> SerializeHeader(const MessageHeader& header, uint8_t version);
+    // Writes HeaderSize(version) bytes to `out`
+    void SerializeHeader(const MessageHeader& header, uint8_t version, uint8_t* out);
+    // Reads HeaderSize(version) bytes from `in`
+    MessageHeader DeserializeHeader(const uint8_t* in, uint8_t version);
+    std::vector<uint8_t> SerializeCount(uint32_t count, uint8_t version);
+    void AppendCount(std::vector<uint8_t>& out, uint32_t count, uint8_t version);
+    std::vector<uint8_t> SerializeListEntry(const FileHeader& file, uint8_t version);
+    void AppendListEntry(std::vector<uint8_t>& out, const FileHeaderView& file, uint8_t version);
+    std::vector<uint8_t> SerializeList(const ListResponse& response, uint8_t version);
+    std::optional<ListResponse> DeserializeList(const std::vector<uint8_t>& in, uint8_t version);
+    // The *View parsers return names and bytes pointing into `in`, which must
+    // outlive them. Headers go into `files`, cleared first, so a reused vector
+    // parses any number of entries without allocating. They return the file count
+    std::optional<uint32_t> DeserializeListView(std::span<const uint8_t> in, uint8_t version, std::vector<FileHeaderView>& files);
+    // LIST_SINCE is v2 only, so these take no version
+    std::vector<uint8_t> SerializeListSinceRequest(const ListSinceRequest& request);
+    std::optional<ListSinceRequest> DeserializeListSinceRequest(std::span<const uint8_t> in);
+    void AppendListSincePrefix(std::vector<uint8_t>& out, const ListSincePrefix& prefix);
+    // One entry of a CHANGES response; the catalog keeps its change log in this form
+    void AppendCatalogChange(std::vector<uint8_t>& out, ChangeOp op, const FileHeaderView& file);
+    // Parses either kind of response into `changes`, cleared first; the files
+    // of a FULL response come back as ADDED
+    std::optional<ListSincePrefix> DeserializeListSinceView(std::span<const uint8_t> in, std::vector<CatalogChangeView>& changes);
+    std::vector<uint8_t> SerializePullRequest(const PullRequest& request, uint8_t version);
+    std::optional<PullRequest> DeserializePullRequest(const std::vector<uint8_t>& in, uint8_t version);
+    std::optional<uint32_t> DeserializePullRequestView(std::span<const uint8_t> in, uint8_t version, std::vector<FileHeaderView>& files);
+    std::optional<pmr::PullRequest> DeserializePullRequest(std::span<const uint8_t> in, uint8_t version, std::pmr::memory_resource* resource);
+    std::vector<uint8_t> SerializePullResponse(const PullResponse& response, uint8_t version);
+    std::optional<PullResponse> DeserializePullResponse(const std::vector<uint8_t>& in, uint8_t version);
+    std::vector<uint8_t> SerializePullRangeRequest(const PullRangeRequest& request, uint8_t version);
+    std::optional<PullRangeRequest> DeserializePullRangeRequest(const std::vector<uint8_t>& in, uint8_t version);
+    std::optional<pmr::PullRangeRequest> DeserializePullRangeRequest(std::span<const uint8_t> in, uint8_t version, std::pmr::memory_resource* resource);
+    // Everything in a PULL_RANGE response that precedes the range's bytes
+    std::vector<uint8_t> SerializeRangePrefix(const FileSpan& span, uint64_t size, uint8_t version);
+    void AppendRangePrefix(std::vector<uint8_t>& out, const FileSpan& span, uint64_t size, uint8_t version);
+    void AppendRangePrefix(std::vector<uint8_t>& out, const pmr::FileSpan& span, uint64_t size, uint8_t version);
+    std::vector<uint8_t> SerializeFileContentsPrefix(const FileHeader& header, uint64_t size, uint8_t version);
+    void AppendFileContentsPrefix(std::vector<uint8_t>& out, const FileHeader& header, uint64_t size, uint8_t version);
+    void AppendFileContentsPrefix(std::vector<uint8_t>& out, const FileHeaderView& header, uint64_t size, uint8_t version);
+    std::vector<uint8_t> SerializeFileContents(const FileContents& file, uint8_t version);
+    std::optional<FileContents> DeserializeFileContents(const std::vector<uint8_t>& in, uint8_t version);
+    std::optional<FileContentsView> DeserializeFileContentsView(std::span<const uint8_t> in, uint8_t version);
+    // Parses only the prefix written by SerializeFileContentsPrefix; `bytes` stays empty
+    std::optional<FileContents> DeserializeFileContentsPrefix(const std::vector<uint8_t>& in, uint8_t version);
+    std::vector<uint8_t> SerializeDeltaRequest(const DeltaRequest& request, uint8_t version);
+    std::optional<DeltaRequest> DeserializeDeltaRequest(const std::vector<uint8_t>& in, uint8_t version);
+    std::optional<pmr::DeltaRequest> DeserializeDeltaRequest(std::span<const uint8_t> in, uint8_t version, std::pmr::memory_resource* resource);
+    // Everything in a DELTA response that precedes the literal bytes
+    std::vector<uint8_t> SerializeDeltaResponsePrefix(const DeltaResponse& response, uint8_t version);
+    void AppendDeltaResponsePrefix(std::vector<uint8_t>& out, const DeltaResponse& response, uint8_t version);
+    void AppendDeltaResponsePrefix(std::vector<uint8_t>& out, const pmr::DeltaResponse& response, uint8_t version);
+    void AppendDeltaResponsePrefix(std::vector<uint8_t>& out, const FileHeaderView& header, uint64_t size,
+                                   std::span<const DeltaInstruction> instructions, uint8_t version);
+    // Parses kDeltaInstructionSize bytes per instruction; LITERAL offsets are left at 0
+    std::optional<std::vector<DeltaInstruction>> DeserializeDeltaInstructions(const std::vector<uint8_t>& in);
+    // A lone file header, as sent in CHUNKS requests
+    std::vector<uint8_t> SerializeFileHeader(const FileHeader& header, uint8_t version);
+    std::optional<FileHeader> DeserializeFileHeader(const std::vector<uint8_t>& in, uint8_t version);
+    std::vector<uint8_t> SerializeChunkList(const ChunkList& list, uint8_t version);
+    void AppendChunkList(std::vector<uint8_t>& out, const ChunkList& list, uint8_t version);
+    std::optional<ChunkList> DeserializeChunkList(const std::vector<uint8_t>& in, uint8_t version);
+    std::optional<pmr::ChunkList> DeserializeChunkList(std::span<const uint8_t> in, uint8_t version, std::pmr::memory_resource* resource);
+    std::vector<uint8_t> SerializeFetchRequest(const FetchRequest& request);
+    std::optional<FetchRequest> DeserializeFetchRequest(const std::vector<uint8_t>& in);
+    std::optional<pmr::FetchRequest> DeserializeFetchRequest(std::span<const uint8_t> in, std::pmr::memory_resource* resource);
+}
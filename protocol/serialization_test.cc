@@ -0,0 +1,233 @@
+#include "serialization.h"
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <memory_resource>
+#include <new>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "protocol.h"
+
+// Counts heap allocations while the messages of a steady-state session are
+// parsed and serialized the way the server and client do it: requests into an
+// arena that is released after each one, responses appended to reused buffers.
+// Once those have grown, no message may allocate. The same session through
+// the calls that return new vectors is timed alongside for comparison.
+
+namespace {
+  std::atomic<size_t> allocations = 0;
+}
+
+void* operator new(size_t size) {
+  allocations++;
+  if (void* memory = std::malloc(size ? size : 1)) {
+    return memory;
+  }
+  throw std::bad_alloc();
+}
+
+void operator delete(void* memory) noexcept {
+  std::free(memory);
+}
+
+void operator delete(void* memory, size_t) noexcept {
+  std::free(memory);
+}
+
+namespace {
+  constexpr int kRounds = 10000;
+  // Same order of size as the server's per-connection request arena
+  constexpr size_t kArenaSize = 16 * 1024;
+
+  int failures = 0;
+
+  // Takes a view so that checking inside a measured round allocates nothing
+  void Check(bool condition, std::string_view what) {
+    if (!condition) {
+      std::cerr << "FAILED: " << what << "\n";
+      failures++;
+    }
+  }
+
+  protocol::FileHeader File(const std::string& name, uint8_t fill) {
+    protocol::FileHeader file { .name_length = static_cast<uint8_t>(name.size()), .name = name, .hash = {} };
+    file.hash.fill(fill);
+    return file;
+  }
+
+  // Serialized requests and the state a connection keeps between them
+  struct Session {
+    uint8_t version;
+    std::vector<uint8_t> pull;
+    std::vector<uint8_t> pull_range;
+    std::vector<uint8_t> delta;
+    std::vector<uint8_t> fetch;
+    std::vector<uint8_t> list;
+    std::vector<protocol::FileHeaderView> files;
+
+    std::array<std::byte, kArenaSize> arena_buffer;
+    std::pmr::monotonic_buffer_resource arena{arena_buffer.data(), arena_buffer.size()};
+    std::vector<uint8_t> payload;
+    std::array<uint8_t, protocol::kMaxHeaderSize> header;
+    std::vector<protocol::FileHeaderView> listed;
+    std::vector<protocol::CatalogChangeView> changes;
+  };
+
+  void Prepare(Session& session) {
+    uint8_t version = session.version;
+    std::vector<protocol::FileHeader> files;
+    for (int i = 0; i < 8; i++) {
+      files.push_back(File("relaxing-piano-music-" + std::to_string(i) + ".mp3", static_cast<uint8_t>(i)));
+    }
+
+    session.pull = protocol::SerializePullRequest({ .file_count = 2, .files = { files[0], files[1] } }, version);
+    session.pull_range = protocol::SerializePullRangeRequest({ .files = { { .header = files[2], .offset = 1 << 20, .length = 1 << 20 } } }, version);
+
+    protocol::DeltaRequest delta { .header = files[3], .block_size = 4096, .blocks = {} };
+    for (uint32_t i = 0; i < 64; i++) {
+      delta.blocks.push_back({ .weak = i * 2654435761u, .strong = {} });
+    }
+    session.delta = protocol::SerializeDeltaRequest(delta, version);
+
+    protocol::FetchRequest fetch;
+    for (const auto& file : files) {
+      fetch.chunks.push_back(file.hash);
+    }
+    session.fetch = protocol::SerializeFetchRequest(fetch);
+    session.list = protocol::SerializeList({ .file_count = static_cast<uint32_t>(files.size()), .files = files }, version);
+
+    for (const auto& file : files) {
+      session.files.push_back(protocol::ToFileHeaderView(file));
+    }
+  }
+
+  void Respond(Session& session, protocol::Command command) {
+    protocol::MessageHeader header { .command = command, .payload_size = session.payload.size() };
+    protocol::SerializeHeader(header, session.version, session.header.data());
+  }
+
+  // One of each request the server parses and answers, then what the client parses
+  void RunRound(Session& session) {
+    uint8_t version = session.version;
+
+    auto pull = protocol::DeserializePullRequest(session.pull, version, &session.arena);
+    Check(pull && pull->files.size() == 2, "PULL request parses");
+    for (size_t i = 0; pull && i < pull->files.size(); i++) {
+      session.payload.clear();
+      protocol::AppendFileContentsPrefix(session.payload, pull->files[i], 4072704, version);
+      Respond(session, protocol::Command::PULL);
+    }
+    session.arena.release();
+
+    auto range = protocol::DeserializePullRangeRequest(session.pull_range, version, &session.arena);
+    Check(range && range->files.size() == 1, "PULL_RANGE request parses");
+    if (range) {
+      session.payload.clear();
+      protocol::AppendRangePrefix(session.payload, range->files[0], 4072704, version);
+      Respond(session, protocol::Command::PULL_RANGE);
+    }
+    session.arena.release();
+
+    auto delta = protocol::DeserializeDeltaRequest(session.delta, version, &session.arena);
+    Check(delta && delta->blocks.size() == 64, "DELTA request parses");
+    if (delta) {
+      protocol::pmr::DeltaResponse response { .header = delta->header, .size = 4072704,
+                                              .instructions = std::pmr::vector<protocol::DeltaInstruction>(&session.arena) };
+      for (uint64_t i = 0; i < 40; i++) {
+        response.instructions.push_back({ .op = i % 2 ? protocol::DeltaOp::COPY : protocol::DeltaOp::LITERAL, .offset = i, .length = 3 });
+      }
+      session.payload.clear();
+      protocol::AppendDeltaResponsePrefix(session.payload, response, version);
+      Respond(session, protocol::Command::DELTA);
+    }
+    session.arena.release();
+
+    auto fetch = protocol::DeserializeFetchRequest(session.fetch, &session.arena);
+    Check(fetch && fetch->chunks.size() == session.files.size(), "FETCH request parses");
+    session.arena.release();
+
+    Check(protocol::DeserializeListView(session.list, version, session.listed) == session.files.size(), "LIST parses");
+
+    if (version >= protocol::kProtocolV2) {
+      session.payload.clear();
+      protocol::AppendListSincePrefix(session.payload, { .epoch = 1, .version = 2, .kind = protocol::ListSinceKind::CHANGES });
+      protocol::AppendCount(session.payload, session.files.size(), version);
+      for (const auto& file : session.files) {
+        protocol::AppendCatalogChange(session.payload, protocol::ChangeOp::MODIFIED, file);
+      }
+      Respond(session, protocol::Command::LIST_SINCE);
+      auto prefix = protocol::DeserializeListSinceView(session.payload, session.changes);
+      Check(prefix && session.changes.size() == session.files.size(), "LIST_SINCE changes parse");
+    }
+  }
+
+  // The same requests and responses through the calls that return new vectors
+  void RunFreshRound(Session& session) {
+    uint8_t version = session.version;
+    auto send = [&](protocol::Command command, const std::vector<uint8_t>& prefix) {
+      std::vector<uint8_t> message = protocol::SerializeHeader({ .command = command, .payload_size = prefix.size() }, version);
+      message.insert(message.end(), prefix.begin(), prefix.end());
+    };
+
+    auto pull = protocol::DeserializePullRequest(session.pull, version);
+    for (size_t i = 0; pull && i < pull->files.size(); i++) {
+      send(protocol::Command::PULL, protocol::SerializeFileContentsPrefix(pull->files[i], 4072704, version));
+    }
+
+    auto range = protocol::DeserializePullRangeRequest(session.pull_range, version);
+    if (range) {
+      send(protocol::Command::PULL_RANGE, protocol::SerializeRangePrefix(range->files[0], 4072704, version));
+    }
+
+    auto delta = protocol::DeserializeDeltaRequest(session.delta, version);
+    if (delta) {
+      protocol::DeltaResponse response { .header = delta->header, .size = 4072704, .instructions = {} };
+      for (uint64_t i = 0; i < 40; i++) {
+        response.instructions.push_back({ .op = i % 2 ? protocol::DeltaOp::COPY : protocol::DeltaOp::LITERAL, .offset = i, .length = 3 });
+      }
+      send(protocol::Command::DELTA, protocol::SerializeDeltaResponsePrefix(response, version));
+    }
+
+    protocol::DeserializeFetchRequest(session.fetch);
+    protocol::DeserializeList(session.list, version);
+  }
+
+  template <typename Function>
+  void Measure(const std::string& what, Function&& function, size_t& allocated) {
+    size_t before = allocations;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < kRounds; i++) {
+      function();
+    }
+    double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / kRounds;
+    allocated = allocations - before;
+    std::cout << what << ": " << static_cast<double>(allocated) / kRounds << " allocations, " << ns << " ns per round" << "\n";
+  }
+}
+
+int main() {
+  for (uint8_t version : { protocol::kProtocolV1, protocol::kProtocolV2 }) {
+    auto session = std::make_unique<Session>();
+    session->version = version;
+    Prepare(*session);
+
+    // The first round grows the reused buffers; from then on nothing may allocate
+    RunRound(*session);
+    std::string name = "v" + std::to_string(version);
+    size_t allocated;
+    Measure(name + " reused buffers", [&] { RunRound(*session); }, allocated);
+    Check(allocated == 0, name + " steady state allocates nothing");
+    Measure(name + " fresh vectors ", [&] { RunFreshRound(*session); }, allocated);
+  }
+
+  if (failures > 0) {
+    std::cerr << failures << " checks failed" << "\n";
+    return EXIT_FAILURE;
+  }
+  std::cout << "All serialization allocation checks passed" << "\n";
+  return EXIT_SUCCESS;
+}
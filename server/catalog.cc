@@ -0,0 +1,420 @@
+#include "catalog.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <thread>
+#include <unordered_set>
+#include <unistd.h>
+#include "utils/compression.h"
+#include "utils/utils.h"
+#include "protocol/serialization.h"
+
+#if defined(__linux__)
+#include <sys/inotify.h>
+#else
+namespace {
+  // How often the directory is rescanned on platforms without inotify
+  constexpr std::chrono::seconds kRescanInterval{2};
+}
+#endif
+
+namespace {
+  // Files are spread over enough buckets that batched LIST messages stay below about this many payload bytes
+  constexpr size_t kListBatchBytes = 64 * 1024;
+
+  // The change log drops its oldest versions beyond this size; clients that
+  // last synced before them get the whole catalog again
+  constexpr size_t kChangeLogBytes = 1 << 20;
+  // Publishing copies at most one segment this small; larger ones are shared
+  constexpr size_t kChangeSegmentBytes = 16 * 1024;
+
+  // Random, so a version handed out by an earlier run of the server is never taken for a current one
+  uint64_t NewEpoch() {
+    std::random_device random;
+    uint64_t epoch = (static_cast<uint64_t>(random()) << 32) | random();
+    return epoch != 0 ? epoch : 1;
+  }
+
+  // A complete LIST message of `files` in every protocol version, and the v2 one compressed
+  std::shared_ptr<const ListBatch> BuildListBatch(const std::unordered_map<std::string, protocol::Digest>& files, Compressor& compressor) {
+    auto batch = std::make_shared<ListBatch>();
+    batch->count = files.size();
+
+    for (uint8_t version = protocol::kProtocolV1; version <= protocol::kProtocolVersion; version++) {
+      std::vector<uint8_t>& message = batch->messages[version - 1];
+      message.resize(protocol::HeaderSize(version));
+      protocol::AppendCount(message, batch->count, version);
+      batch->entries_offset[version - 1] = message.size();
+      for (const auto& [name, hash] : files) {
+        protocol::AppendListEntry(message, { .name = name, .hash = hash }, version);
+      }
+
+      protocol::MessageHeader header { .command = protocol::Command::LIST, .payload_size = message.size() - protocol::HeaderSize(version) };
+      protocol::SerializeHeader(header, version, message.data());
+    }
+
+    const std::vector<uint8_t>& message = batch->messages[protocol::kProtocolV2 - 1];
+    size_t header_size = protocol::HeaderSize(protocol::kProtocolV2);
+    protocol::MessageHeader header { .command = protocol::Compressed(protocol::Command::LIST), .payload_size = message.size() - header_size };
+    std::vector<uint8_t> compressed = protocol::SerializeHeader(header, protocol::kProtocolV2);
+    if (compressor.Compress(message.data() + header_size, message.size() - header_size, true, compressed)) {
+      batch->compressed_message = std::move(compressed);
+    }
+
+    // Entries are a name length byte, the name and the digest
+    batch->file_hashes.reserve(batch->count);
+    for (size_t offset = batch->entries_offset[protocol::kProtocolV2 - 1]; offset < message.size(); offset += 1 + message[offset] + protocol::kSha256Bytes) {
+      std::string_view name(reinterpret_cast<const char*>(&message[offset + 1]), message[offset]);
+      protocol::Digest& hash = batch->file_hashes[name];
+      std::copy_n(&message[offset + 1 + message[offset]], protocol::kSha256Bytes, hash.begin());
+    }
+    return batch;
+  }
+
+  size_t ListedBytes(const std::string& file_name) {
+    return 1 + file_name.size() + protocol::kSha256Bytes;
+  }
+}
+
+Catalog::Catalog(const std::filesystem::path& data_dir, HashIndex& hash_index, ChunkStore& chunk_store,
+                 uint64_t worker_mapped_bytes, size_t worker_mapped_files)
+    : data_dir_(data_dir), hash_index_(hash_index), chunk_store_(chunk_store),
+      worker_mapped_bytes_(worker_mapped_bytes), worker_mapped_files_(worker_mapped_files),
+      epoch_(NewEpoch()) {
+  Compressor compressor;
+  empty_batch_ = BuildListBatch({}, compressor);
+  buckets_.push_back({ .files = {}, .batch = empty_batch_ });
+}
+
+void Catalog::Start() {
+#if defined(__linux__)
+  // Watch before the initial scan so no change can slip in between
+  if ((inotify_fd_ = inotify_init1(IN_CLOEXEC)) < 0) {
+    FatalError("inotify_init1() failed");
+  }
+
+  uint32_t mask = IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE;
+  if (inotify_add_watch(inotify_fd_, data_dir_.c_str(), mask) < 0) {
+    FatalError("inotify_add_watch() failed for " + data_dir_.string());
+  }
+#endif
+
+  Rescan();
+
+  // The watcher runs for the lifetime of the server
+  std::thread(&Catalog::Watch, this).detach();
+}
+
+std::shared_ptr<const CatalogSnapshot> Catalog::Current(const std::shared_ptr<const CatalogSnapshot>& cached) const {
+  if (cached && cached->version == version_.load(std::memory_order_acquire)) {
+    return cached;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  return snapshot_;
+}
+
+#if defined(__linux__)
+
+void Catalog::Watch() {
+  alignas(inotify_event) char buffer[4096];
+
+  while (true) {
+    ssize_t length = read(inotify_fd_, buffer, sizeof(buffer));
+
+    if (length < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      FatalError("read() failed for inotify descriptor");
+    }
+
+    // Apply a whole batch of events before publishing once
+    bool changed = false;
+    bool overflowed = false;
+
+    for (char* p = buffer; p < buffer + length;) {
+      const inotify_event* event = reinterpret_cast<const inotify_event*>(p);
+      p += sizeof(inotify_event) + event->len;
+
+      if (event->mask & IN_Q_OVERFLOW) {
+        overflowed = true;
+      } else if (event->len == 0) {
+        continue;
+      } else if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+        RemoveFile(event->name);
+        changed = true;
+      } else if (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+        UpdateFile(event->name);
+        changed = true;
+      }
+    }
+
+    // Events were lost, only a full rescan can tell what changed. The events
+    // applied before the overflow still have to go out with it
+    if (overflowed) {
+      Rescan(changed);
+    } else if (changed) {
+      hash_index_.Save();
+      Publish();
+    }
+  }
+}
+
+#else
+
+void Catalog::Watch() {
+  while (true) {
+    std::this_thread::sleep_for(kRescanInterval);
+    Rescan();
+  }
+}
+
+#endif
+
+void Catalog::Rescan(bool changed) {
+  std::vector<protocol::FileHeader> files = hash_index_.ListFilesWithHashes(data_dir_);
+  hash_index_.Save();
+  for (const auto& file : files) {
+    chunk_store_.Prepare(file.name);
+  }
+
+  // Changes come from comparing with what was listed; the initial scan records none
+  std::unordered_set<std::string_view> found;
+  found.reserve(files.size());
+  for (const auto& file : files) {
+    found.insert(file.name);
+    std::optional<protocol::Digest> listed = ListedHash(file.name);
+    if (listed == file.hash) {
+      continue;
+    }
+    RecordChange(listed ? protocol::ChangeOp::MODIFIED : protocol::ChangeOp::ADDED, file.name, file.hash);
+    SetEntry(file.name, file.hash);
+    changed = true;
+  }
+
+  std::vector<std::string> removed;
+  for (const auto& bucket : buckets_) {
+    for (const auto& [name, hash] : bucket.files) {
+      if (!found.contains(name)) {
+        RecordChange(protocol::ChangeOp::REMOVED, name, hash);
+        removed.push_back(name);
+      }
+    }
+  }
+  for (const auto& name : removed) {
+    RemoveEntry(name);
+    changed = true;
+  }
+
+  if (version_.load(std::memory_order_relaxed) > 0 && !changed) {
+    return;
+  }
+
+  std::cout << "Catalog rescanned: " << files.size() << " files" << "\n";
+  Publish();
+}
+
+void Catalog::UpdateFile(const std::string& file_name) {
+  std::filesystem::path file_path = data_dir_ / file_name;
+  std::error_code ec;
+
+  // In-progress uploads; the final rename shows up as its own event
+  if (IsHiddenFile(file_name)) {
+    return;
+  }
+
+  chunk_store_.Forget(file_name);
+
+  if (!std::filesystem::is_regular_file(file_path, ec)) {
+    RemoveFile(file_name);
+    return;
+  }
+
+  std::optional<protocol::Digest> hash = hash_index_.Lookup(file_path);
+  if (!hash) {
+    RemoveFile(file_name);
+    return;
+  }
+  chunk_store_.Prepare(file_name);
+
+  // Rewriting a file with the same content changes nothing for clients
+  std::optional<protocol::Digest> listed = ListedHash(file_name);
+  if (listed != hash) {
+    RecordChange(listed ? protocol::ChangeOp::MODIFIED : protocol::ChangeOp::ADDED, file_name, *hash);
+    SetEntry(file_name, *hash);
+  }
+
+  std::cout << "Catalog updated: " << file_name << "\n";
+}
+
+void Catalog::RemoveFile(const std::string& file_name) {
+  std::optional<protocol::Digest> listed = ListedHash(file_name);
+
+  if (RemoveEntry(file_name)) {
+    RecordChange(protocol::ChangeOp::REMOVED, file_name, *listed);
+    hash_index_.Forget(file_name);
+    chunk_store_.Forget(file_name);
+    std::cout << "Catalog removed: " << file_name << "\n";
+  }
+}
+
+void Catalog::SetEntry(const std::string& file_name, const protocol::Digest& hash) {
+  Bucket& bucket = BucketOf(file_name);
+  auto [it, inserted] = bucket.files.insert_or_assign(file_name, hash);
+  if (inserted) {
+    file_count_++;
+    listed_bytes_ += ListedBytes(file_name);
+  }
+  bucket.dirty = true;
+}
+
+bool Catalog::RemoveEntry(const std::string& file_name) {
+  Bucket& bucket = BucketOf(file_name);
+  if (bucket.files.erase(file_name) == 0) {
+    return false;
+  }
+
+  file_count_--;
+  listed_bytes_ -= ListedBytes(file_name);
+  bucket.dirty = true;
+  return true;
+}
+
+std::optional<protocol::Digest> Catalog::ListedHash(const std::string& file_name) const {
+  const Bucket& bucket = buckets_[ListBucket(file_name, buckets_.size())];
+  auto it = bucket.files.find(file_name);
+  if (it == bucket.files.end()) {
+    return std::nullopt;
+  }
+  return it->second;
+}
+
+void Catalog::Rebucket() {
+  // Batches average between an eighth and half of kListBatchBytes
+  size_t count = buckets_.size();
+  while (listed_bytes_ > count * kListBatchBytes / 2) {
+    count *= 2;
+  }
+  while (count > 1 && listed_bytes_ < count * kListBatchBytes / 8) {
+    count /= 2;
+  }
+  if (count == buckets_.size()) {
+    return;
+  }
+
+  // Every file moves, so every batch is rebuilt, once per doubling or halving of the catalog
+  std::vector<Bucket> buckets(count, Bucket{ .files = {}, .batch = empty_batch_, .dirty = true });
+  for (auto& bucket : buckets_) {
+    for (auto& [name, hash] : bucket.files) {
+      buckets[ListBucket(name, count)].files.emplace(name, hash);
+    }
+  }
+  buckets_ = std::move(buckets);
+}
+
+void Catalog::RecordChange(protocol::ChangeOp op, const std::string& file_name, const protocol::Digest& hash) {
+  // The initial scan is where the log starts, not a change
+  if (version_.load(std::memory_order_relaxed) == 0) {
+    return;
+  }
+
+  protocol::AppendCatalogChange(pending_changes_, op, { .name = file_name, .hash = hash });
+  pending_change_count_++;
+}
+
+void Catalog::Publish() {
+  auto snapshot = std::make_shared<CatalogSnapshot>();
+  snapshot->epoch = epoch_;
+  snapshot->version = version_.load(std::memory_order_relaxed) + 1;
+
+  // The changes join the newest segment as this version's. Only that segment
+  // is copied, and only while it is small; older ones are shared as they are
+  if (pending_change_count_ > 0) {
+    auto segment = std::make_shared<ChangeSegment>();
+    if (!change_segments_.empty() && change_segments_.back()->changes.size() < kChangeSegmentBytes) {
+      *segment = *change_segments_.back();
+      change_segments_.pop_back();
+    }
+    segment->marks.push_back({ .version = snapshot->version, .offset = segment->changes.size(), .index = segment->change_count });
+    segment->changes.insert(segment->changes.end(), pending_changes_.begin(), pending_changes_.end());
+    segment->change_count += pending_change_count_;
+    change_log_bytes_ += pending_changes_.size();
+    change_segments_.push_back(std::move(segment));
+    pending_changes_.clear();
+    pending_change_count_ = 0;
+
+    // Whole segments are dropped from the front until the log fits kChangeLogBytes again
+    while (change_log_bytes_ > kChangeLogBytes) {
+      oldest_version_ = change_segments_.front()->marks.back().version;
+      change_log_bytes_ -= change_segments_.front()->changes.size();
+      change_segments_.pop_front();
+    }
+  }
+
+  snapshot->oldest_version = oldest_version_;
+  snapshot->change_segments.assign(change_segments_.begin(), change_segments_.end());
+
+  // Only the dirty buckets are serialized and compressed again; the others keep their batch
+  Rebucket();
+  Compressor compressor;
+  snapshot->buckets.reserve(buckets_.size());
+  snapshot->file_count = file_count_;
+  snapshot->list_entry_bytes.fill(0);
+
+  for (auto& bucket : buckets_) {
+    if (bucket.dirty) {
+      bucket.batch = bucket.files.empty() ? empty_batch_ : BuildListBatch(bucket.files, compressor);
+      bucket.dirty = false;
+    }
+
+    snapshot->buckets.push_back(bucket.batch);
+    if (bucket.batch->count > 0) {
+      snapshot->list_batches.push_back(bucket.batch);
+    }
+    for (uint8_t version = protocol::kProtocolV1; version <= protocol::kProtocolVersion; version++) {
+      snapshot->list_entry_bytes[version - 1] += bucket.batch->Entries(version).size();
+    }
+  }
+  snapshot->list_batches.push_back(empty_batch_);
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  snapshot_ = std::move(snapshot);
+  version_.store(snapshot_->version, std::memory_order_release);
+}
+
+const protocol::Digest* CatalogSnapshot::FileHash(std::string_view file_name) const {
+  const auto& file_hashes = buckets[ListBucket(file_name, buckets.size())]->file_hashes;
+  auto it = file_hashes.find(file_name);
+  return it != file_hashes.end() ? &it->second : nullptr;
+}
+
+bool CatalogSnapshot::AppendChangesSince(uint64_t since_epoch, uint64_t since_version, std::vector<uint8_t>& out) const {
+  if (since_epoch != epoch || since_version < oldest_version || since_version > version) {
+    return false;
+  }
+
+  // Everything from the first version the client has not seen, in each segment that has any
+  auto first_unseen = [since_version](const ChangeSegment& segment) {
+    return std::upper_bound(segment.marks.begin(), segment.marks.end(), since_version,
+                            [](uint64_t version, const ChangeMark& mark) { return version < mark.version; });
+  };
+
+  uint32_t count = 0;
+  for (const auto& segment : change_segments) {
+    auto mark = first_unseen(*segment);
+    count += mark != segment->marks.end() ? segment->change_count - mark->index : 0;
+  }
+
+  protocol::AppendCount(out, count, protocol::kProtocolV2);
+  for (const auto& segment : change_segments) {
+    auto mark = first_unseen(*segment);
+    if (mark != segment->marks.end()) {
+      out.insert(out.end(), segment->changes.begin() + mark->offset, segment->changes.end());
+    }
+  }
+  return true;
+}
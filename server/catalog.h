@@ -0,0 +1,185 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include "chunk_store.h"
+#include "protocol/protocol.h"
+#include "utils/hash_index.h"
+#include "utils/mapped_file.h"
+
+// First change a published version added to a ChangeSegment, and how many of the segment's changes precede it
+struct ChangeMark {
+  uint64_t version;
+  size_t offset;
+  uint32_t index;
+};
+
+// Stretch of the change log covering whole consecutive versions, as LIST_SINCE
+// entries with a mark where each version's changes start. Never modified once
+// published, so snapshots share the segments instead of copying the log
+struct ChangeSegment {
+  std::vector<uint8_t> changes;
+  std::vector<ChangeMark> marks;
+  uint32_t change_count = 0;
+};
+
+// Bucket of the catalog's batches a listed file falls in; bucket counts are powers of two
+inline size_t ListBucket(std::string_view file_name, size_t bucket_count) {
+  return std::hash<std::string_view>{}(file_name) & (bucket_count - 1);
+}
+
+// The listed files of one bucket, as a complete LIST message in each protocol
+// version. Never modified once published: a change rebuilds only the batches
+// of the files it touched, and snapshots share all the others
+struct ListBatch {
+  uint32_t count = 0;
+  // Header, count and entries; clients that negotiated batched LIST get the v2
+  // message as it is, the others the entries of every batch after a single count
+  std::array<std::vector<uint8_t>, protocol::kProtocolVersion> messages;
+  std::array<size_t, protocol::kProtocolVersion> entries_offset;
+  // The v2 message compressed; empty if zstd failed
+  std::vector<uint8_t> compressed_message;
+  // Hash of every file in the batch, by a name pointing into the v2 message
+  std::unordered_map<std::string_view, protocol::Digest> file_hashes;
+
+  std::span<const uint8_t> Entries(uint8_t protocol_version) const {
+    const std::vector<uint8_t>& message = messages[protocol_version - 1];
+    return std::span<const uint8_t>(message).subspan(entries_offset[protocol_version - 1]);
+  }
+};
+
+// Immutable view of the catalog handed out to workers, replaced as a whole on every change
+struct CatalogSnapshot {
+  // Versions count publishes within one run of the server, told apart by the epoch
+  uint64_t epoch;
+  uint64_t version;
+  // Every listed file, in the batch of its bucket; empty buckets share one empty batch
+  std::vector<std::shared_ptr<const ListBatch>> buckets;
+  // What a batched LIST sends: the non-empty batches, then an empty one that ends it
+  std::vector<std::shared_ptr<const ListBatch>> list_batches;
+  uint32_t file_count;
+  // Bytes of all the batches' entries in each protocol version, which follow the count of a single LIST
+  std::array<uint64_t, protocol::kProtocolVersion> list_entry_bytes;
+
+  // Every change published after oldest_version, oldest segment first
+  uint64_t oldest_version;
+  std::vector<std::shared_ptr<const ChangeSegment>> change_segments;
+
+  // Hash listed for a file; null if it is not listed
+  const protocol::Digest* FileHash(std::string_view file_name) const;
+
+  // Appends the count and entries of a CHANGES response that brings a client at
+  // `version` of `epoch` up to this snapshot; false if the log cannot
+  bool AppendChangesSince(uint64_t epoch, uint64_t version, std::vector<uint8_t>& out) const;
+};
+
+// In-memory catalog of the data directory, kept current by inotify (or by a
+// periodic rescan where inotify is unavailable). Files are split into buckets by
+// name, each published as a ListBatch, and a change only rebuilds the batches of
+// the buckets it touched before publishing a new snapshot.
+// Changes also invalidate the files' chunk recipes in the ChunkStore, and are
+// recorded in a change log, trimmed to its most recent changes, for LIST_SINCE.
+class Catalog {
+ public:
+  Catalog(const std::filesystem::path& data_dir, HashIndex& hash_index, ChunkStore& chunk_store,
+          uint64_t worker_mapped_bytes, size_t worker_mapped_files);
+
+  // Scans the data directory and starts watching it for changes
+  void Start();
+
+  // Latest published snapshot; `cached` is returned without locking when it is still current
+  std::shared_ptr<const CatalogSnapshot> Current(const std::shared_ptr<const CatalogSnapshot>& cached) const;
+
+  ChunkStore& chunk_store() const { return chunk_store_; }
+  // Bounds of each worker's MappingCache
+  uint64_t worker_mapped_bytes() const { return worker_mapped_bytes_; }
+  size_t worker_mapped_files() const { return worker_mapped_files_; }
+
+ private:
+  // Files of one bucket and the batch last published for them, rebuilt by the next Publish() once dirty
+  struct Bucket {
+    std::unordered_map<std::string, protocol::Digest> files;
+    std::shared_ptr<const ListBatch> batch;
+    bool dirty = false;
+  };
+
+  void Watch();
+  // `changed` says the catalog was already modified since the last publish,
+  // so it is published even if the rescan itself finds nothing new
+  void Rescan(bool changed = false);
+  void UpdateFile(const std::string& file_name);
+  void RemoveFile(const std::string& file_name);
+  Bucket& BucketOf(std::string_view file_name) { return buckets_[ListBucket(file_name, buckets_.size())]; }
+  void SetEntry(const std::string& file_name, const protocol::Digest& hash);
+  bool RemoveEntry(const std::string& file_name);
+  // Doubles or halves the buckets once batches drift too far from their target size
+  void Rebucket();
+  // Hash the catalog currently lists for a file, if any
+  std::optional<protocol::Digest> ListedHash(const std::string& file_name) const;
+  void RecordChange(protocol::ChangeOp op, const std::string& file_name, const protocol::Digest& hash);
+  void Publish();
+
+  const std::filesystem::path& data_dir_;
+  HashIndex& hash_index_;
+  ChunkStore& chunk_store_;
+  const uint64_t worker_mapped_bytes_;
+  const size_t worker_mapped_files_;
+  int inotify_fd_ = -1;
+
+  // Only touched by the thread that owns the watcher
+  std::vector<Bucket> buckets_;
+  size_t file_count_ = 0;
+  // Size of every listed file's v2 entry, which the bucket count follows
+  size_t listed_bytes_ = 0;
+  std::shared_ptr<const ListBatch> empty_batch_;
+  // Changes since the last Publish(), and the log they are moved into
+  std::vector<uint8_t> pending_changes_;
+  uint32_t pending_change_count_ = 0;
+  std::deque<std::shared_ptr<const ChangeSegment>> change_segments_;
+  size_t change_log_bytes_ = 0;
+  // The initial scan publishes version 1, which the log starts from
+  uint64_t oldest_version_ = 1;
+
+  const uint64_t epoch_;
+
+  std::atomic<uint64_t> version_{0};
+  mutable std::mutex mutex_;
+  std::shared_ptr<const CatalogSnapshot> snapshot_;
+};
+
+// Per-worker handle on the catalog that only takes the catalog lock after a new snapshot was published
+class CatalogReader {
+ public:
+  explicit CatalogReader(const Catalog& catalog)
+      : catalog_(catalog), mapping_cache_(catalog.worker_mapped_bytes(), catalog.worker_mapped_files()) {}
+
+  std::shared_ptr<const CatalogSnapshot> Get() {
+    snapshot_ = catalog_.Current(snapshot_);
+    return snapshot_;
+  }
+
+  // Latest chunk store snapshot, with the same locking as Get()
+  std::shared_ptr<const ChunkStore::Snapshot> chunks() {
+    chunks_ = catalog_.chunk_store().Current(chunks_);
+    return chunks_;
+  }
+  // This worker's own, so looking up a mapping takes no lock
+  MappingCache& mapping_cache() { return mapping_cache_; }
+
+ private:
+  const Catalog& catalog_;
+  std::shared_ptr<const CatalogSnapshot> snapshot_;
+  std::shared_ptr<const ChunkStore::Snapshot> chunks_;
+  MappingCache mapping_cache_;
+};
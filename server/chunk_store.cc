@@ -0,0 +1,158 @@
+#include "chunk_store.h"
+
+#include <iostream>
+#include <thread>
+#include "utils/chunker.h"
+
+ChunkStore::ChunkStore(const std::filesystem::path& data_dir, HashIndex& hash_index)
+    : data_dir_(data_dir), hash_index_(hash_index) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  PublishLocked();
+}
+
+void ChunkStore::Start() {
+  // Runs for the lifetime of the server, like the catalog's watcher
+  std::thread(&ChunkStore::ChunkQueued, this).detach();
+}
+
+void ChunkStore::Prepare(const std::string& file_name) {
+  std::lock_guard<std::mutex> lock(queue_mutex_);
+  if (queued_.insert(file_name).second) {
+    queue_.push_back(file_name);
+    queue_ready_.notify_one();
+  }
+}
+
+void ChunkStore::ChunkQueued() {
+  while (true) {
+    std::string file_name;
+    {
+      std::unique_lock<std::mutex> lock(queue_mutex_);
+      queue_ready_.wait(lock, [this] { return !queue_.empty(); });
+      file_name = std::move(queue_.front());
+      queue_.pop_front();
+      queued_.erase(file_name);
+    }
+
+    std::error_code ec;
+    uint64_t size = std::filesystem::file_size(data_dir_ / file_name, ec);
+    if (!ec && size >= kMinChunkedFileSize) {
+      Chunk(file_name);
+    }
+  }
+}
+
+// Chunks a file unless its recipe is current. Runs on the chunking thread only
+void ChunkStore::Chunk(const std::string& file_name) {
+  std::filesystem::path file_path = data_dir_ / file_name;
+  std::optional<protocol::Digest> hash = hash_index_.Lookup(file_path);
+  if (!hash) {
+    Forget(file_name);
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const std::shared_ptr<const Recipe>* recipe = recipes_.Find(file_name);
+    if (recipe && (*recipe)->file_hash == *hash) {
+      return;
+    }
+    chunking_ = file_name;
+    chunking_forgotten_ = false;
+  }
+
+  // Chunk outside the lock so the catalog can forget recipes meanwhile
+  std::optional<std::vector<protocol::ChunkInfo>> chunks = ChunkFile(file_path);
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  chunking_.clear();
+  // A change seen while chunking is queued again by the catalog; until then the file has no recipe
+  if (chunking_forgotten_) {
+    return;
+  }
+  if (!chunks) {
+    if (ForgetLocked(file_name)) {
+      PublishLocked();
+    }
+    return;
+  }
+
+  auto recipe = std::make_shared<Recipe>();
+  recipe->file_hash = *hash;
+  recipe->chunks = std::move(*chunks);
+  recipe->size = 0;
+  ForgetLocked(file_name);
+
+  for (const auto& chunk : recipe->chunks) {
+    Location location { .file_name = file_name, .offset = recipe->size, .length = chunk.length };
+    std::vector<Location>& holders = holders_[chunk.hash];
+    if (holders.empty()) {
+      unique_bytes_ += chunk.length;
+      locations_.Set(chunk.hash, location);
+    }
+    holders.push_back(std::move(location));
+    recipe->size += chunk.length;
+  }
+
+  recipes_.Set(file_name, recipe);
+  PublishLocked();
+  std::cout << "Chunked " << file_name << ": " << recipe->chunks.size() << " chunks, "
+            << unique_bytes_ << " unique bytes indexed" << "\n";
+}
+
+void ChunkStore::Forget(const std::string& file_name) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (file_name == chunking_) {
+    chunking_forgotten_ = true;
+  }
+  if (ForgetLocked(file_name)) {
+    PublishLocked();
+  }
+}
+
+std::shared_ptr<const ChunkStore::Snapshot> ChunkStore::Current(const std::shared_ptr<const Snapshot>& cached) const {
+  if (cached && cached->version == version_.load(std::memory_order_acquire)) {
+    return cached;
+  }
+
+  std::lock_guard<std::mutex> lock(snapshot_mutex_);
+  return snapshot_;
+}
+
+// Drops a file's recipe; chunks it held move to another holder, if any
+bool ChunkStore::ForgetLocked(const std::string& file_name) {
+  const std::shared_ptr<const Recipe>* found = recipes_.Find(file_name);
+  if (!found) {
+    return false;
+  }
+  std::shared_ptr<const Recipe> recipe = *found;
+  recipes_.Erase(file_name);
+
+  for (const auto& chunk : recipe->chunks) {
+    auto holders = holders_.find(chunk.hash);
+    if (holders == holders_.end()) {
+      continue;
+    }
+
+    std::erase_if(holders->second, [&](const Location& location) { return location.file_name == file_name; });
+    if (holders->second.empty()) {
+      unique_bytes_ -= chunk.length;
+      holders_.erase(holders);
+      locations_.Erase(chunk.hash);
+    } else if (locations_.Find(chunk.hash)->file_name == file_name) {
+      locations_.Set(chunk.hash, holders->second.front());
+    }
+  }
+  return true;
+}
+
+void ChunkStore::PublishLocked() {
+  auto snapshot = std::make_shared<Snapshot>();
+  snapshot->version = version_.load(std::memory_order_relaxed) + 1;
+  snapshot->recipes = recipes_.Share();
+  snapshot->locations = locations_.Share();
+
+  std::lock_guard<std::mutex> lock(snapshot_mutex_);
+  snapshot_ = std::move(snapshot);
+  version_.store(snapshot_->version, std::memory_order_release);
+}
@@ -0,0 +1,162 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "protocol/protocol.h"
+#include "utils/digest_set.h"
+#include "utils/hash_index.h"
+
+// Map split into small shards by key hash. Copies share their shards, and a
+// change copies only the shard it touches first, so publishing a copy after
+// every change costs a pointer per shard rather than the whole map.
+template <typename Key, typename Value, typename Hash = std::hash<Key>>
+class ShardedMap {
+ public:
+  ShardedMap() : shards_(1, std::make_shared<Shard>()), owned_(1, true) {}
+
+  const Value* Find(const Key& key) const {
+    const Shard& shard = *shards_[Index(key)];
+    auto it = shard.find(key);
+    return it != shard.end() ? &it->second : nullptr;
+  }
+
+  void Set(const Key& key, Value value) {
+    auto [it, inserted] = Own(Index(key)).insert_or_assign(key, std::move(value));
+    if (inserted && ++size_ > shards_.size() * kShardSize) {
+      Grow();
+    }
+  }
+
+  bool Erase(const Key& key) {
+    size_t index = Index(key);
+    if (shards_[index]->count(key) == 0) {
+      return false;
+    }
+    Own(index).erase(key);
+    size_--;
+    return true;
+  }
+
+  // Copy for readers; this map copies each shard again before changing it
+  ShardedMap Share() {
+    owned_.assign(owned_.size(), false);
+    return *this;
+  }
+
+ private:
+  using Shard = std::unordered_map<Key, Value, Hash>;
+  static constexpr size_t kShardSize = 64;
+
+  size_t Index(const Key& key) const { return Hash{}(key) & (shards_.size() - 1); }
+
+  Shard& Own(size_t index) {
+    if (!owned_[index]) {
+      shards_[index] = std::make_shared<Shard>(*shards_[index]);
+      owned_[index] = true;
+    }
+    return *shards_[index];
+  }
+
+  // Every entry moves, once per doubling of the map
+  void Grow() {
+    std::vector<std::shared_ptr<Shard>> shards(shards_.size() * 2);
+    for (auto& shard : shards) {
+      shard = std::make_shared<Shard>();
+    }
+    for (const auto& shard : shards_) {
+      for (const auto& [key, value] : *shard) {
+        shards[Hash{}(key) & (shards.size() - 1)]->emplace(key, value);
+      }
+    }
+    shards_ = std::move(shards);
+    owned_.assign(shards_.size(), true);
+  }
+
+  std::vector<std::shared_ptr<Shard>> shards_;
+  std::vector<bool> owned_;
+  size_t size_ = 0;
+};
+
+// Content-defined chunks of the served files and where each distinct chunk can
+// be read from. Files worth chunking are chunked in the background as the
+// catalog finds them, and a recipe is dropped as soon as the catalog sees the
+// file change, so a chunk shared by several files (or one file under two
+// names) is indexed once and clients only transfer chunks they do not hold.
+// Workers only read published snapshots; a file without a recipe yet is sent
+// whole instead of being chunked on the request path.
+class ChunkStore {
+ public:
+  struct Recipe {
+    protocol::Digest file_hash;
+    uint64_t size;
+    std::vector<protocol::ChunkInfo> chunks;
+  };
+
+  struct Location {
+    std::string file_name;
+    uint64_t offset;
+    uint32_t length;
+  };
+
+  // Recipes ready to be served and where to read each chunk, never modified once published
+  struct Snapshot {
+    uint64_t version;
+    ShardedMap<std::string, std::shared_ptr<const Recipe>> recipes;
+    ShardedMap<protocol::Digest, Location, DigestHash> locations;
+  };
+
+  ChunkStore(const std::filesystem::path& data_dir, HashIndex& hash_index);
+
+  // Starts the thread that chunks files passed to Prepare()
+  void Start();
+
+  // Queues a new or changed file to be chunked in the background, so workers
+  // find its recipe ready. Files below kMinChunkedFileSize are left alone
+  void Prepare(const std::string& file_name);
+
+  // Drops the recipe of a changed or deleted file, publishing at once so no worker serves it any more
+  void Forget(const std::string& file_name);
+
+  // Latest published snapshot; `cached` is returned without locking when it is still current
+  std::shared_ptr<const Snapshot> Current(const std::shared_ptr<const Snapshot>& cached) const;
+
+ private:
+  void ChunkQueued();
+  void Chunk(const std::string& file_name);
+  bool ForgetLocked(const std::string& file_name);
+  void PublishLocked();
+
+  const std::filesystem::path& data_dir_;
+  HashIndex& hash_index_;
+
+  // Only the catalog thread (forgetting recipes) and the chunking thread
+  // (adding them) take this, never a worker
+  std::mutex mutex_;
+  ShardedMap<std::string, std::shared_ptr<const Recipe>> recipes_;
+  ShardedMap<protocol::Digest, Location, DigestHash> locations_;
+  // Every file holding each chunk; locations_ has the first of them
+  std::unordered_map<protocol::Digest, std::vector<Location>, DigestHash> holders_;
+  uint64_t unique_bytes_ = 0;
+  // File being chunked, and whether it was forgotten meanwhile, which makes its recipe stale
+  std::string chunking_;
+  bool chunking_forgotten_ = false;
+
+  std::atomic<uint64_t> version_{0};
+  mutable std::mutex snapshot_mutex_;
+  std::shared_ptr<const Snapshot> snapshot_;
+
+  std::mutex queue_mutex_;
+  std::condition_variable queue_ready_;
+  std::deque<std::string> queue_;
+  std::unordered_set<std::string> queued_;
+};
@@ -0,0 +1,1080 @@
+#include "connection.h"
+
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <memory_resource>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <string_view>
+#include <unordered_map>
+#include <unistd.h>
+#include "utils/utils.h"
+#include "utils/delta.h"
+#include "protocol/serialization.h"
+
+namespace {
+  // Requests only carry file names and hashes, so anything bigger is a broken client
+  constexpr uint64_t kMaxRequestPayloadSize = 64 << 20;
+
+  // Upload bodies are moved from the socket to disk in chunks of this size
+  constexpr size_t kUploadChunkSize = 64 * 1024;
+
+  // Compressed bodies are read from disk (or mapped files) in pieces of this size
+  constexpr size_t kCompressInputSize = 256 * 1024;
+
+  // Largest single send from a mapped file
+  constexpr off_t kMappedSendSize = 4 << 20;
+
+  // Payload buffer capacity kept between messages
+  constexpr size_t kMaxKeptPayloadSize = 1 << 20;
+
+  // Compressed output rarely fills the socket buffer, so without a limit one
+  // connection would keep its worker to itself until the whole file is out
+  constexpr int kCompressedBlocksPerTurn = 16;
+
+  // Clients pick the DELTA block size; anything larger is pointless for signatures
+  constexpr uint32_t kMaxDeltaBlockSize = 1 << 20;
+
+  // v1 payload sizes are 32 bits; leave room for the largest FileContents prefix
+  constexpr uint64_t kMaxV1FileSize = UINT32_MAX - (1 + UINT8_MAX + 1 + UINT8_MAX + sizeof(uint32_t));
+
+  bool RequiresV2(protocol::Command command) {
+    return command == protocol::Command::DELTA || command == protocol::Command::CHUNKS ||
+           command == protocol::Command::FETCH || command == protocol::Command::PULL_RANGE ||
+           command == protocol::Command::LIST_SINCE;
+  }
+}
+
+Connection::Connection(int socket, std::unique_ptr<Transport> transport, const std::filesystem::path& data_dir, CatalogReader& catalog)
+    : socket_(socket), transport_(std::move(transport)), data_dir_(data_dir), catalog_(catalog) {}
+
+Connection::~Connection() {
+  for (int fd : file_fds_) {
+    close(fd);
+  }
+  if (prefetch_fd_ >= 0) {
+    close(prefetch_fd_);
+  }
+  if (upload_fd_ >= 0) {
+    close(upload_fd_);
+    unlink(upload_temp_path_.c_str());
+  }
+  if (close(socket_) < 0) {
+    std::cerr << "close() failed: " << std::strerror(errno) << "\n";
+  }
+}
+
+bool Connection::OnReady() {
+  yielded_ = false;
+  turn_blocks_ = 0;
+
+  while (true) {
+    IoResult result = IoResult::Closed;
+
+    switch (state_) {
+      case State::ReadingHeader:
+        result = ReadHeader();
+        break;
+      case State::ReadingPayload:
+        result = ReadPayload();
+        break;
+      case State::ReadingUploadPrefix:
+        result = ReadUploadPrefix();
+        break;
+      case State::ReadingUploadBody:
+        result = ReadUploadBody();
+        break;
+      case State::Writing:
+        result = Write();
+        break;
+      case State::Closed:
+        return false;
+    }
+
+    if (result == IoResult::WouldBlock) {
+      return true;
+    } else if (result == IoResult::Closed) {
+      state_ = State::Closed;
+      return false;
+    }
+  }
+}
+
+Connection::IoResult Connection::Receive(uint8_t* buffer, size_t size, size_t& offset) {
+  while (offset < size) {
+    ssize_t bytes_received = transport_->Receive(buffer + offset, size - offset);
+
+    if (bytes_received > 0) {
+      offset += bytes_received;
+    } else if (bytes_received == 0) {
+      std::cout << "Client disconnected" << "\n";
+      return IoResult::Closed;
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      return IoResult::WouldBlock;
+    } else if (errno != EINTR) {
+      std::cerr << "recv() failed: " << std::strerror(errno) << "\n";
+      return IoResult::Closed;
+    }
+  }
+
+  return IoResult::Done;
+}
+
+Connection::IoResult Connection::ReadHeader() {
+  IoResult result = Receive(header_buffer_.data(), protocol::HeaderSize(protocol_version_), header_offset_);
+  if (result != IoResult::Done) {
+    return result;
+  }
+
+  header_ = protocol::DeserializeHeader(header_buffer_.data(), protocol_version_);
+  header_offset_ = 0;
+
+  // HELLO reuses payload_size for the version and has no payload
+  if (header_.command == protocol::Command::HELLO) {
+    Dispatch();
+    return IoResult::Done;
+  }
+
+  // PUSH bodies can be any size, so they are streamed rather than buffered
+  if (header_.command == protocol::Command::PUSH) {
+    if (protocol_version_ < protocol::kProtocolV2) {
+      std::cerr << "PUSH requires protocol v2" << "\n";
+      return IoResult::Closed;
+    }
+
+    payload_buffer_.resize(1);
+    payload_offset_ = 0;
+    state_ = State::ReadingUploadPrefix;
+    return IoResult::Done;
+  }
+
+  if (header_.payload_size > kMaxRequestPayloadSize) {
+    std::cerr << "Request payload too large: " << header_.payload_size << " bytes" << "\n";
+    return IoResult::Closed;
+  }
+
+  payload_buffer_.resize(header_.payload_size);
+  payload_offset_ = 0;
+  state_ = State::ReadingPayload;
+  return IoResult::Done;
+}
+
+Connection::IoResult Connection::ReadPayload() {
+  IoResult result = Receive(payload_buffer_.data(), payload_buffer_.size(), payload_offset_);
+  if (result != IoResult::Done) {
+    return result;
+  }
+
+  Dispatch();
+  return IoResult::Done;
+}
+
+Connection::IoResult Connection::ReadUploadPrefix() {
+  IoResult result = Receive(payload_buffer_.data(), payload_buffer_.size(), payload_offset_);
+  if (result != IoResult::Done) {
+    return result;
+  }
+
+  // The leading name length fixes the size of the rest of the v2 prefix
+  if (payload_buffer_.size() == 1) {
+    payload_buffer_.resize(1 + payload_buffer_[0] + protocol::kSha256Bytes + sizeof(uint64_t));
+    return IoResult::Done;
+  }
+
+  std::optional<protocol::FileContents> prefix = protocol::DeserializeFileContentsPrefix(payload_buffer_, protocol_version_);
+  if (!prefix) {
+    std::cerr << "PUSH: malformed upload prefix" << "\n";
+    return IoResult::Closed;
+  }
+  std::cout << "Received command: " << static_cast<int>(header_.command) << " (" << prefix->header.name << ")" << "\n";
+
+  if (!IsValidFileName(prefix->header.name) || payload_buffer_.size() + prefix->size != header_.payload_size) {
+    std::cerr << "PUSH: rejected malformed upload of " << prefix->header.name << "\n";
+    return IoResult::Closed;
+  }
+
+  upload_file_ = prefix->header;
+  upload_remaining_ = prefix->size;
+  upload_hash_.reset();
+
+  // Fixed-length hidden name, so even a NAME_MAX-long file name can be uploaded
+  std::string temp_path = (data_dir_ / ".upload-XXXXXX").string();
+  if ((upload_fd_ = mkostemp(temp_path.data(), O_CLOEXEC)) < 0) {
+    std::cerr << "PUSH: unable to create a temporary file in " << data_dir_ << ": " << std::strerror(errno) << "\n";
+    return IoResult::Closed;
+  }
+  upload_temp_path_ = temp_path;
+  // mkostemp() creates it private; the stored file is readable like any other
+  fchmod(upload_fd_, 0644);
+
+  state_ = State::ReadingUploadBody;
+  return IoResult::Done;
+}
+
+Connection::IoResult Connection::ReadUploadBody() {
+  if (upload_buffer_.empty()) {
+    upload_buffer_.resize(kUploadChunkSize);
+  }
+
+  while (upload_remaining_ > 0) {
+    size_t chunk_size = std::min<uint64_t>(upload_remaining_, upload_buffer_.size());
+    ssize_t bytes_received = transport_->Receive(upload_buffer_.data(), chunk_size);
+
+    if (bytes_received == 0) {
+      std::cout << "Client disconnected during PUSH" << "\n";
+      return IoResult::Closed;
+    } else if (bytes_received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return IoResult::WouldBlock;
+    } else if (bytes_received < 0 && errno == EINTR) {
+      continue;
+    } else if (bytes_received < 0) {
+      std::cerr << "recv() failed: " << std::strerror(errno) << "\n";
+      return IoResult::Closed;
+    }
+
+    upload_hash_.add(upload_buffer_.data(), bytes_received);
+    upload_remaining_ -= bytes_received;
+
+    for (ssize_t written = 0; written < bytes_received;) {
+      ssize_t n = write(upload_fd_, upload_buffer_.data() + written, bytes_received - written);
+      if (n < 0 && errno != EINTR) {
+        std::cerr << "PUSH: write() failed for " << upload_temp_path_ << ": " << std::strerror(errno) << "\n";
+        return IoResult::Closed;
+      }
+      written += std::max<ssize_t>(n, 0);
+    }
+  }
+
+  FinishUpload();
+  return IoResult::Done;
+}
+
+void Connection::FinishUpload() {
+  protocol::PushStatus status = protocol::PushStatus::OK;
+  protocol::Digest digest;
+  upload_hash_.getHash(digest.data());
+
+  close(upload_fd_);
+  upload_fd_ = -1;
+
+  // Publish atomically: readers see either the old file or the complete new one
+  std::error_code ec;
+  if (digest != upload_file_.hash) {
+    std::cerr << "PUSH: hash mismatch for " << upload_file_.name << "\n";
+    status = protocol::PushStatus::REJECTED;
+  } else if (std::filesystem::rename(upload_temp_path_, data_dir_ / upload_file_.name, ec); ec) {
+    std::cerr << "PUSH: unable to store " << upload_file_.name << ": " << ec.message() << "\n";
+    status = protocol::PushStatus::REJECTED;
+  }
+
+  if (status != protocol::PushStatus::OK) {
+    unlink(upload_temp_path_.c_str());
+  }
+
+  NewPayload().push_back(static_cast<uint8_t>(status));
+  QueueMessage(protocol::Command::PUSH);
+  state_ = State::Writing;
+}
+
+Connection::IoResult Connection::Write() {
+  while (true) {
+    while (out_header_offset_ < out_header_size_ || (send_buffer_ && send_offset_ < send_buffer_->size())) {
+      int flags;
+      int count = GatherOutput(flags);
+      ssize_t bytes_sent = transport_->Send(iovecs_.data(), count, flags);
+
+      if (bytes_sent >= 0) {
+        ConsumeOutput(bytes_sent);
+      } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return IoResult::WouldBlock;
+      } else if (errno != EINTR) {
+        std::cerr << "send() failed: " << std::strerror(errno) << "\n";
+        return IoResult::Closed;
+      }
+    }
+
+    out_header_size_ = 0;
+    out_header_offset_ = 0;
+    send_buffer_.reset();
+    send_offset_ = 0;
+
+    if (!compressing_) {
+      break;
+    } else if (++turn_blocks_ > kCompressedBlocksPerTurn) {
+      yielded_ = true;
+      return IoResult::WouldBlock;
+    } else if (!CompressNextBlock()) {
+      return IoResult::Closed;
+    }
+  }
+
+  if (!file_fds_.empty()) {
+    IoResult result = SendFileBody();
+    if (result != IoResult::Done) {
+      return result;
+    }
+  }
+
+  if (!pending_files_.empty()) {
+    return QueueNextPullFile() ? IoResult::Done : IoResult::Closed;
+  }
+
+  if (list_snapshot_ && next_list_batch_ < list_snapshot_->list_batches.size()) {
+    // Batches compressed here take turns like the blocks of a compressed file
+    if (compressor_ && !sending_list_batches_ && ++turn_blocks_ > kCompressedBlocksPerTurn) {
+      yielded_ = true;
+      return IoResult::WouldBlock;
+    }
+    return QueueNextListBatch() ? IoResult::Done : IoResult::Closed;
+  }
+  list_snapshot_.reset();
+
+  if (header_.command == protocol::Command::LIST) {
+    std::cout << "LIST completed." << "\n";
+  } else if (header_.command == protocol::Command::LIST_SINCE) {
+    std::cout << "LIST_SINCE completed." << "\n";
+  } else if (header_.command == protocol::Command::PULL || header_.command == protocol::Command::PULL_RANGE) {
+    std::cout << "PULL operation completed." << "\n";
+  } else if (header_.command == protocol::Command::PUSH) {
+    std::cout << "PUSH completed: " << upload_file_.name << "\n";
+  } else if (header_.command == protocol::Command::DELTA) {
+    std::cout << "DELTA completed." << "\n";
+  } else if (header_.command == protocol::Command::FETCH) {
+    std::cout << "FETCH completed." << "\n";
+  }
+
+  state_ = State::ReadingHeader;
+  return IoResult::Done;
+}
+
+void Connection::Dispatch() {
+  std::cout << "Received command: " << static_cast<int>(header_.command) << "\n";
+
+  // Nothing of the previous request is alive any more; pending_files_ drops
+  // its storage first so it never points into the released arena
+  pending_files_ = std::pmr::vector<protocol::pmr::FileSpan>(&request_arena_);
+  request_arena_.release();
+
+  if (protocol_version_ < protocol::kProtocolV2 && RequiresV2(header_.command)) {
+    std::cerr << "Command " << static_cast<int>(header_.command) << " requires protocol v2" << "\n";
+    state_ = State::Closed;
+    return;
+  }
+
+  switch (header_.command) {
+    case protocol::Command::LIST: {
+      HandleList();
+      break;
+    }
+    case protocol::Command::LIST_SINCE: {
+      HandleListSince();
+      break;
+    }
+    case protocol::Command::PULL:
+    case protocol::Command::PULL_RANGE: {
+      HandlePull();
+      break;
+    }
+    case protocol::Command::DELTA: {
+      HandleDelta();
+      break;
+    }
+    case protocol::Command::CHUNKS: {
+      HandleChunks();
+      break;
+    }
+    case protocol::Command::FETCH: {
+      HandleFetch();
+      break;
+    }
+    case protocol::Command::HELLO: {
+      HandleHello();
+      break;
+    }
+    case protocol::Command::LEAVE: {
+      std::cout << "Client connection closed." << "\n";
+      state_ = State::Closed;
+      break;
+    }
+    default:
+      std::cout << "Unknown command received: " << static_cast<int>(header_.command) << "\n";
+      state_ = State::ReadingHeader;
+  }
+}
+
+void Connection::HandleHello() {
+  // HELLO travels in v1 framing and carries the client's highest version in
+  // the low byte of payload_size, the features it offers above that
+  uint8_t requested_version = static_cast<uint8_t>(std::min<uint64_t>(header_.payload_size & protocol::kHelloVersionMask, protocol::kProtocolVersion));
+  uint8_t negotiated_version = std::max(protocol::kProtocolV1, requested_version);
+  bool compress = negotiated_version >= protocol::kProtocolV2 && (header_.payload_size & protocol::kHelloZstd) != 0;
+  list_batches_ = negotiated_version >= protocol::kProtocolV2 && (header_.payload_size & protocol::kHelloListBatches) != 0;
+  list_since_ = negotiated_version >= protocol::kProtocolV2 && (header_.payload_size & protocol::kHelloListSince) != 0;
+
+  protocol::MessageHeader reply {
+    .command = protocol::Command::HELLO,
+    .payload_size = negotiated_version | (compress ? protocol::kHelloZstd : 0) | (list_batches_ ? protocol::kHelloListBatches : 0) |
+                    (list_since_ ? protocol::kHelloListSince : 0)
+  };
+  QueueHeader(reply, protocol::kProtocolV1);
+
+  if (compress) {
+    compressor_ = std::make_unique<Compressor>();
+  }
+
+  // The reply is already serialized, everything after it uses the new framing
+  protocol_version_ = negotiated_version;
+  std::cout << "Negotiated protocol version " << static_cast<int>(protocol_version_) << (compress ? " with compression" : "")
+            << (list_batches_ ? ", batched LIST" : "") << (list_since_ ? ", LIST_SINCE" : "") << "\n";
+  state_ = State::Writing;
+}
+
+void Connection::HandleList() {
+  // The catalog keeps the response serialized in batches, so LIST only sends
+  // them, with the snapshot held until the last one is out: as batched LIST
+  // messages, or as the entries of a single message after one count
+  std::shared_ptr<const CatalogSnapshot> snapshot = catalog_.Get();
+  if (list_batches_) {
+    list_snapshot_ = std::move(snapshot);
+    next_list_batch_ = 0;
+    sending_list_batches_ = true;
+    QueueNextListBatch();
+    state_ = State::Writing;
+    return;
+  }
+
+  protocol::AppendCount(NewPayload(), snapshot->file_count, protocol_version_);
+  if (!QueueListEntries(protocol::Command::LIST, std::move(snapshot))) {
+    std::cerr << "LIST: unable to compress the catalog" << "\n";
+    state_ = State::Closed;
+    return;
+  }
+  state_ = State::Writing;
+}
+
+bool Connection::QueueListEntries(protocol::Command command, std::shared_ptr<const CatalogSnapshot> snapshot) {
+  uint64_t body_size = snapshot->list_entry_bytes[protocol_version_ - 1];
+  sending_list_batches_ = false;
+  next_list_batch_ = 0;
+  // With nothing listed, the payload is the whole message (and closes the compressed frame itself)
+  if (body_size > 0) {
+    list_snapshot_ = std::move(snapshot);
+  }
+
+  if (!compressor_) {
+    QueueMessage(command, body_size);
+    return true;
+  }
+  return QueueCompressedMessage(command, body_size);
+}
+
+bool Connection::QueueNextListBatch() {
+  bool last = next_list_batch_ + 1 == list_snapshot_->list_batches.size();
+  std::shared_ptr<const ListBatch> batch = list_snapshot_->list_batches[next_list_batch_++];
+
+  if (sending_list_batches_) {
+    const std::vector<uint8_t>* message = &batch->messages[protocol::kProtocolV2 - 1];
+    if (compressor_ && !batch->compressed_message.empty()) {
+      message = &batch->compressed_message;
+    }
+    send_buffer_ = std::shared_ptr<const std::vector<uint8_t>>(batch, message);
+    send_offset_ = 0;
+    return true;
+  }
+
+  if (!compressor_) {
+    send_buffer_ = std::shared_ptr<const std::vector<uint8_t>>(batch, &batch->messages[protocol_version_ - 1]);
+    send_offset_ = batch->entries_offset[protocol_version_ - 1];
+    return true;
+  }
+
+  // The entries continue the frame the payload opened, and the last, empty batch closes it
+  std::span<const uint8_t> entries = batch->Entries(protocol_version_);
+  compressed_->clear();
+  if (!compressor_->Compress(entries.data(), entries.size(), last, *compressed_)) {
+    std::cerr << "Unable to compress the catalog" << "\n";
+    return false;
+  }
+  send_buffer_ = compressed_;
+  send_offset_ = 0;
+  return true;
+}
+
+void Connection::HandleListSince() {
+  if (!list_since_) {
+    std::cerr << "LIST_SINCE was not negotiated" << "\n";
+    state_ = State::Closed;
+    return;
+  }
+
+  std::optional<protocol::ListSinceRequest> request = protocol::DeserializeListSinceRequest(payload_buffer_);
+  if (!request) {
+    std::cerr << "LIST_SINCE: malformed request" << "\n";
+    state_ = State::Closed;
+    return;
+  }
+  std::shared_ptr<const CatalogSnapshot> snapshot = catalog_.Get();
+
+  // Only the changes the client has not seen, or the whole catalog when the log cannot tell
+  std::vector<uint8_t>& payload = NewPayload();
+  protocol::ListSincePrefix prefix { .epoch = snapshot->epoch, .version = snapshot->version, .kind = protocol::ListSinceKind::CHANGES };
+  protocol::AppendListSincePrefix(payload, prefix);
+
+  if (!snapshot->AppendChangesSince(request->epoch, request->version, payload)) {
+    prefix.kind = protocol::ListSinceKind::FULL;
+    payload.clear();
+    protocol::AppendListSincePrefix(payload, prefix);
+    protocol::AppendCount(payload, snapshot->file_count, protocol::kProtocolV2);
+  }
+
+  std::cout << "LIST_SINCE: version " << request->version << " -> " << snapshot->version
+            << (prefix.kind == protocol::ListSinceKind::FULL ? ", full catalog" : ", changes only") << "\n";
+
+  if (prefix.kind != protocol::ListSinceKind::FULL) {
+    QueueMessage(protocol::Command::LIST_SINCE);
+  } else if (!QueueListEntries(protocol::Command::LIST_SINCE, std::move(snapshot))) {
+    std::cerr << "LIST_SINCE: unable to compress the catalog" << "\n";
+    state_ = State::Closed;
+    return;
+  }
+  state_ = State::Writing;
+}
+
+void Connection::HandlePull() {
+  // Files are sent one at a time as the previous one drains, so a large PULL
+  // never holds more than a single file in memory; the next one is prefetched
+  if (header_.command == protocol::Command::PULL_RANGE) {
+    std::optional<protocol::pmr::PullRangeRequest> request = protocol::DeserializePullRangeRequest(payload_buffer_, protocol_version_, &request_arena_);
+    if (!request) {
+      std::cerr << "PULL_RANGE: malformed request" << "\n";
+      state_ = State::Closed;
+      return;
+    }
+    pending_files_.assign(request->files.rbegin(), request->files.rend());
+  } else {
+    std::optional<protocol::pmr::PullRequest> request = protocol::DeserializePullRequest(payload_buffer_, protocol_version_, &request_arena_);
+    if (!request) {
+      std::cerr << "PULL: malformed request" << "\n";
+      state_ = State::Closed;
+      return;
+    }
+    pending_files_.reserve(request->files.size());
+    for (auto it = request->files.rbegin(); it != request->files.rend(); ++it) {
+      pending_files_.push_back({ .header = *it, .offset = 0, .length = 0 });
+    }
+  }
+
+  if (pending_files_.empty()) {
+    std::cout << "PULL operation completed." << "\n";
+    state_ = State::ReadingHeader;
+    return;
+  }
+
+  state_ = QueueNextPullFile() ? State::Writing : State::Closed;
+}
+
+void Connection::HandleDelta() {
+  std::optional<protocol::pmr::DeltaRequest> parsed = protocol::DeserializeDeltaRequest(payload_buffer_, protocol_version_, &request_arena_);
+  if (!parsed) {
+    std::cerr << "DELTA: malformed request" << "\n";
+    state_ = State::Closed;
+    return;
+  }
+  protocol::pmr::DeltaRequest& request = *parsed;
+
+  if (request.block_size == 0 || request.block_size > kMaxDeltaBlockSize) {
+    std::cerr << "DELTA: rejected block size " << request.block_size << "\n";
+    state_ = State::Closed;
+    return;
+  }
+
+  off_t size;
+  int fd = OpenPullFile(request.header, size);
+  if (fd < 0) {
+    std::cerr << "DELTA: unable to open " << request.header.name << ": " << std::strerror(errno) << "\n";
+    state_ = State::Closed;
+    return;
+  }
+
+  // The rolling checksum runs over the same mapping the literals are later compressed from
+  file_fds_.push_back(fd);
+  protocol::pmr::DeltaResponse response { .header = request.header, .size = static_cast<uint64_t>(size),
+                                          .instructions = std::pmr::vector<protocol::DeltaInstruction>(&request_arena_) };
+  if (size > 0) {
+    const MappedFile* mapping = Mapping(fd);
+    if (!mapping || mapping->size() < static_cast<uint64_t>(size)) {
+      std::cerr << "DELTA: unable to map " << request.header.name << "\n";
+      state_ = State::Closed;
+      return;
+    }
+
+    // Everything ComputeDelta() allocates comes from request_arena_, so a fault leaks nothing
+    bool complete = GuardMappedReads([&] {
+      response.instructions = ComputeDelta(mapping->data(), size, request.block_size, request.blocks, &request_arena_);
+    });
+    if (!complete) {
+      std::cerr << "DELTA: " << request.header.name << " was truncated while being read" << "\n";
+      state_ = State::Closed;
+      return;
+    }
+  }
+
+  // Literal bytes follow the instructions, sent straight from the file
+  uint64_t literal_bytes = 0;
+  for (const auto& instruction : response.instructions) {
+    if (instruction.op == protocol::DeltaOp::LITERAL) {
+      off_t offset = static_cast<off_t>(instruction.offset);
+      file_ranges_.push_back({ .fd = fd, .offset = offset, .end = offset + static_cast<off_t>(instruction.length) });
+      literal_bytes += instruction.length;
+    }
+  }
+
+  std::cout << "DELTA: " << request.header.name << " needs " << literal_bytes << " of " << size << " bytes" << "\n";
+
+  protocol::AppendDeltaResponsePrefix(NewPayload(), response, protocol_version_);
+
+  if (!compressor_ || !IsCompressible(request.header.name, fd, 0, size)) {
+    QueueMessage(protocol::Command::DELTA, literal_bytes);
+  } else if (!QueueCompressedMessage(protocol::Command::DELTA, literal_bytes)) {
+    std::cerr << "DELTA: unable to compress " << request.header.name << "\n";
+    state_ = State::Closed;
+    return;
+  }
+  state_ = State::Writing;
+}
+
+void Connection::HandleChunks() {
+  std::optional<protocol::FileHeader> parsed = protocol::DeserializeFileHeader(payload_buffer_, protocol_version_);
+  if (!parsed) {
+    std::cerr << "CHUNKS: malformed request" << "\n";
+    state_ = State::Closed;
+    return;
+  }
+  protocol::FileHeader& file = *parsed;
+  if (!IsValidFileName(file.name)) {
+    std::cerr << "CHUNKS: invalid file name " << file.name << "\n";
+    state_ = State::Closed;
+    return;
+  }
+
+  // Recipes are made by the chunking thread; until one is published the empty
+  // list sends the client to PULL instead of chunking the file here
+  std::shared_ptr<const ChunkStore::Snapshot> chunks = catalog_.chunks();
+  const std::shared_ptr<const ChunkStore::Recipe>* recipe = chunks->recipes.Find(file.name);
+  protocol::ChunkList list { .header = file, .size = 0, .chunks = {} };
+
+  if (recipe) {
+    // The hash describes the content the chunks were cut from, which may be newer than the LIST the client saw
+    list.header.hash = (*recipe)->file_hash;
+    list.size = (*recipe)->size;
+    list.chunks = (*recipe)->chunks;
+  } else {
+    std::cout << "CHUNKS: " << file.name << " is not chunked, the client will PULL it" << "\n";
+  }
+
+  protocol::AppendChunkList(NewPayload(), list, protocol_version_);
+  QueueMessage(protocol::Command::CHUNKS);
+  state_ = State::Writing;
+}
+
+void Connection::HandleFetch() {
+  std::optional<protocol::pmr::FetchRequest> parsed = protocol::DeserializeFetchRequest(payload_buffer_, &request_arena_);
+  if (!parsed) {
+    std::cerr << "FETCH: malformed request" << "\n";
+    state_ = State::Closed;
+    return;
+  }
+  protocol::pmr::FetchRequest& request = *parsed;
+  std::shared_ptr<const ChunkStore::Snapshot> chunks = catalog_.chunks();
+
+  // Every chunk is sent straight from whichever file holds it, each file opened
+  // once and checked once for whether its bytes are worth compressing
+  struct Source {
+    int fd;
+    bool compressible;
+  };
+  std::pmr::unordered_map<std::string_view, Source> sources(&request_arena_);
+  uint64_t body_size = 0;
+  uint64_t compressible_size = 0;
+
+  for (const auto& chunk : request.chunks) {
+    const ChunkStore::Location* found = chunks->locations.Find(chunk);
+    if (!found) {
+      std::cerr << "FETCH: no file holds chunk " << DigestToHex(chunk) << "\n";
+      state_ = State::Closed;
+      return;
+    }
+
+    const ChunkStore::Location& location = *found;
+    auto [it, inserted] = sources.try_emplace(location.file_name, Source{ .fd = -1, .compressible = false });
+    Source& source = it->second;
+
+    if (inserted) {
+      std::filesystem::path file_path = data_dir_ / location.file_name;
+      struct stat st;
+      if ((source.fd = open(file_path.c_str(), O_RDONLY | O_CLOEXEC)) < 0) {
+        std::cerr << "FETCH: unable to open " << location.file_name << ": " << std::strerror(errno) << "\n";
+        state_ = State::Closed;
+        return;
+      }
+      file_fds_.push_back(source.fd);
+      source.compressible = compressor_ && fstat(source.fd, &st) == 0 && IsCompressible(location.file_name, source.fd, 0, st.st_size);
+    }
+
+    // Chunks requested in file order continue each other, so they go out as one range
+    off_t offset = static_cast<off_t>(location.offset);
+    if (!file_ranges_.empty() && file_ranges_.back().fd == source.fd && file_ranges_.back().end == offset) {
+      file_ranges_.back().end += location.length;
+    } else {
+      file_ranges_.push_back({ .fd = source.fd, .offset = offset, .end = offset + static_cast<off_t>(location.length) });
+    }
+    body_size += location.length;
+    compressible_size += source.compressible ? location.length : 0;
+  }
+
+  // A batch is compressed as a whole when most of it comes from compressible files
+  NewPayload();
+  if (compressible_size == 0 || compressible_size * 2 < body_size) {
+    QueueMessage(protocol::Command::FETCH, body_size);
+  } else if (!QueueCompressedMessage(protocol::Command::FETCH, body_size)) {
+    std::cerr << "FETCH: unable to compress chunks" << "\n";
+    state_ = State::Closed;
+    return;
+  }
+  state_ = State::Writing;
+}
+
+bool Connection::QueueNextPullFile() {
+  protocol::pmr::FileSpan span = pending_files_.back();
+  pending_files_.pop_back();
+
+  int fd;
+  off_t size;
+
+  if (prefetch_fd_ >= 0) {
+    fd = prefetch_fd_;
+    size = prefetch_size_;
+    prefetch_fd_ = -1;
+  } else if ((fd = OpenPullFile(span.header, size)) < 0) {
+    std::cerr << "PULL: unable to open " << span.header.name << ": " << std::strerror(errno) << "\n";
+    return false;
+  }
+
+  // Only the small metadata prefix goes through userspace; the body is sent
+  // straight from the page cache by SendFileBody(), unless it is compressed
+  file_fds_.push_back(fd);
+  std::vector<uint8_t>& prefix = NewPayload();
+  FileRange body { .fd = fd, .offset = 0, .end = size };
+
+  if (header_.command == protocol::Command::PULL_RANGE) {
+    // An offset into content other than what the client holds part of would
+    // splice two versions together; send those files from the start instead.
+    // The hash is the one the catalog published: workers never take the hash
+    // index's lock, and a file changed since is rehashed by the catalog thread
+    // (the client checks the whole file's hash when it is done)
+    std::shared_ptr<const CatalogSnapshot> snapshot = catalog_.Get();
+    const protocol::Digest* listed = snapshot->FileHash(span.header.name);
+    uint64_t offset = span.offset;
+
+    if (!listed || *listed != span.header.hash || offset > static_cast<uint64_t>(size)) {
+      offset = 0;
+    }
+    if (listed) {
+      span.header.hash = *listed;
+    }
+
+    uint64_t length = size - offset;
+    span.length = span.length == 0 ? length : std::min(span.length, length);
+    span.offset = offset;
+
+    protocol::AppendRangePrefix(prefix, span, size, protocol_version_);
+    body = { .fd = fd, .offset = static_cast<off_t>(offset), .end = static_cast<off_t>(offset + span.length) };
+  } else {
+    protocol::AppendFileContentsPrefix(prefix, span.header, size, protocol_version_);
+  }
+
+  uint64_t body_size = body.end - body.offset;
+
+  if (body_size > 0) {
+    file_ranges_.push_back(body);
+  }
+
+  if (!compressor_ || !IsCompressible(span.header.name, fd, body.offset, body_size)) {
+    QueueMessage(header_.command, body_size);
+  } else if (!QueueCompressedMessage(header_.command, body_size)) {
+    std::cerr << "PULL: unable to compress " << span.header.name << "\n";
+    return false;
+  }
+
+  PrefetchNextPullFile();
+  return true;
+}
+
+// Opens a requested file for sending. Returns -1 with errno set on failure
+int Connection::OpenPullFile(const protocol::FileHeaderView& file, off_t& size) const {
+  // Names come straight from the client and must not escape the data directory
+  if (!IsValidFileName(file.name)) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  std::filesystem::path file_path = data_dir_ / file.name;
+  struct stat st;
+  int fd = open(file_path.c_str(), O_RDONLY | O_CLOEXEC);
+
+  if (fd < 0) {
+    return -1;
+  } else if (fstat(fd, &st) < 0) {
+    int saved_errno = errno;
+    close(fd);
+    errno = saved_errno;
+    return -1;
+  } else if (protocol_version_ == protocol::kProtocolV1 && static_cast<uint64_t>(st.st_size) > kMaxV1FileSize) {
+    close(fd);
+    errno = EFBIG;
+    return -1;
+  }
+
+  size = st.st_size;
+  return fd;
+}
+
+// Opens the next file of the PULL and asks the kernel to start reading it
+// while the current one is on the wire, so sendfile() rarely waits on disk
+void Connection::PrefetchNextPullFile() {
+  if (pending_files_.empty() || (prefetch_fd_ = OpenPullFile(pending_files_.back().header, prefetch_size_)) < 0) {
+    // Failures are reported when the file is actually dequeued
+    return;
+  }
+
+#if defined(POSIX_FADV_WILLNEED)
+  posix_fadvise(prefetch_fd_, 0, prefetch_size_, POSIX_FADV_WILLNEED);
+#elif defined(F_RDADVISE)
+  radvisory advice { .ra_offset = 0, .ra_count = static_cast<int>(std::min<off_t>(prefetch_size_, INT_MAX)) };
+  fcntl(prefetch_fd_, F_RDADVISE, &advice);
+#endif
+}
+
+Connection::IoResult Connection::SendFileBody() {
+  while (!file_ranges_.empty()) {
+    FileRange& range = file_ranges_.front();
+    if (range.offset == range.end) {
+      file_ranges_.pop_front();
+      continue;
+    }
+
+    ssize_t bytes_sent;
+    const MappedFile* mapping = transport_->zero_copy_send_file() ? nullptr : Mapping(range.fd);
+
+    if (mapping && static_cast<uint64_t>(range.end) <= mapping->size()) {
+      // Without a real sendfile(), sending the mapped pages saves reading them first
+      int flags;
+      int count = GatherOutput(flags);
+      bytes_sent = transport_->Send(iovecs_.data(), count, flags);
+      ConsumeOutput(std::max<ssize_t>(bytes_sent, 0));
+    } else {
+      bytes_sent = transport_->SendFile(range.fd, &range.offset, range.end - range.offset);
+    }
+
+    if (bytes_sent == 0) {
+      std::cerr << "sendfile() hit end of file early, was it truncated?" << "\n";
+      return IoResult::Closed;
+    } else if (bytes_sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return IoResult::WouldBlock;
+    } else if (bytes_sent < 0 && errno != EINTR) {
+      std::cerr << "sendfile() failed: " << std::strerror(errno) << "\n";
+      return IoResult::Closed;
+    }
+  }
+
+  for (int fd : file_fds_) {
+    close(fd);
+  }
+  file_fds_.clear();
+  mappings_.clear();
+  return IoResult::Done;
+}
+
+// Reads the next pieces of file_ranges_ and queues the blocks they compress
+// to; false if a file cannot be read or zstd fails
+bool Connection::CompressNextBlock() {
+  std::shared_ptr<std::vector<uint8_t>> blocks = compressed_;
+  blocks->clear();
+
+  // zstd holds input back until it fills a block, so keep feeding it until something comes out
+  while (compressing_ && blocks->empty()) {
+    FileRange& range = file_ranges_.front();
+    size_t piece = std::min<off_t>(range.end - range.offset, kCompressInputSize);
+    const MappedFile* mapping = Mapping(range.fd);
+    const uint8_t* input;
+    bool mapped = mapping && static_cast<uint64_t>(range.end) <= mapping->size();
+
+    if (mapped) {
+      // zstd reads the mapped pages directly
+      input = mapping->data() + range.offset;
+    } else {
+      compress_input_.resize(kCompressInputSize);
+      ssize_t bytes_read = piece > 0 ? pread(range.fd, compress_input_.data(), piece, range.offset) : 0;
+
+      if (bytes_read < 0 && errno == EINTR) {
+        continue;
+      } else if (bytes_read < 0 || (bytes_read == 0 && piece > 0)) {
+        std::cerr << "Unable to read file to compress, was it truncated?" << "\n";
+        return false;
+      }
+      input = compress_input_.data();
+      piece = bytes_read;
+    }
+
+    range.offset += piece;
+    if (range.offset == range.end) {
+      file_ranges_.pop_front();
+    }
+
+    compressing_ = !file_ranges_.empty();
+    bool compressed = false;
+    bool end = !compressing_;
+    if (!mapped) {
+      compressed = compressor_->Compress(input, piece, end, *blocks);
+    } else if (!GuardMappedReads([&] { compressed = compressor_->Compress(input, piece, end, *blocks); })) {
+      // The compressor is left mid-frame, but the connection is closed along with it
+      std::cerr << "Unable to read file to compress, was it truncated?" << "\n";
+      return false;
+    }
+    if (!compressed) {
+      std::cerr << "Compression failed" << "\n";
+      return false;
+    }
+  }
+
+  send_buffer_ = std::move(blocks);
+  send_offset_ = 0;
+  return true;
+}
+
+// Fills iovecs_ with what is left of the header and send_buffer_, followed by
+// the file ranges the transport would send from mappings anyway, so one send
+// covers all of a small response. Sets MSG_MORE in flags if output remains
+int Connection::GatherOutput(int& flags) {
+  int count = 0;
+  if (out_header_offset_ < out_header_size_) {
+    iovecs_[count++] = { out_header_.data() + out_header_offset_, out_header_size_ - out_header_offset_ };
+  }
+  if (send_buffer_ && send_offset_ < send_buffer_->size()) {
+    iovecs_[count++] = { const_cast<uint8_t*>(send_buffer_->data()) + send_offset_, send_buffer_->size() - send_offset_ };
+  }
+
+  // Compressed responses only read their ranges; sendfile() beats copying them
+  bool complete = file_ranges_.empty() && !compressing_;
+  if (!compressing_ && !transport_->zero_copy_send_file()) {
+    size_t gathered = 0;
+    for (const FileRange& range : file_ranges_) {
+      const MappedFile* mapping = count < kMaxGather ? Mapping(range.fd) : nullptr;
+      if (!mapping || static_cast<uint64_t>(range.end) > mapping->size()) {
+        break;
+      }
+
+      // The kernel copies these pages itself: a truncated file fails the send with EFAULT instead of raising SIGBUS
+      off_t length = std::min(range.end - range.offset, kMappedSendSize);
+      iovecs_[count++] = { const_cast<uint8_t*>(mapping->data()) + range.offset, static_cast<size_t>(length) };
+      if (length < range.end - range.offset) {
+        break;
+      }
+      gathered++;
+    }
+    complete = gathered == file_ranges_.size();
+  }
+
+  // Hold back a PULL prefix so it leaves in the same segment as the start of
+  // the body instead of stalling small files behind Nagle and delayed ACKs
+  flags = 0;
+#if defined(MSG_MORE)
+  flags = complete ? 0 : MSG_MORE;
+#endif
+  return count;
+}
+
+// Advances past `bytes` of what GatherOutput() handed to the transport
+void Connection::ConsumeOutput(size_t bytes) {
+  size_t length = std::min(bytes, out_header_size_ - out_header_offset_);
+  out_header_offset_ += length;
+  bytes -= length;
+
+  if (send_buffer_) {
+    length = std::min(bytes, send_buffer_->size() - send_offset_);
+    send_offset_ += length;
+    bytes -= length;
+  }
+
+  while (bytes > 0) {
+    FileRange& range = file_ranges_.front();
+    length = std::min<uint64_t>(bytes, range.end - range.offset);
+    range.offset += length;
+    bytes -= length;
+    if (range.offset == range.end) {
+      file_ranges_.pop_front();
+    }
+  }
+}
+
+// Mapping of a file being sent, looked up in the worker's cache once per response
+const MappedFile* Connection::Mapping(int fd) {
+  auto [it, inserted] = mappings_.try_emplace(fd);
+  if (inserted) {
+    it->second = catalog_.mapping_cache().Get(fd);
+  }
+  return it->second.get();
+}
+
+std::vector<uint8_t>& Connection::NewPayload() {
+  payload_->clear();
+  // One huge payload (a long chunk list) is not worth keeping for the rest of the connection
+  if (payload_->capacity() > kMaxKeptPayloadSize) {
+    payload_->shrink_to_fit();
+  }
+  return *payload_;
+}
+
+void Connection::QueueMessage(protocol::Command command, uint64_t body_size) {
+  protocol::MessageHeader header {
+    .command = command,
+    .payload_size = payload_->size() + body_size
+  };
+
+  QueueHeader(header, protocol_version_);
+  send_buffer_ = payload_;
+  send_offset_ = 0;
+}
+
+bool Connection::QueueCompressedMessage(protocol::Command command, uint64_t body_size) {
+  // The header announces the plain size. The payload opens the frame and
+  // CompressNextBlock() adds the body as the socket drains, or for a catalog
+  // listing QueueNextListBatch() adds the batches' entries
+  protocol::MessageHeader header {
+    .command = protocol::Compressed(command),
+    .payload_size = payload_->size() + body_size
+  };
+
+  QueueHeader(header, protocol_version_);
+  compressed_->clear();
+  if (!compressor_->Compress(payload_->data(), payload_->size(), body_size == 0, *compressed_)) {
+    return false;
+  }
+
+  send_buffer_ = compressed_;
+  send_offset_ = 0;
+  compressing_ = body_size > 0 && !file_ranges_.empty();
+  return true;
+}
+
+void Connection::QueueHeader(const protocol::MessageHeader& header, uint8_t version) {
+  protocol::SerializeHeader(header, version, out_header_.data());
+  out_header_size_ = protocol::HeaderSize(version);
+  out_header_offset_ = 0;
+  send_buffer_.reset();
+  send_offset_ = 0;
+}
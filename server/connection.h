@@ -0,0 +1,174 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <memory>
+#include <memory_resource>
+#include <unordered_map>
+#include <vector>
+#include "catalog.h"
+#include "transport.h"
+#include "protocol/protocol.h"
+#include "utils/compression.h"
+#include "utils/mapped_file.h"
+#include "utils/sha256.h"
+
+// Per-client state machine driven by the event loop. A connection alternates
+// between reading a request (header, then payload) and writing its response;
+// all socket I/O goes through a non-blocking Transport so one slow client never
+// stalls the others.
+// PUSH uploads are streamed to disk instead of being read as one payload, and
+// compressed responses read their file bytes a block at a time as the socket drains,
+// straight from mapped files where possible.
+class Connection {
+ public:
+  enum class State { ReadingHeader, ReadingPayload, ReadingUploadPrefix, ReadingUploadBody, Writing, Closed };
+
+  Connection(int socket, std::unique_ptr<Transport> transport, const std::filesystem::path& data_dir, CatalogReader& catalog);
+  ~Connection();
+  Connection(const Connection&) = delete;
+  Connection& operator=(const Connection&) = delete;
+
+  // Makes as much progress as the socket allows without blocking.
+  // Returns false once the connection is finished and should be destroyed.
+  bool OnReady();
+
+  // Whether the last OnReady() stopped with work left so other connections get
+  // a turn. No readiness event will come for it, so it must be called again.
+  bool yielded() const { return yielded_; }
+
+  int socket() const { return socket_; }
+
+ private:
+  enum class IoResult { Done, WouldBlock, Closed };
+
+  IoResult ReadHeader();
+  IoResult ReadPayload();
+  IoResult ReadUploadPrefix();
+  IoResult ReadUploadBody();
+  void FinishUpload();
+  IoResult Write();
+  IoResult Receive(uint8_t* buffer, size_t size, size_t& offset);
+
+  void Dispatch();
+  void HandleHello();
+  void HandleList();
+  // Queues the NewPayload() followed by the entries of every batch of `snapshot` as one message
+  bool QueueListEntries(protocol::Command command, std::shared_ptr<const CatalogSnapshot> snapshot);
+  // False if the batch had to be compressed and zstd failed
+  bool QueueNextListBatch();
+  void HandleListSince();
+  void HandlePull();
+  void HandleDelta();
+  void HandleChunks();
+  void HandleFetch();
+  bool QueueNextPullFile();
+  int OpenPullFile(const protocol::FileHeaderView& file, off_t& size) const;
+  void PrefetchNextPullFile();
+  IoResult SendFileBody();
+  bool CompressNextBlock();
+  const MappedFile* Mapping(int fd);
+  int GatherOutput(int& flags);
+  void ConsumeOutput(size_t bytes);
+  // Empty buffer to serialize the next message's payload into
+  std::vector<uint8_t>& NewPayload();
+  // Queues a message header and the NewPayload(); body_size more bytes will follow from file_ranges_
+  void QueueMessage(protocol::Command command, uint64_t body_size = 0);
+  // Same, but the payload and the body go out as one zstd frame. False if zstd failed
+  bool QueueCompressedMessage(protocol::Command command, uint64_t body_size);
+  void QueueHeader(const protocol::MessageHeader& header, uint8_t version);
+
+  int socket_;
+  std::unique_ptr<Transport> transport_;
+  const std::filesystem::path& data_dir_;
+  CatalogReader& catalog_;
+  State state_ = State::ReadingHeader;
+  bool yielded_ = false;
+
+  // Every connection starts in v1 framing until a HELLO negotiates otherwise
+  uint8_t protocol_version_ = protocol::kProtocolV1;
+
+  std::array<uint8_t, protocol::kMaxHeaderSize> header_buffer_;
+  size_t header_offset_ = 0;
+  protocol::MessageHeader header_;
+
+  std::vector<uint8_t> payload_buffer_;
+  size_t payload_offset_ = 0;
+
+  // Objects that only live while one request is served (parsed requests,
+  // pending files, delta instructions) are carved out of this arena and freed
+  // all at once before the next request is dispatched. Requests that fit the
+  // inline buffer never touch the heap; names point into payload_buffer_.
+  static constexpr size_t kRequestArenaSize = 8 * 1024;
+  std::array<std::byte, kRequestArenaSize> request_arena_buffer_;
+  std::pmr::monotonic_buffer_resource request_arena_{request_arena_buffer_.data(), request_arena_buffer_.size()};
+
+  // Header of the message being written; it goes out ahead of send_buffer_
+  std::array<uint8_t, protocol::kMaxHeaderSize> out_header_;
+  size_t out_header_size_ = 0;
+  size_t out_header_offset_ = 0;
+
+  // Shared so a LIST can send the catalog's prebuilt response without copying it
+  std::shared_ptr<const std::vector<uint8_t>> send_buffer_;
+  size_t send_offset_ = 0;
+
+  // Payloads are serialized (and compressed) into these and sent from them,
+  // reused message after message so steady-state responses allocate nothing
+  std::shared_ptr<std::vector<uint8_t>> payload_ = std::make_shared<std::vector<uint8_t>>();
+  std::shared_ptr<std::vector<uint8_t>> compressed_ = std::make_shared<std::vector<uint8_t>>();
+
+  // Header, payload and file ranges that leave in the next send
+  static constexpr int kMaxGather = 64;
+  std::array<iovec, kMaxGather> iovecs_;
+
+  // Byte ranges of open files that follow send_buffer_ on the wire: a whole
+  // file for PULL, the literals for DELTA, chunks of several files for FETCH
+  struct FileRange {
+    int fd;
+    off_t offset;
+    off_t end;
+  };
+  std::deque<FileRange> file_ranges_;
+  // Descriptors the ranges read from, closed once everything is sent
+  std::vector<int> file_fds_;
+  // Mappings of those files, from the worker's cache; null where mapping failed
+  std::unordered_map<int, std::shared_ptr<const MappedFile>> mappings_;
+
+  // Set when HELLO negotiated batched LIST responses
+  bool list_batches_ = false;
+  // Set when HELLO negotiated LIST_SINCE
+  bool list_since_ = false;
+  // Snapshot whose batches the current LIST (or full LIST_SINCE) is sending, and the next one to send
+  std::shared_ptr<const CatalogSnapshot> list_snapshot_;
+  size_t next_list_batch_ = 0;
+  // Whether they go out as batched LIST messages, or only their entries as the body of one message
+  bool sending_list_batches_ = false;
+
+  // Set when HELLO negotiated compression
+  std::unique_ptr<Compressor> compressor_;
+  // Whether file_ranges_ are being read into compressor_ instead of sent as they are
+  bool compressing_ = false;
+  std::vector<uint8_t> compress_input_;
+  // Blocks compressed during the current OnReady()
+  int turn_blocks_ = 0;
+
+  // Files (or parts of them, for PULL_RANGE) of the current PULL that have not
+  // been queued for sending yet, last one first so the next is popped off the back
+  std::pmr::vector<protocol::pmr::FileSpan> pending_files_{&request_arena_};
+
+  // pending_files_.back(), already opened and being read ahead by the kernel
+  int prefetch_fd_ = -1;
+  off_t prefetch_size_ = 0;
+
+  // File being received by the current PUSH, written under a hidden name until verified
+  int upload_fd_ = -1;
+  std::filesystem::path upload_temp_path_;
+  protocol::FileHeader upload_file_;
+  uint64_t upload_remaining_ = 0;
+  SHA256 upload_hash_;
+  std::vector<uint8_t> upload_buffer_;
+};
@@ -0,0 +1,89 @@
+#include "event_loop.h"
+
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "utils/utils.h"
+
+namespace {
+  void SetNonBlocking(int socket) {
+    int flags = fcntl(socket, F_GETFL, 0);
+    if (flags < 0 || fcntl(socket, F_SETFL, flags | O_NONBLOCK) < 0) {
+      FatalError("fcntl() failed to set O_NONBLOCK");
+    }
+  }
+}
+
+EventLoop::EventLoop(int listen_socket, const std::filesystem::path& data_dir, const Catalog& catalog)
+    : listen_socket_(listen_socket), data_dir_(data_dir), catalog_(catalog) {
+  SetNonBlocking(listen_socket_);
+  poller_.Add(listen_socket_);
+}
+
+void EventLoop::Run() {
+  std::vector<int> ready_fds;
+
+  while (true) {
+    // Yielded connections have work left, so only poll for events without blocking
+    poller_.Wait(ready_fds, yielded_.empty() ? -1 : 0);
+    ready_fds.insert(ready_fds.end(), yielded_.begin(), yielded_.end());
+    yielded_.clear();
+
+    for (int fd : ready_fds) {
+      if (fd == listen_socket_) {
+        AcceptConnections();
+      } else {
+        RunConnection(fd);
+      }
+    }
+  }
+}
+
+void EventLoop::RunConnection(int socket) {
+  auto it = connections_.find(socket);
+  if (it == connections_.end()) {
+    return;
+  } else if (!it->second->OnReady()) {
+    CloseConnection(socket);
+  } else if (it->second->yielded()) {
+    yielded_.push_back(socket);
+  }
+}
+
+void EventLoop::AcceptConnections() {
+  while (true) {
+    sockaddr_in client_address;
+    socklen_t client_length = sizeof(client_address);
+    int client_socket = accept(listen_socket_, (struct sockaddr *)&client_address, &client_length);
+
+    if (client_socket < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return;
+      } else if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      std::cerr << "accept() failed: " << std::strerror(errno) << "\n";
+      return;
+    }
+
+    std::cout << "Accepted connection from " << inet_ntoa(client_address.sin_addr) << ":" << ntohs(client_address.sin_port) << "\n";
+
+    SetNonBlocking(client_socket);
+    auto connection = std::make_unique<Connection>(client_socket, std::make_unique<SocketTransport>(client_socket), data_dir_, catalog_);
+    connections_[client_socket] = std::move(connection);
+    poller_.Add(client_socket);
+
+    // The client may have sent its first request before we started watching the socket
+    RunConnection(client_socket);
+  }
+}
+
+void EventLoop::CloseConnection(int socket) {
+  poller_.Remove(socket);
+  connections_.erase(socket);
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <filesystem>
+#include <memory>
+#include <unordered_map>
+#include "connection.h"
+#include "catalog.h"
+#include "poller.h"
+
+// Single-threaded reactor: accepts clients on a non-blocking listening socket
+// and drives every Connection from edge-triggered readiness events.
+class EventLoop {
+ public:
+  EventLoop(int listen_socket, const std::filesystem::path& data_dir, const Catalog& catalog);
+  void Run();
+
+ private:
+  void AcceptConnections();
+  void RunConnection(int socket);
+  void CloseConnection(int socket);
+
+  Poller poller_;
+  int listen_socket_;
+  const std::filesystem::path& data_dir_;
+  CatalogReader catalog_;
+  std::unordered_map<int, std::unique_ptr<Connection>> connections_;
+  // Connections that yielded and are run again on the next iteration
+  std::vector<int> yielded_;
+};
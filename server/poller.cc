@@ -0,0 +1,107 @@
+#include "poller.h"
+
+#include <array>
+#include <cerrno>
+#include <unistd.h>
+#include "utils/utils.h"
+
+#if defined(__linux__)
+#include <sys/epoll.h>
+#else
+#include <sys/event.h>
+#endif
+
+namespace {
+  constexpr int kMaxEvents = 64;
+}
+
+#if defined(__linux__)
+
+Poller::Poller() {
+  if ((poll_fd_ = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+    FatalError("epoll_create1() failed");
+  }
+}
+
+void Poller::Add(int fd) {
+  epoll_event event{};
+  event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+  event.data.fd = fd;
+
+  if (epoll_ctl(poll_fd_, EPOLL_CTL_ADD, fd, &event) < 0) {
+    FatalError("epoll_ctl() failed to add descriptor");
+  }
+}
+
+void Poller::Remove(int fd) {
+  epoll_ctl(poll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+}
+
+void Poller::Wait(std::vector<int>& ready_fds, int timeout_ms) {
+  std::array<epoll_event, kMaxEvents> events;
+  int n;
+
+  ready_fds.clear();
+  while ((n = epoll_wait(poll_fd_, events.data(), events.size(), timeout_ms)) < 0) {
+    if (errno != EINTR) {
+      FatalError("epoll_wait() failed");
+    }
+  }
+
+  for (int i = 0; i < n; i++) {
+    ready_fds.push_back(events[i].data.fd);
+  }
+}
+
+#else
+
+Poller::Poller() {
+  if ((poll_fd_ = kqueue()) < 0) {
+    FatalError("kqueue() failed");
+  }
+}
+
+void Poller::Add(int fd) {
+  struct kevent changes[2];
+  EV_SET(&changes[0], fd, EVFILT_READ, EV_ADD | EV_CLEAR, 0, 0, nullptr);
+  EV_SET(&changes[1], fd, EVFILT_WRITE, EV_ADD | EV_CLEAR, 0, 0, nullptr);
+
+  if (kevent(poll_fd_, changes, 2, nullptr, 0, nullptr) < 0) {
+    FatalError("kevent() failed to add descriptor");
+  }
+}
+
+void Poller::Remove(int fd) {
+  // Errors are ignored: kqueue already dropped the filters if the descriptor was closed
+  struct kevent changes[2];
+  EV_SET(&changes[0], fd, EVFILT_READ, EV_DELETE, 0, 0, nullptr);
+  EV_SET(&changes[1], fd, EVFILT_WRITE, EV_DELETE, 0, 0, nullptr);
+  kevent(poll_fd_, changes, 2, nullptr, 0, nullptr);
+}
+
+void Poller::Wait(std::vector<int>& ready_fds, int timeout_ms) {
+  std::array<struct kevent, kMaxEvents> events;
+  timespec timeout{timeout_ms / 1000, (timeout_ms % 1000) * 1000000L};
+  int n;
+
+  ready_fds.clear();
+  while ((n = kevent(poll_fd_, nullptr, 0, events.data(), events.size(), timeout_ms < 0 ? nullptr : &timeout)) < 0) {
+    if (errno != EINTR) {
+      FatalError("kevent() failed");
+    }
+  }
+
+  // Read and write readiness arrive as separate events; report each descriptor once
+  for (int i = 0; i < n; i++) {
+    int fd = static_cast<int>(events[i].ident);
+    if (ready_fds.empty() || ready_fds.back() != fd) {
+      ready_fds.push_back(fd);
+    }
+  }
+}
+
+#endif
+
+Poller::~Poller() {
+  close(poll_fd_);
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <vector>
+
+// Thin wrapper over the platform readiness API (epoll on Linux, kqueue elsewhere).
+// Every descriptor is watched edge-triggered for both read and write readiness,
+// so callers must drain a descriptor until EAGAIN before waiting again.
+class Poller {
+ public:
+  Poller();
+  ~Poller();
+  Poller(const Poller&) = delete;
+  Poller& operator=(const Poller&) = delete;
+
+  void Add(int fd);
+  void Remove(int fd);
+
+  // Blocks until at least one descriptor is ready and fills ready_fds with them.
+  void Wait(std::vector<int>& ready_fds, int timeout_ms = -1);
+
+ private:
+  int poll_fd_;
+};
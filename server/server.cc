@@ -6,32 +6,119 @@
 #include <iostream>
 #include <cstring>
 #include <vector>
+#include <thread>
 #include <filesystem>
+#include <csignal>
 #include "utils/utils.h"
-#include "protocol/protocol.h"
-#include "protocol/serialization.h"
+#include "utils/hash_index.h"
+#include "catalog.h"
+#include "event_loop.h"
+#include "uring_event_loop.h"
 
-void ServeClient(int client_socket, const std::filesystem::path& data_dir);
-void HandleList(int client_socket, const std::filesystem::path& data_dir);
-void HandlePull(int client_socket, uint32_t payload_size, const std::filesystem::path& data_dir);
-void HandleLeave(int cilent_socket);
+enum class Engine { Epoll, IoUring };
+
+// Most files kept mapped for sending at once by each worker, whatever their total size
+constexpr size_t kMaxMappedFiles = 256;
+
+int CreateListenSocket(unsigned int server_port);
+void RunWorker(unsigned int server_port, Engine engine, const std::filesystem::path& data_dir, const Catalog& catalog);
 
 int main(int argc, char *argv[]) {
-  int server_socket;
-  int client_socket;
-  sockaddr_in server_address;
-  sockaddr_in client_address;
-  const unsigned int server_port = 9090;
+  unsigned int server_port = 9090;
+  unsigned int worker_count = std::max(1u, std::thread::hardware_concurrency());
+  Engine engine = Engine::Epoll;
+  uint64_t mapped_megabytes = 1024;
+  int option;
+
+  // Parse command line options
+  while ((option = getopt(argc, argv, "p:w:e:m:")) != -1) {
+    switch (option) {
+      case 'p':
+        server_port = std::stoul(optarg);
+        break;
+      case 'w':
+        worker_count = std::max(1ul, std::stoul(optarg));
+        break;
+      case 'm':
+        mapped_megabytes = std::stoull(optarg);
+        break;
+      case 'e':
+        if (std::string(optarg) == "io_uring") {
+          engine = Engine::IoUring;
+          break;
+        } else if (std::string(optarg) == "epoll") {
+          engine = Engine::Epoll;
+          break;
+        }
+        [[fallthrough]];
+      default:
+        std::cerr << "Usage: " << argv[0] << " [-p port] [-w workers] [-e epoll|io_uring] [-m mapped_megabytes]" << "\n";
+        return EXIT_FAILURE;
+    }
+  }
+
+  // io_uring may be missing from the kernel or blocked by seccomp
+  if (engine == Engine::IoUring && !UringEventLoop::Supported()) {
+    std::cerr << "io_uring is not available, falling back to epoll" << "\n";
+    engine = Engine::Epoll;
+  }
 
   // Initialize data directory
   std::filesystem::path data_dir = std::filesystem::current_path() / "server" / "files";
   std::cout << "Data directory: " << data_dir << "\n";
 
+  // Load the persistent hash index and build the live catalog from it before serving
+  std::filesystem::path index_path = data_dir;
+  index_path += ".index";
+  HashIndex hash_index(index_path);
+  hash_index.Load();
+
+  // Files are chunked in the background as the catalog finds them, so a
+  // client asking for a chunk list rarely waits for a worker to chunk the file
+  ChunkStore chunk_store(data_dir, hash_index);
+  chunk_store.Start();
+  // Hot files stay mapped so resending them costs no read syscalls. Each
+  // worker keeps its own mappings within an equal share of the budget
+  Catalog catalog(data_dir, hash_index, chunk_store, (mapped_megabytes << 20) / worker_count, kMaxMappedFiles);
+  catalog.Start();
+
+  // A client vanishing mid-response must not kill the whole server
+  signal(SIGPIPE, SIG_IGN);
+
+  // Each worker owns a listening socket and an event loop; the kernel spreads
+  // incoming connections across the sockets. Workers only share the catalog
+  std::vector<std::thread> workers;
+  for (unsigned int i = 0; i < worker_count; i++) {
+    workers.emplace_back(RunWorker, server_port, engine, std::cref(data_dir), std::cref(catalog));
+  }
+
+  std::cout << "Server is listening on port " << server_port << " with " << worker_count << " workers" << "\n";
+
+  for (auto& worker : workers) {
+    worker.join();
+  }
+  return 0;
+};
+
+int CreateListenSocket(unsigned int server_port) {
+  int server_socket;
+  sockaddr_in server_address;
+
   // Create a new TCP socket for incoming requests
   if ((server_socket = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0) {
     FatalError("socket() failed");
   }
 
+  // Allow restarting while old connections linger in TIME_WAIT, and let every
+  // worker bind its own socket to the same port
+  int reuse = 1;
+  if (setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) < 0) {
+    FatalError("setsockopt() failed for SO_REUSEADDR");
+  }
+  if (setsockopt(server_socket, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) < 0) {
+    FatalError("setsockopt() failed for SO_REUSEPORT");
+  }
+
   // Construct local address structure
   server_address.sin_family      = AF_INET;
   server_address.sin_port        = htons(server_port);
@@ -43,172 +130,19 @@ int main(int argc, char *argv[]) {
   }
 
   // Listen for incoming connections
-  if (listen(server_socket, 5) < 0) {
+  if (listen(server_socket, SOMAXCONN) < 0) {
     FatalError("listen() failed");
   }
 
-  std::cout << "Server is listening on port " << server_port << "\n";
-
-  while (true) {
-    // Accept incoming connection
-    unsigned int client_length = sizeof(client_address);
-
-    if ((client_socket = accept(server_socket, (struct sockaddr *)&client_address, &client_length)) < 0) {
-      FatalError("accept() failed");
-    }
-
-    std::cout << "Accepted connection from " << inet_ntoa(client_address.sin_addr) << ":" << ntohs(client_address.sin_port) << "\n";
-
-    // Process commands on existing connection
-    ServeClient(client_socket, data_dir);
-  }
-  return 0;
-};
-
-void ServeClient(int client_socket, const std::filesystem::path& data_dir) {
-  while (true) {
-    std::array<uint8_t, 5> header_buffer;
-    int bytes_received = recv(client_socket, header_buffer.data(), header_buffer.size(), MSG_WAITALL);
-
-    if (bytes_received < 0) {
-      FatalError("recv() failed");
-    } else if (bytes_received == 0) {
-      std::cout << "Client disconnected" << "\n";
-      return;
-    } else if (bytes_received < static_cast<int>(header_buffer.size())) {
-      FatalError("Received incomplete header, expected " + std::to_string(header_buffer.size()) + " bytes, got " + std::to_string(bytes_received) + " bytes.");
-    }
-
-    int command = header_buffer[0];
-    uint32_t payload_size = ntohl(*reinterpret_cast<uint32_t*>(header_buffer.data() + 1));
-
-    std::cout << "Received command: " << command << "\n";
-
-    switch (command) {
-      case 1: {
-        // LIST
-        HandleList(client_socket, data_dir);
-        break;
-      }
-      case 3: {
-        // PULL
-        HandlePull(client_socket, payload_size, data_dir);
-        break;
-      }
-      case 4: {
-        // LEAVE
-        HandleLeave(client_socket);
-        return;
-      }
-      default:
-        std::cout << "Unknown command received: " << command << "\n";
-    }
-  }
-}
-
-void HandleList(int client_socket, const std::filesystem::path& data_dir) {
-  std::vector<protocol::FileHeader> files = ListFilesWithHashes(data_dir);
-  protocol::ListResponse response;
-  response.file_count = static_cast<uint8_t>(files.size());
-  response.files = files;
-
-  std::vector<uint8_t> serialized_response = protocol::SerializeList(response);
-
-  uint32_t total_size = serialized_response.size();
-
-  protocol::MessageHeader header {
-    .command = protocol::Command::LIST,
-    .payload_size = total_size
-  };
-
-  std::array<uint8_t, 5> serialized_header = protocol::SerializeHeader(header);
-  unsigned int total_bytes_sent = 0;
-  unsigned int bytes_sent;
-
-  // Send header
-  if (send(client_socket, serialized_header.data(), serialized_header.size(), 0) < 0) {
-    FatalError("LIST: send() failed for message header");
-  }
-
-  while (total_bytes_sent < total_size) {
-    bytes_sent = send(client_socket, serialized_response.data() + total_bytes_sent, total_size - total_bytes_sent, 0);
-    if (bytes_sent < 0) {
-      FatalError("send() failed");
-    } else if (bytes_sent == 0) {
-      FatalError("Client disconnected while sending LIST response.");
-    }
-
-    total_bytes_sent += bytes_sent;
-  }
-
-  std::cout << "LIST completed." << "\n";
+  return server_socket;
 }
 
-void HandlePull(int client_socket, uint32_t payload_size, const std::filesystem::path& data_dir) {
-  // Receive PULL request payload from client
-  unsigned int total_bytes_received = 0;
-  int bytes_received;
-  std::vector<uint8_t> receive_buffer(payload_size);
-
-  while (total_bytes_received < payload_size) {
-    bytes_received = recv(client_socket, receive_buffer.data() + total_bytes_received, payload_size - total_bytes_received, 0);
-    
-    if (bytes_received < 0) {
-      FatalError("recv() failed");
-    } else if (bytes_received == 0) {
-      FatalError("Client disconnected while receiving PULL request.");
-    }
-
-    total_bytes_received += bytes_received;
+void RunWorker(unsigned int server_port, Engine engine, const std::filesystem::path& data_dir, const Catalog& catalog) {
+  if (engine == Engine::IoUring) {
+    UringEventLoop loop(CreateListenSocket(server_port), data_dir, catalog);
+    loop.Run();
+  } else {
+    EventLoop loop(CreateListenSocket(server_port), data_dir, catalog);
+    loop.Run();
   }
-
-  protocol::PullRequest request = protocol::DeserializePullRequest(receive_buffer);
-
-  // Prepare PULL request response
-  for (const auto& file : request.files) {
-    std::vector<uint8_t> file_bytes = ReadFileBytes(data_dir / file.name);
-    protocol::FileContents file_contents {
-      .header = file,
-      .size = static_cast<uint32_t>(file_bytes.size()),
-      .bytes = std::move(file_bytes)
-    };
-    std::vector<uint8_t> send_buffer = protocol::SerializeFileContents(file_contents);
-
-    // Send response header
-    protocol::MessageHeader header {
-      .command = protocol::Command::PULL,
-      .payload_size = static_cast<uint32_t>(send_buffer.size())
-    };
-    std::array<uint8_t, 5> serialized_header = protocol::SerializeHeader(header);
-
-    if (send(client_socket, serialized_header.data(), serialized_header.size(), 0) != serialized_header.size()) {
-      FatalError("PULL: send() failed for message header");
-    }
-
-    // Send file contents
-    int bytes_sent;
-    unsigned int total_bytes_sent = 0;
-    uint32_t total_size = send_buffer.size();
-
-    while (total_bytes_sent < total_size) {
-      bytes_sent = send(client_socket, send_buffer.data() + total_bytes_sent, total_size - total_bytes_sent, 0);
-
-      if (bytes_sent < 0) {
-        FatalError("send() failed for PULL response file");
-      } else if (bytes_sent == 0) {
-        FatalError("Client disconnected while sending PULL response.");
-      }
-
-      total_bytes_sent += bytes_sent;
-    }
-  }
-
-  std::cout << "PULL operation completed." << "\n";
 }
-
-void HandleLeave(int client_socket) {
-  if (close(client_socket) < 0) {
-    FatalError("close() failed");
-  }
-  std::cout << "Client connection closed." << "\n";
-}
\ No newline at end of file
@@ -0,0 +1,34 @@
+#include "transport.h"
+
+#include <algorithm>
+#include <sys/socket.h>
+
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#else
+#include <sys/uio.h>
+#endif
+
+ssize_t SocketTransport::Receive(void* buffer, size_t size) {
+  return recv(socket_, buffer, size, 0);
+}
+
+ssize_t SocketTransport::Send(const iovec* iov, int count, int flags) {
+  msghdr message {};
+  message.msg_iov = const_cast<iovec*>(iov);
+  message.msg_iovlen = count;
+  return sendmsg(socket_, &message, flags);
+}
+
+ssize_t SocketTransport::SendFile(int file_fd, off_t* offset, size_t count) {
+#if defined(__linux__)
+  return sendfile(socket_, file_fd, offset, count);
+#else
+  // macOS reports partial progress through `length`, even when failing with EAGAIN
+  off_t length = count;
+  int result = sendfile(file_fd, socket_, *offset, &length, nullptr, 0);
+  ssize_t bytes_sent = (result < 0 && length == 0) ? -1 : length;
+  *offset += std::max<ssize_t>(bytes_sent, 0);
+  return bytes_sent;
+#endif
+}
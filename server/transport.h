@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstddef>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+// How a Connection moves bytes. Every call follows the contract of the matching
+// syscall: bytes transferred, 0 at end of stream, or -1 with errno set, where
+// EAGAIN means "call again once the engine reports progress". This lets the
+// readiness (epoll/kqueue) and completion (io_uring) engines share one state machine.
+class Transport {
+ public:
+  virtual ~Transport() = default;
+
+  // Like recv()
+  virtual ssize_t Receive(void* buffer, size_t size) = 0;
+  // Like sendmsg() with a gather list of `count` buffers; flags may carry MSG_MORE
+  virtual ssize_t Send(const iovec* iov, int count, int flags) = 0;
+  // Like Linux sendfile(): sends up to `count` bytes of file_fd from *offset and advances it
+  virtual ssize_t SendFile(int file_fd, off_t* offset, size_t count) = 0;
+
+  // Whether SendFile() hands file pages to the socket without reading them
+  // into userspace first. Connections send from mapped files when it does not
+  virtual bool zero_copy_send_file() const { return true; }
+};
+
+// Non-blocking syscalls straight on the socket, for readiness-based engines
+class SocketTransport : public Transport {
+ public:
+  explicit SocketTransport(int socket) : socket_(socket) {}
+
+  ssize_t Receive(void* buffer, size_t size) override;
+  ssize_t Send(const iovec* iov, int count, int flags) override;
+  ssize_t SendFile(int file_fd, off_t* offset, size_t count) override;
+
+ private:
+  int socket_;
+};
@@ -0,0 +1,175 @@
+#include "uring.h"
+
+#if defined(__linux__)
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "utils/utils.h"
+
+namespace {
+  int Setup(unsigned entries, io_uring_params& params) {
+    return syscall(__NR_io_uring_setup, entries, &params);
+  }
+
+  int Enter(int ring_fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, nullptr, 0);
+  }
+
+  int Register(int ring_fd, unsigned opcode, void* arg, unsigned count) {
+    return syscall(__NR_io_uring_register, ring_fd, opcode, arg, count);
+  }
+
+  void* MapRing(int ring_fd, size_t size, off_t offset) {
+    void* ring = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, offset);
+    if (ring == MAP_FAILED) {
+      FatalError("mmap() failed for io_uring");
+    }
+    return ring;
+  }
+
+  // Provided buffer rings (5.19) arrived together with multishot accept, so
+  // registering one is enough to tell the kernel supports the whole engine
+  bool RegisterBufferRing(int ring_fd, io_uring_buf_ring* ring, unsigned entries) {
+    io_uring_buf_reg reg{};
+    reg.ring_addr = reinterpret_cast<uint64_t>(ring);
+    reg.ring_entries = entries;
+    reg.bgid = IoUring::kBufferGroup;
+    return Register(ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) == 0;
+  }
+}
+
+IoUring::IoUring(unsigned entries, unsigned buffer_count, unsigned buffer_size)
+    : buffer_count_(buffer_count), buffer_size_(buffer_size) {
+  io_uring_params params{};
+  if ((ring_fd_ = Setup(entries, params)) < 0) {
+    FatalError("io_uring_setup() failed");
+  }
+
+  sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+
+  // Newer kernels map both rings with a single mmap
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+  }
+
+  sq_ring_ = MapRing(ring_fd_, sq_ring_size_, IORING_OFF_SQ_RING);
+  cq_ring_ = (params.features & IORING_FEAT_SINGLE_MMAP) ? sq_ring_ : MapRing(ring_fd_, cq_ring_size_, IORING_OFF_CQ_RING);
+
+  sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+  sqes_ = static_cast<io_uring_sqe*>(MapRing(ring_fd_, sqes_size_, IORING_OFF_SQES));
+
+  uint8_t* sq = static_cast<uint8_t*>(sq_ring_);
+  sq_head_ = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+  sq_tail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+  sq_mask_ = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+  sq_array_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+  sq_entries_ = params.sq_entries;
+  sq_local_tail_ = sq_submitted_ = *sq_tail_;
+
+  uint8_t* cq = static_cast<uint8_t*>(cq_ring_);
+  cq_head_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+  cq_tail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+  cq_mask_ = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+  cqes_ = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+  // Receive buffers the kernel picks from as data arrives, so idle
+  // connections do not each pin a buffer of their own
+  buffer_ring_size_ = buffer_count_ * sizeof(io_uring_buf);
+  void* buffer_ring = mmap(nullptr, buffer_ring_size_, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+  if (buffer_ring == MAP_FAILED) {
+    FatalError("mmap() failed for io_uring buffer ring");
+  }
+  buffer_ring_ = static_cast<io_uring_buf_ring*>(buffer_ring);
+
+  if (!RegisterBufferRing(ring_fd_, buffer_ring_, buffer_count_)) {
+    FatalError("io_uring_register() failed for buffer ring");
+  }
+
+  buffers_ = new uint8_t[static_cast<size_t>(buffer_count_) * buffer_size_];
+  for (unsigned i = 0; i < buffer_count_; i++) {
+    RecycleBuffer(i);
+  }
+}
+
+IoUring::~IoUring() {
+  close(ring_fd_);
+  munmap(sqes_, sqes_size_);
+  if (cq_ring_ != sq_ring_) {
+    munmap(cq_ring_, cq_ring_size_);
+  }
+  munmap(sq_ring_, sq_ring_size_);
+  munmap(buffer_ring_, buffer_ring_size_);
+  delete[] buffers_;
+}
+
+bool IoUring::Supported() {
+  io_uring_params params{};
+  int ring_fd = Setup(4, params);
+  if (ring_fd < 0) {
+    return false;
+  }
+
+  void* buffer_ring = mmap(nullptr, sizeof(io_uring_buf), PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+  bool supported = buffer_ring != MAP_FAILED && RegisterBufferRing(ring_fd, static_cast<io_uring_buf_ring*>(buffer_ring), 1);
+
+  close(ring_fd);
+  if (buffer_ring != MAP_FAILED) {
+    munmap(buffer_ring, sizeof(io_uring_buf));
+  }
+  return supported;
+}
+
+io_uring_sqe* IoUring::GetSqe() {
+  if (sq_local_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= sq_entries_) {
+    Submit();
+    if (sq_local_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= sq_entries_) {
+      FatalError("io_uring submission queue is full");
+    }
+  }
+
+  unsigned index = sq_local_tail_ & *sq_mask_;
+  sq_array_[index] = index;
+  sq_local_tail_++;
+
+  io_uring_sqe* sqe = &sqes_[index];
+  std::memset(sqe, 0, sizeof(*sqe));
+  return sqe;
+}
+
+void IoUring::Submit(unsigned wait_for) {
+  __atomic_store_n(sq_tail_, sq_local_tail_, __ATOMIC_RELEASE);
+
+  int submitted;
+  do {
+    submitted = Enter(ring_fd_, sq_local_tail_ - sq_submitted_, wait_for, wait_for > 0 ? IORING_ENTER_GETEVENTS : 0);
+  } while (submitted < 0 && errno == EINTR);
+
+  // EBUSY/EAGAIN mean the completion queue needs draining first; leftovers go with the next call
+  if (submitted < 0 && errno != EBUSY && errno != EAGAIN) {
+    FatalError("io_uring_enter() failed");
+  }
+  sq_submitted_ += std::max(submitted, 0);
+}
+
+const uint8_t* IoUring::Buffer(uint16_t buffer_id) const {
+  return buffers_ + static_cast<size_t>(buffer_id) * buffer_size_;
+}
+
+void IoUring::RecycleBuffer(uint16_t buffer_id) {
+  // The ring tail overlays the reserved field of the first entry, so only
+  // the addr/len/bid fields of an entry may be written. Entries are indexed
+  // by hand: in C++ the header's flexible array member starts at offset 8, not 0
+  unsigned short tail = buffer_ring_->tail;
+  io_uring_buf& entry = reinterpret_cast<io_uring_buf*>(buffer_ring_)[tail & (buffer_count_ - 1)];
+  entry.addr = reinterpret_cast<uint64_t>(Buffer(buffer_id));
+  entry.len = buffer_size_;
+  entry.bid = buffer_id;
+  __atomic_store_n(&buffer_ring_->tail, static_cast<unsigned short>(tail + 1), __ATOMIC_RELEASE);
+}
+
+#endif
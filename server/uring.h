@@ -0,0 +1,79 @@
+#pragma once
+
+#if defined(__linux__)
+
+#include <cstddef>
+#include <cstdint>
+#include <linux/io_uring.h>
+
+// Minimal io_uring wrapper over the raw syscalls (no liburing): one submission
+// and one completion ring, plus a provided-buffer ring the kernel picks receive
+// buffers from. Linux only; callers check Supported() before constructing one.
+class IoUring {
+ public:
+  // Ring size and provided receive buffers (count must be a power of two)
+  IoUring(unsigned entries, unsigned buffer_count, unsigned buffer_size);
+  ~IoUring();
+  IoUring(const IoUring&) = delete;
+  IoUring& operator=(const IoUring&) = delete;
+
+  // Whether this kernel offers everything the io_uring engine relies on
+  static bool Supported();
+
+  // Returns a zeroed submission entry, flushing the queue first if it is full
+  io_uring_sqe* GetSqe();
+
+  // Submits queued entries and waits for at least `wait_for` completions
+  void Submit(unsigned wait_for = 0);
+
+  // Calls handler(cqe) for every available completion
+  template <typename Handler>
+  void ForEachCompletion(Handler&& handler) {
+    unsigned head = *cq_head_;
+    unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+
+    for (; head != tail; head++) {
+      handler(cqes_[head & *cq_mask_]);
+      // Publish progress per entry so the handler may queue new submissions
+      __atomic_store_n(cq_head_, head + 1, __ATOMIC_RELEASE);
+    }
+  }
+
+  // Group id to put in sqe->buf_group together with IOSQE_BUFFER_SELECT
+  static constexpr uint16_t kBufferGroup = 0;
+
+  // Memory of the provided buffer a completion reported, and handing it back
+  const uint8_t* Buffer(uint16_t buffer_id) const;
+  void RecycleBuffer(uint16_t buffer_id);
+
+ private:
+  int ring_fd_ = -1;
+
+  void* sq_ring_ = nullptr;
+  size_t sq_ring_size_ = 0;
+  unsigned* sq_head_;
+  unsigned* sq_tail_;
+  unsigned* sq_mask_;
+  unsigned* sq_array_;
+  unsigned sq_entries_;
+  unsigned sq_local_tail_ = 0;
+  unsigned sq_submitted_ = 0;
+
+  io_uring_sqe* sqes_ = nullptr;
+  size_t sqes_size_ = 0;
+
+  void* cq_ring_ = nullptr;
+  size_t cq_ring_size_ = 0;
+  unsigned* cq_head_;
+  unsigned* cq_tail_;
+  unsigned* cq_mask_;
+  io_uring_cqe* cqes_;
+
+  io_uring_buf_ring* buffer_ring_ = nullptr;
+  size_t buffer_ring_size_ = 0;
+  uint8_t* buffers_ = nullptr;
+  unsigned buffer_count_;
+  unsigned buffer_size_;
+};
+
+#endif
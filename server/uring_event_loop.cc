@@ -0,0 +1,356 @@
+#include "uring_event_loop.h"
+
+#if defined(__linux__)
+
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <netinet/in.h>
+#include <optional>
+#include <sys/socket.h>
+#include <vector>
+#include "uring.h"
+
+namespace {
+  constexpr unsigned kRingEntries = 256;
+
+  // Shared pool the kernel picks receive buffers from
+  constexpr unsigned kReceiveBuffers = 64;
+  constexpr unsigned kReceiveBufferSize = 16 * 1024;
+
+  // PULL bodies are read from disk and sent in chunks of this size
+  constexpr size_t kFileChunkSize = 64 * 1024;
+
+  // Operation kinds, stored in the low byte of user_data next to the socket
+  enum class Op : uint8_t { Accept, Receive, FileRead, Send };
+
+  uint64_t UserData(int socket, Op op) {
+    return (static_cast<uint64_t>(socket) << 8) | static_cast<uint8_t>(op);
+  }
+}
+
+// Stages a connection's I/O as io_uring submissions. A call that has to wait
+// submits the operation and reports EAGAIN; once the completion arrives the
+// event loop re-runs the connection, which repeats the call and gets the result.
+class UringTransport : public Transport {
+ public:
+  UringTransport(int socket, IoUring& ring) : socket_(socket), ring_(ring) {}
+
+  ssize_t Receive(void* buffer, size_t size) override {
+    if (input_offset_ < input_.size()) {
+      size_t length = std::min(size, input_.size() - input_offset_);
+      std::memcpy(buffer, input_.data() + input_offset_, length);
+      input_offset_ += length;
+
+      if (input_offset_ == input_.size()) {
+        input_.clear();
+        input_offset_ = 0;
+      }
+      return length;
+    }
+
+    if (end_of_stream_) {
+      return 0;
+    } else if (receive_error_ != 0) {
+      errno = receive_error_;
+      return -1;
+    }
+
+    // Only arm a receive when the connection wants data, which keeps TCP
+    // backpressure intact while a response is still being written
+    if (!receive_in_flight_) {
+      io_uring_sqe* sqe = ring_.GetSqe();
+      sqe->opcode = IORING_OP_RECV;
+      sqe->fd = socket_;
+      sqe->flags = IOSQE_BUFFER_SELECT;
+      sqe->buf_group = IoUring::kBufferGroup;
+      sqe->user_data = UserData(socket_, Op::Receive);
+      receive_in_flight_ = true;
+      in_flight_++;
+    }
+
+    errno = EAGAIN;
+    return -1;
+  }
+
+  ssize_t Send(const iovec* iov, int count, int flags) override {
+    if (write_result_) {
+      return TakeWriteResult();
+    }
+
+    if (!write_in_flight_) {
+      // The kernel may read the gather list after this returns, so it keeps its own copy
+      send_iovecs_.assign(iov, iov + count);
+      send_message_ = {};
+      send_message_.msg_iov = send_iovecs_.data();
+      send_message_.msg_iovlen = send_iovecs_.size();
+
+      io_uring_sqe* sqe = ring_.GetSqe();
+      sqe->opcode = IORING_OP_SENDMSG;
+      sqe->fd = socket_;
+      sqe->addr = reinterpret_cast<uint64_t>(&send_message_);
+      sqe->len = 1;
+      sqe->msg_flags = flags;
+      sqe->user_data = UserData(socket_, Op::Send);
+      write_in_flight_ = true;
+      in_flight_++;
+    }
+
+    errno = EAGAIN;
+    return -1;
+  }
+
+  ssize_t SendFile(int file_fd, off_t* offset, size_t count) override {
+    if (write_result_) {
+      ssize_t bytes_sent = TakeWriteResult();
+      *offset += std::max<ssize_t>(bytes_sent, 0);
+      return bytes_sent;
+    }
+
+    // io_uring has no sendfile(): read a chunk and send it as one linked
+    // chain, so both steps cost a single submission
+    if (!write_in_flight_) {
+      file_chunk_.resize(kFileChunkSize);
+      size_t length = std::min(count, kFileChunkSize);
+
+      io_uring_sqe* read = ring_.GetSqe();
+      read->opcode = IORING_OP_READ;
+      read->fd = file_fd;
+      read->addr = reinterpret_cast<uint64_t>(file_chunk_.data());
+      read->len = length;
+      read->off = *offset;
+      read->flags = IOSQE_IO_LINK;
+      read->user_data = UserData(socket_, Op::FileRead);
+
+      io_uring_sqe* send = ring_.GetSqe();
+      send->opcode = IORING_OP_SEND;
+      send->fd = socket_;
+      send->addr = reinterpret_cast<uint64_t>(file_chunk_.data());
+      send->len = length;
+      send->user_data = UserData(socket_, Op::Send);
+
+      file_read_result_.reset();
+      write_in_flight_ = true;
+      in_flight_ += 2;
+    }
+
+    errno = EAGAIN;
+    return -1;
+  }
+
+  // SendFile() is emulated with a read into file_chunk_
+  bool zero_copy_send_file() const override { return false; }
+
+  void OnReceive(int result, const uint8_t* data) {
+    receive_in_flight_ = false;
+    in_flight_--;
+
+    if (result > 0) {
+      input_.insert(input_.end(), data, data + result);
+    } else if (result == 0) {
+      end_of_stream_ = true;
+    } else if (result != -ENOBUFS) {
+      // Out of provided buffers is transient: the next Receive() simply re-arms
+      receive_error_ = -result;
+    }
+  }
+
+  void OnFileRead(int result) {
+    file_read_result_ = result;
+    in_flight_--;
+  }
+
+  void OnSend(int result) {
+    write_in_flight_ = false;
+    in_flight_--;
+
+    // A failed or short read cancels its linked send; a short read means the
+    // file shrank, which the connection treats like sendfile() hitting EOF
+    if (result == -ECANCELED && file_read_result_) {
+      result = std::min(*file_read_result_, 0);
+    }
+    write_result_ = result;
+  }
+
+  unsigned in_flight() const { return in_flight_; }
+
+ private:
+  ssize_t TakeWriteResult() {
+    int result = *write_result_;
+    write_result_.reset();
+
+    if (result < 0) {
+      errno = -result;
+      return -1;
+    }
+    return result;
+  }
+
+  int socket_;
+  IoUring& ring_;
+  unsigned in_flight_ = 0;
+
+  // Received bytes the connection has not consumed yet
+  std::vector<uint8_t> input_;
+  size_t input_offset_ = 0;
+  bool receive_in_flight_ = false;
+  bool end_of_stream_ = false;
+  int receive_error_ = 0;
+
+  // At most one send (or read -> send chain) is in flight per connection
+  bool write_in_flight_ = false;
+  std::optional<int> write_result_;
+  std::optional<int> file_read_result_;
+  std::vector<uint8_t> file_chunk_;
+  std::vector<iovec> send_iovecs_;
+  msghdr send_message_ {};
+};
+
+UringEventLoop::UringEventLoop(int listen_socket, const std::filesystem::path& data_dir, const Catalog& catalog)
+    : ring_(std::make_unique<IoUring>(kRingEntries, kReceiveBuffers, kReceiveBufferSize)),
+      listen_socket_(listen_socket), data_dir_(data_dir), catalog_(catalog) {}
+
+UringEventLoop::~UringEventLoop() = default;
+
+bool UringEventLoop::Supported() {
+  return IoUring::Supported();
+}
+
+void UringEventLoop::Run() {
+  SubmitAccept();
+
+  while (true) {
+    // Yielded connections have work left, so only wait for completions when there are none
+    ring_->Submit(yielded_.empty() ? 1 : 0);
+    ring_->ForEachCompletion([this](const io_uring_cqe& cqe) { HandleCompletion(cqe); });
+
+    std::vector<int> yielded;
+    yielded.swap(yielded_);
+    for (int socket : yielded) {
+      auto it = clients_.find(socket);
+      if (it != clients_.end() && !it->second.closing) {
+        RunClient(it);
+      }
+    }
+  }
+}
+
+void UringEventLoop::SubmitAccept() {
+  // One submission keeps producing a completion per accepted client
+  io_uring_sqe* sqe = ring_->GetSqe();
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = listen_socket_;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->accept_flags = SOCK_CLOEXEC;
+  sqe->user_data = UserData(listen_socket_, Op::Accept);
+}
+
+void UringEventLoop::HandleCompletion(const io_uring_cqe& cqe) {
+  int socket = static_cast<int>(cqe.user_data >> 8);
+  Op op = static_cast<Op>(cqe.user_data & 0xff);
+
+  if (op == Op::Accept) {
+    if (cqe.res >= 0) {
+      AcceptConnection(cqe.res);
+    } else if (cqe.res != -EINTR && cqe.res != -ECONNABORTED) {
+      std::cerr << "accept() failed: " << std::strerror(-cqe.res) << "\n";
+    }
+
+    // The kernel ends a multishot accept on errors and overflow; re-arm it
+    if (!(cqe.flags & IORING_CQE_F_MORE)) {
+      SubmitAccept();
+    }
+    return;
+  }
+
+  auto it = clients_.find(socket);
+  if (it == clients_.end()) {
+    return;
+  }
+  Client& client = it->second;
+
+  switch (op) {
+    case Op::Receive: {
+      if (cqe.flags & IORING_CQE_F_BUFFER) {
+        uint16_t buffer_id = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+        client.transport->OnReceive(cqe.res, ring_->Buffer(buffer_id));
+        ring_->RecycleBuffer(buffer_id);
+      } else {
+        client.transport->OnReceive(cqe.res, nullptr);
+      }
+      break;
+    }
+    case Op::FileRead:
+      // Its linked send completes next and carries the outcome of both
+      client.transport->OnFileRead(cqe.res);
+      return;
+    case Op::Send:
+      client.transport->OnSend(cqe.res);
+      break;
+    case Op::Accept:
+      break;
+  }
+
+  if (client.closing) {
+    if (client.transport->in_flight() == 0) {
+      clients_.erase(it);
+    }
+  } else {
+    RunClient(it);
+  }
+}
+
+void UringEventLoop::RunClient(std::unordered_map<int, Client>::iterator it) {
+  if (!it->second.connection->OnReady()) {
+    CloseClient(it);
+  } else if (it->second.connection->yielded()) {
+    yielded_.push_back(it->first);
+  }
+}
+
+void UringEventLoop::AcceptConnection(int client_socket) {
+  sockaddr_in client_address;
+  socklen_t client_length = sizeof(client_address);
+  if (getpeername(client_socket, (struct sockaddr *)&client_address, &client_length) == 0) {
+    std::cout << "Accepted connection from " << inet_ntoa(client_address.sin_addr) << ":" << ntohs(client_address.sin_port) << "\n";
+  }
+
+  auto transport = std::make_unique<UringTransport>(client_socket, *ring_);
+  Client& client = clients_[client_socket];
+  client.transport = transport.get();
+  client.connection = std::make_unique<Connection>(client_socket, std::move(transport), data_dir_, catalog_);
+
+  // Arms the first receive
+  RunClient(clients_.find(client_socket));
+}
+
+void UringEventLoop::CloseClient(std::unordered_map<int, Client>::iterator it) {
+  if (it->second.transport->in_flight() == 0) {
+    clients_.erase(it);
+    return;
+  }
+
+  // Operations still reference the connection's buffers; make them fail fast
+  // and free the client once the last completion is in
+  it->second.closing = true;
+  shutdown(it->first, SHUT_RDWR);
+}
+
+#else
+
+// io_uring is Linux only; Supported() keeps server.cc on EventLoop elsewhere
+class IoUring {};
+
+UringEventLoop::UringEventLoop(int listen_socket, const std::filesystem::path& data_dir, const Catalog& catalog)
+    : listen_socket_(listen_socket), data_dir_(data_dir), catalog_(catalog) {}
+
+UringEventLoop::~UringEventLoop() = default;
+
+bool UringEventLoop::Supported() {
+  return false;
+}
+
+void UringEventLoop::Run() {}
+
+#endif
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+#include "connection.h"
+#include "catalog.h"
+
+class IoUring;
+class UringTransport;
+struct io_uring_cqe;
+
+// Completion-based alternative to EventLoop on top of io_uring. A multishot
+// accept feeds new clients, receives land in kernel-selected provided buffers,
+// and PULL bodies go out as linked file-read -> socket-send pairs, so one
+// io_uring_enter() covers the I/O of every connection in the worker.
+// Connections keep their state machine; UringTransport resumes them on completions.
+class UringEventLoop {
+ public:
+  UringEventLoop(int listen_socket, const std::filesystem::path& data_dir, const Catalog& catalog);
+  ~UringEventLoop();
+  UringEventLoop(const UringEventLoop&) = delete;
+  UringEventLoop& operator=(const UringEventLoop&) = delete;
+
+  // False when the platform or kernel lacks what the engine needs; use EventLoop then
+  static bool Supported();
+
+  void Run();
+
+ private:
+  struct Client {
+    std::unique_ptr<Connection> connection;
+    UringTransport* transport;
+    // Finished, waiting for in-flight operations to complete before it is freed
+    bool closing = false;
+  };
+
+  void SubmitAccept();
+  void HandleCompletion(const io_uring_cqe& cqe);
+  void AcceptConnection(int client_socket);
+  void RunClient(std::unordered_map<int, Client>::iterator it);
+  void CloseClient(std::unordered_map<int, Client>::iterator it);
+
+  std::unique_ptr<IoUring> ring_;
+  int listen_socket_;
+  const std::filesystem::path& data_dir_;
+  CatalogReader catalog_;
+  std::unordered_map<int, Client> clients_;
+  // Connections that yielded and are run again after the next batch of completions
+  std::vector<int> yielded_;
+};
@@ -0,0 +1,186 @@
+#include "chunk_index.h"
+
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <unordered_set>
+#include <sys/stat.h>
+#include "chunker.h"
+#include "utils.h"
+
+namespace {
+  constexpr const char* kIndexMagic = "# chunk index v1\n";
+
+  // The index never leaves the machine it was written on, so fields are stored in host byte order
+  template <typename T>
+  void Put(std::vector<uint8_t>& out, const T& value) {
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&value);
+    out.insert(out.end(), bytes, bytes + sizeof(T));
+  }
+
+  template <typename T>
+  bool Get(const std::vector<uint8_t>& in, size_t& offset, T& value) {
+    if (in.size() - offset < sizeof(T)) {
+      return false;
+    }
+    std::memcpy(&value, in.data() + offset, sizeof(T));
+    offset += sizeof(T);
+    return true;
+  }
+
+  // One record per file: name length, name, size, mtime_ns, inode, chunk count, then each chunk's hash and length
+  bool GetFile(const std::vector<uint8_t>& in, size_t& offset, std::string& name, ChunkIndex::File& file) {
+    uint16_t name_length;
+    uint32_t chunk_count;
+    if (!Get(in, offset, name_length) || in.size() - offset < name_length) {
+      return false;
+    }
+    name.assign(reinterpret_cast<const char*>(in.data() + offset), name_length);
+    offset += name_length;
+
+    if (!Get(in, offset, file.size) || !Get(in, offset, file.mtime_ns) || !Get(in, offset, file.inode) ||
+        !Get(in, offset, chunk_count) ||
+        (in.size() - offset) / (protocol::kSha256Bytes + sizeof(uint32_t)) < chunk_count) {
+      return false;
+    }
+
+    file.chunks.resize(chunk_count);
+    uint64_t total = 0;
+    for (auto& chunk : file.chunks) {
+      std::memcpy(chunk.hash.data(), in.data() + offset, protocol::kSha256Bytes);
+      offset += protocol::kSha256Bytes;
+      Get(in, offset, chunk.length);
+      total += chunk.length;
+    }
+    return total == file.size;
+  }
+}
+
+ChunkIndex::ChunkIndex(std::filesystem::path index_path) : index_path_(std::move(index_path)) {}
+
+void ChunkIndex::Load() {
+  std::ifstream in(index_path_, std::ios::binary);
+  std::vector<uint8_t> bytes((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+  size_t magic_size = std::strlen(kIndexMagic);
+
+  files_.clear();
+  if (bytes.size() < magic_size || std::memcmp(bytes.data(), kIndexMagic, magic_size) != 0) {
+    std::cout << "No usable chunk index at " << index_path_ << ", starting empty" << "\n";
+    return;
+  }
+
+  size_t offset = magic_size;
+  while (offset < bytes.size()) {
+    std::string name;
+    File file;
+    if (!GetFile(bytes, offset, name, file)) {
+      // Whatever follows a torn record cannot be trusted; those files are chunked again
+      std::cerr << "Ignoring the rest of a malformed chunk index: " << index_path_ << "\n";
+      dirty_ = true;
+      break;
+    }
+    files_[name] = std::move(file);
+  }
+}
+
+void ChunkIndex::Save() {
+  if (!dirty_) {
+    return;
+  }
+
+  std::vector<uint8_t> out(kIndexMagic, kIndexMagic + std::strlen(kIndexMagic));
+  for (const auto& [name, file] : files_) {
+    Put(out, static_cast<uint16_t>(name.size()));
+    out.insert(out.end(), name.begin(), name.end());
+    Put(out, file.size);
+    Put(out, file.mtime_ns);
+    Put(out, file.inode);
+    Put(out, static_cast<uint32_t>(file.chunks.size()));
+    for (const auto& chunk : file.chunks) {
+      out.insert(out.end(), chunk.hash.begin(), chunk.hash.end());
+      Put(out, chunk.length);
+    }
+  }
+
+  // Write next to the index and rename so a crash never leaves a torn index behind
+  std::filesystem::path temp_path = index_path_;
+  temp_path += ".tmp";
+
+  std::ofstream file(temp_path, std::ios::binary | std::ios::trunc);
+  file.write(reinterpret_cast<const char*>(out.data()), out.size());
+  file.close();
+
+  std::error_code ec;
+  if (!file) {
+    std::cerr << "Failed to write chunk index: " << temp_path << "\n";
+  } else if (std::filesystem::rename(temp_path, index_path_, ec); ec) {
+    std::cerr << "Failed to replace chunk index: " << ec.message() << "\n";
+  } else {
+    dirty_ = false;
+  }
+}
+
+void ChunkIndex::Update(const std::filesystem::path& dir) {
+  std::unordered_set<std::string> seen;
+  std::error_code ec;
+
+  for (const auto& entry : std::filesystem::directory_iterator(dir, ec)) {
+    std::string file_name = entry.path().filename().string();
+    struct stat st;
+
+    if (IsHiddenFile(file_name) || stat(entry.path().c_str(), &st) < 0 || !S_ISREG(st.st_mode)) {
+      continue;
+    }
+
+    auto it = files_.find(file_name);
+    if (it != files_.end() && it->second.size == static_cast<uint64_t>(st.st_size) &&
+        it->second.mtime_ns == ModificationTimeNs(st) && it->second.inode == static_cast<uint64_t>(st.st_ino)) {
+      seen.insert(file_name);
+      continue;
+    }
+
+    std::optional<std::vector<protocol::ChunkInfo>> chunks = ChunkFile(entry.path());
+    if (!chunks) {
+      continue;
+    }
+    Record(entry.path(), std::move(*chunks));
+    seen.insert(file_name);
+  }
+
+  // Forget files that no longer exist
+  for (auto it = files_.begin(); it != files_.end();) {
+    if (seen.count(it->first) == 0) {
+      it = files_.erase(it);
+      dirty_ = true;
+    } else {
+      ++it;
+    }
+  }
+}
+
+void ChunkIndex::Record(const std::filesystem::path& file_path, std::vector<protocol::ChunkInfo> chunks) {
+  struct stat st;
+  if (stat(file_path.c_str(), &st) < 0) {
+    return;
+  }
+
+  // A file that changed while it was being chunked is chunked again next time
+  uint64_t total = 0;
+  for (const auto& chunk : chunks) {
+    total += chunk.length;
+  }
+  if (total != static_cast<uint64_t>(st.st_size)) {
+    files_.erase(file_path.filename().string());
+    dirty_ = true;
+    return;
+  }
+
+  files_[file_path.filename().string()] = File {
+    .size = static_cast<uint64_t>(st.st_size),
+    .mtime_ns = ModificationTimeNs(st),
+    .inode = static_cast<uint64_t>(st.st_ino),
+    .chunks = std::move(chunks)
+  };
+  dirty_ = true;
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "protocol/protocol.h"
+
+// Persistent cache of the content-defined chunks of the files in a directory.
+// Like HashIndex, a file's chunks are trusted as long as its size,
+// modification time and inode still match what was recorded when it was
+// chunked, so bringing an unchanged directory up to date costs a stat() per
+// file instead of reading every byte again.
+class ChunkIndex {
+ public:
+  struct File {
+    uint64_t size;
+    int64_t mtime_ns;
+    uint64_t inode;
+    std::vector<protocol::ChunkInfo> chunks;
+  };
+
+  explicit ChunkIndex(std::filesystem::path index_path);
+
+  // Loads the on-disk index; a missing or unreadable index starts out empty
+  void Load();
+  // Writes the index atomically (temporary file + rename) if anything changed
+  void Save();
+
+  // Rechunks the visible files of `dir` whose metadata changed and forgets
+  // the ones that are gone or cannot be read
+  void Update(const std::filesystem::path& dir);
+
+  // Records the chunks of a file that was just written, so it is not read again
+  void Record(const std::filesystem::path& file_path, std::vector<protocol::ChunkInfo> chunks);
+
+  // Indexed files by name, as of the last Update() or Record()
+  const std::unordered_map<std::string, File>& files() const { return files_; }
+
+ private:
+  std::filesystem::path index_path_;
+  std::unordered_map<std::string, File> files_;
+  bool dirty_ = false;
+};
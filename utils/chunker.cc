@@ -0,0 +1,138 @@
+#include "chunker.h"
+
+#include <algorithm>
+#include <array>
+#include <fcntl.h>
+#include <memory>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "mapped_file.h"
+#include "sha256.h"
+
+namespace {
+  // Random 64-bit value per byte value; fixed so every peer finds the same boundaries
+  constexpr std::array<uint64_t, 256> kGear = [] {
+    std::array<uint64_t, 256> gear{};
+    uint64_t state = 0x9e3779b97f4a7c15;
+
+    // splitmix64
+    for (auto& value : gear) {
+      uint64_t z = (state += 0x9e3779b97f4a7c15);
+      z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+      z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+      value = z ^ (z >> 31);
+    }
+    return gear;
+  }();
+
+  // The top bits of the gear hash mix in the most bytes. 13 bits average 8 KiB;
+  // two bits more (or less) before (after) that size normalize the distribution
+  constexpr uint64_t TopBits(int bits) {
+    return ~uint64_t{0} << (64 - bits);
+  }
+  constexpr uint64_t kMaskSmall = TopBits(15);
+  constexpr uint64_t kMaskLarge = TopBits(11);
+}
+
+size_t ChunkLength(const uint8_t* data, size_t size) {
+  if (size <= kMinChunkSize) {
+    return size;
+  }
+
+  size_t normal = std::min(size, kAverageChunkSize);
+  size_t limit = std::min(size, kMaxChunkSize);
+  uint64_t hash = 0;
+  size_t i = kMinChunkSize;
+
+  // Nothing before the minimum size can be a boundary, so it is not even hashed
+  for (; i < normal; i++) {
+    hash = (hash << 1) + kGear[data[i]];
+    if ((hash & kMaskSmall) == 0) {
+      return i + 1;
+    }
+  }
+
+  for (; i < limit; i++) {
+    hash = (hash << 1) + kGear[data[i]];
+    if ((hash & kMaskLarge) == 0) {
+      return i + 1;
+    }
+  }
+
+  return limit;
+}
+
+namespace {
+  // Enough chunks per hashMany() call to keep every SIMD lane busy
+  constexpr size_t kHashBatch = 256;
+
+  // Boundaries and digests of up to kHashBatch chunks, in fixed arrays so
+  // filling them touches no heap memory
+  struct Batch {
+    std::array<const void*, kHashBatch> starts;
+    std::array<size_t, kHashBatch> lengths;
+    std::array<uint8_t, kHashBatch * SHA256::HashBytes> digests;
+    size_t count;
+
+    // Cuts and hashes the chunks of `data` from `offset` on, advancing it past them
+    void Fill(const uint8_t* data, size_t size, size_t& offset) {
+      for (count = 0; count < kHashBatch && offset < size; count++) {
+        starts[count] = data + offset;
+        lengths[count] = ChunkLength(data + offset, size - offset);
+        offset += lengths[count];
+      }
+      SHA256::hashMany(starts.data(), lengths.data(), count, digests.data());
+    }
+
+    void AppendTo(std::vector<protocol::ChunkInfo>& chunks) const {
+      for (size_t i = 0; i < count; i++) {
+        protocol::ChunkInfo& chunk = chunks.emplace_back();
+        std::copy_n(digests.begin() + i * SHA256::HashBytes, SHA256::HashBytes, chunk.hash.begin());
+        chunk.length = static_cast<uint32_t>(lengths[i]);
+      }
+    }
+  };
+}
+
+std::vector<protocol::ChunkInfo> ChunkData(const uint8_t* data, size_t size) {
+  std::vector<protocol::ChunkInfo> chunks;
+  chunks.reserve(size / kAverageChunkSize + 1);
+
+  Batch batch;
+  for (size_t offset = 0; offset < size;) {
+    batch.Fill(data, size, offset);
+    batch.AppendTo(chunks);
+  }
+  return chunks;
+}
+
+std::optional<std::vector<protocol::ChunkInfo>> ChunkFile(const std::filesystem::path& path) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  struct stat st;
+
+  if (fd < 0) {
+    return std::nullopt;
+  } else if (fstat(fd, &st) < 0) {
+    close(fd);
+    return std::nullopt;
+  }
+
+  std::shared_ptr<const MappedFile> mapping = MappedFile::Map(fd, st.st_size, MADV_SEQUENTIAL);
+  close(fd);
+  if (!mapping) {
+    return st.st_size == 0 ? std::optional(std::vector<protocol::ChunkInfo>{}) : std::nullopt;
+  }
+
+  std::vector<protocol::ChunkInfo> chunks;
+  chunks.reserve(mapping->size() / kAverageChunkSize + 1);
+
+  // One batch at a time, so a file truncated meanwhile only fails the batch reading past its end
+  Batch batch;
+  for (size_t offset = 0; offset < mapping->size();) {
+    if (!GuardMappedReads([&] { batch.Fill(mapping->data(), mapping->size(), offset); })) {
+      return std::nullopt;
+    }
+    batch.AppendTo(chunks);
+  }
+  return chunks;
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <vector>
+#include "protocol/protocol.h"
+
+// FastCDC content-defined chunking. Boundaries are picked where a gear hash of
+// the last 64 bytes matches a mask, so they depend only on nearby content: an
+// insertion shifts at most the chunks around it, and identical regions of
+// different files split into identical chunks. Normalized chunking (a stricter
+// mask before the average size, a looser one after) keeps sizes close to it.
+constexpr size_t kMinChunkSize = 2 * 1024;
+constexpr size_t kAverageChunkSize = 8 * 1024;
+constexpr size_t kMaxChunkSize = 64 * 1024;
+// Smaller files are sent whole: what their chunks could save is not worth a FETCH round trip
+constexpr uint64_t kMinChunkedFileSize = 1024 * 1024;
+
+// Length of the chunk starting at `data`, at most `size`
+size_t ChunkLength(const uint8_t* data, size_t size);
+
+// Chunks of `data` in order, with their SHA-256 digests
+std::vector<protocol::ChunkInfo> ChunkData(const uint8_t* data, size_t size);
+
+// Chunks of a file, or nothing if it cannot be read
+std::optional<std::vector<protocol::ChunkInfo>> ChunkFile(const std::filesystem::path& path);
@@ -0,0 +1,144 @@
+#include "compression.h"
+
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <cmath>
+#include <filesystem>
+#include <unistd.h>
+#include <zstd.h>
+#include "protocol/protocol.h"
+#include "utils.h"
+
+namespace {
+  // Fast enough to keep up with a local network on one core
+  constexpr int kCompressionLevel = 3;
+
+  // Input fed to zstd per block; a block holds at most its worst-case output
+  constexpr size_t kBlockInputSize = 128 * 1024;
+  constexpr size_t kBlockOutputSize = ZSTD_COMPRESSBOUND(kBlockInputSize);
+  static_assert(sizeof(uint32_t) + kBlockOutputSize <= protocol::kMaxCompressedBlockSize);
+
+  // Anything smaller gains less than the block framing costs
+  constexpr uint64_t kMinCompressibleSize = 4 * 1024;
+
+  constexpr size_t kEntropySampleSize = 16 * 1024;
+  // Bits per byte above which zstd saves next to nothing
+  constexpr double kMaxEntropy = 7.5;
+
+  // Audio and the usual archive, image and video formats
+  const std::array<const char*, 18> kCompressedExtensions = {
+    ".mp3", ".ogg", ".opus", ".flac", ".aac", ".m4a",
+    ".zip", ".gz", ".zst", ".xz", ".bz2", ".7z",
+    ".jpg", ".jpeg", ".png", ".webp", ".mp4", ".mkv"
+  };
+
+  double Entropy(const uint8_t* data, size_t size) {
+    std::array<size_t, 256> counts{};
+    for (size_t i = 0; i < size; i++) {
+      counts[data[i]]++;
+    }
+
+    double entropy = 0;
+    for (size_t count : counts) {
+      if (count > 0) {
+        double p = static_cast<double>(count) / size;
+        entropy -= p * std::log2(p);
+      }
+    }
+    return entropy;
+  }
+}
+
+Compressor::Compressor() : context_(ZSTD_createCCtx()) {
+  if (!context_) {
+    FatalError("ZSTD_createCCtx() failed");
+  }
+  ZSTD_CCtx_setParameter(context_, ZSTD_c_compressionLevel, kCompressionLevel);
+}
+
+Compressor::~Compressor() {
+  ZSTD_freeCCtx(context_);
+}
+
+bool Compressor::Compress(const uint8_t* data, size_t size, bool end, std::vector<uint8_t>& out) {
+  size_t consumed = 0;
+  bool finished = false;
+
+  while (!finished) {
+    // At most kBlockInputSize goes in per block, which bounds what comes out
+    ZSTD_inBuffer input { .src = data, .size = std::min(size, consumed + kBlockInputSize), .pos = consumed };
+    ZSTD_EndDirective directive = end && input.size == size ? ZSTD_e_end : ZSTD_e_continue;
+
+    // Leave room for the block length, filled in once the block's size is known
+    size_t block_start = out.size();
+    out.resize(block_start + sizeof(uint32_t) + kBlockOutputSize);
+    ZSTD_outBuffer output { .dst = out.data() + block_start + sizeof(uint32_t), .size = kBlockOutputSize, .pos = 0 };
+
+    size_t remaining;
+    do {
+      remaining = ZSTD_compressStream2(context_, &output, &input, directive);
+      if (ZSTD_isError(remaining)) {
+        ZSTD_CCtx_reset(context_, ZSTD_reset_session_only);
+        return false;
+      }
+    } while (output.pos < output.size && (input.pos < input.size || (directive == ZSTD_e_end && remaining > 0)));
+
+    if (output.pos == 0) {
+      out.resize(block_start);
+    } else {
+      out.resize(block_start + sizeof(uint32_t) + output.pos);
+      for (size_t i = 0; i < sizeof(uint32_t); i++) {
+        out[block_start + i] = static_cast<uint8_t>(output.pos >> (8 * (sizeof(uint32_t) - 1 - i)));
+      }
+    }
+
+    consumed = input.pos;
+    finished = consumed == size && (directive != ZSTD_e_end || remaining == 0);
+  }
+
+  return true;
+}
+
+Decompressor::Decompressor() : context_(ZSTD_createDCtx()) {
+  if (!context_) {
+    FatalError("ZSTD_createDCtx() failed");
+  }
+}
+
+Decompressor::~Decompressor() {
+  ZSTD_freeDCtx(context_);
+}
+
+bool Decompressor::Decompress(const uint8_t* in, size_t in_size, size_t& in_pos, uint8_t* out, size_t out_size, size_t& out_pos) {
+  ZSTD_inBuffer input { .src = in, .size = in_size, .pos = in_pos };
+  ZSTD_outBuffer output { .dst = out, .size = out_size, .pos = out_pos };
+
+  size_t result = ZSTD_decompressStream(context_, &output, &input);
+  if (ZSTD_isError(result)) {
+    FatalError(std::string("Corrupt compressed payload: ") + ZSTD_getErrorName(result));
+  }
+
+  in_pos = input.pos;
+  out_pos = output.pos;
+  return result == 0;
+}
+
+bool IsCompressible(std::string_view name, int fd, off_t offset, uint64_t size) {
+  if (size < kMinCompressibleSize) {
+    return false;
+  }
+
+  std::string extension = std::filesystem::path(name).extension().string();
+  std::transform(extension.begin(), extension.end(), extension.begin(), [](unsigned char c) { return std::tolower(c); });
+  if (std::find(kCompressedExtensions.begin(), kCompressedExtensions.end(), extension) != kCompressedExtensions.end()) {
+    return false;
+  }
+
+  // Sample the middle of the range, past any header
+  std::array<uint8_t, kEntropySampleSize> sample;
+  off_t sample_offset = offset + static_cast<off_t>(size / 2 - std::min<uint64_t>(size / 2, sample.size() / 2));
+  ssize_t bytes_read = pread(fd, sample.data(), std::min<uint64_t>(size, sample.size()), sample_offset);
+
+  return bytes_read > 0 && Entropy(sample.data(), bytes_read) < kMaxEntropy;
+}
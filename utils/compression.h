@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <sys/types.h>
+#include <vector>
+
+struct ZSTD_CCtx_s;
+struct ZSTD_DCtx_s;
+
+// Streaming zstd compressor for one connection. Every compressed message is a
+// frame of its own, emitted as the length-prefixed blocks of protocol.h.
+class Compressor {
+ public:
+  Compressor();
+  ~Compressor();
+  Compressor(const Compressor&) = delete;
+  Compressor& operator=(const Compressor&) = delete;
+
+  // Feeds the next part of the current frame and appends whatever blocks it
+  // produced to `out` (zstd may hold small inputs back); `end` closes the frame.
+  // False if zstd failed, in which case the frame is discarded.
+  bool Compress(const uint8_t* data, size_t size, bool end, std::vector<uint8_t>& out);
+
+ private:
+  ZSTD_CCtx_s* context_;
+};
+
+class Decompressor {
+ public:
+  Decompressor();
+  ~Decompressor();
+  Decompressor(const Decompressor&) = delete;
+  Decompressor& operator=(const Decompressor&) = delete;
+
+  // Decompresses from in[in_pos, in_size) into out[out_pos, out_size),
+  // advancing both positions. Returns true once the frame is complete
+  bool Decompress(const uint8_t* in, size_t in_size, size_t& in_pos, uint8_t* out, size_t out_size, size_t& out_pos);
+
+ private:
+  ZSTD_DCtx_s* context_;
+};
+
+// Whether `size` bytes of a file starting at `offset` are worth compressing:
+// not tiny, not a format that is compressed already (judged by the name's
+// extension), and not close to random in a sample read from `fd`
+bool IsCompressible(std::string_view name, int fd, off_t offset, uint64_t size);
@@ -0,0 +1,154 @@
+#include "delta.h"
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include "sha256.h"
+#include "utils.h"
+
+namespace {
+  constexpr uint32_t kMinBlockSize = 1024;
+  constexpr uint32_t kMaxBlockSize = 64 * 1024;
+
+  void BlockSums(const uint8_t* data, size_t size, uint32_t& a, uint32_t& b) {
+    a = 0;
+    b = 0;
+    for (size_t i = 0; i < size; i++) {
+      a += data[i];
+      b += (size - i) * data[i];
+    }
+    a &= 0xffff;
+    b &= 0xffff;
+  }
+
+  std::array<uint8_t, protocol::kDeltaStrongBytes> StrongChecksum(const uint8_t* data, size_t size) {
+    SHA256 sha256;
+    sha256.add(data, size);
+
+    protocol::Digest digest;
+    sha256.getHash(digest.data());
+
+    std::array<uint8_t, protocol::kDeltaStrongBytes> strong;
+    std::copy(digest.begin(), digest.begin() + strong.size(), strong.begin());
+    return strong;
+  }
+}
+
+uint32_t DeltaBlockSize(uint64_t file_size) {
+  uint32_t block_size = static_cast<uint32_t>(std::sqrt(static_cast<double>(file_size)));
+  return std::clamp(block_size, kMinBlockSize, kMaxBlockSize);
+}
+
+uint32_t WeakChecksum(const uint8_t* data, size_t size) {
+  uint32_t a, b;
+  BlockSums(data, size, a, b);
+  return (b << 16) | a;
+}
+
+std::vector<protocol::BlockSignature> ComputeSignatures(const std::filesystem::path& path, uint32_t block_size) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file) {
+    FatalError("Failed to open file for reading: " + path.string());
+  }
+
+  std::vector<protocol::BlockSignature> signatures;
+  std::vector<uint8_t> block(block_size);
+
+  while (file.read(reinterpret_cast<char *>(block.data()), block_size)) {
+    signatures.push_back({
+      .weak = WeakChecksum(block.data(), block_size),
+      .strong = StrongChecksum(block.data(), block_size)
+    });
+  }
+
+  return signatures;
+}
+
+std::pmr::vector<protocol::DeltaInstruction> ComputeDelta(const uint8_t* data, size_t size, uint32_t block_size,
+                                                          std::span<const protocol::BlockSignature> signatures,
+                                                          std::pmr::memory_resource* resource) {
+  std::pmr::vector<protocol::DeltaInstruction> instructions(resource);
+
+  auto emit_literal = [&](size_t from, size_t to) {
+    if (to > from) {
+      instructions.push_back({ .op = protocol::DeltaOp::LITERAL, .offset = from, .length = to - from });
+    }
+  };
+
+  auto emit_copy = [&](uint32_t block) {
+    protocol::DeltaInstruction* last = instructions.empty() ? nullptr : &instructions.back();
+    if (last && last->op == protocol::DeltaOp::COPY && last->offset + last->length == block) {
+      last->length++;
+    } else {
+      instructions.push_back({ .op = protocol::DeltaOp::COPY, .offset = block, .length = 1 });
+    }
+  };
+
+  // Weak checksums sorted for binary search, paired with their block index
+  std::pmr::vector<std::pair<uint32_t, uint32_t>> index(resource);
+  index.reserve(signatures.size());
+  for (uint32_t i = 0; i < signatures.size(); i++) {
+    index.emplace_back(signatures[i].weak, i);
+  }
+  std::sort(index.begin(), index.end());
+
+  size_t literal_start = 0;
+  size_t position = 0;
+
+  if (!index.empty() && block_size > 0 && size >= block_size) {
+    uint32_t a, b;
+    BlockSums(data, block_size, a, b);
+
+    while (true) {
+      uint32_t weak = (b << 16) | a;
+      auto candidates = std::equal_range(index.begin(), index.end(), std::make_pair(weak, 0u),
+                                         [](const auto& lhs, const auto& rhs) { return lhs.first < rhs.first; });
+
+      // The strong checksum is only computed when the weak one already matches
+      int64_t matched_block = -1;
+      if (candidates.first != candidates.second) {
+        auto strong = StrongChecksum(data + position, block_size);
+
+        for (auto it = candidates.first; it != candidates.second; ++it) {
+          if (signatures[it->second].strong != strong) {
+            continue;
+          }
+
+          matched_block = it->second;
+          // Prefer the block that continues the previous COPY run
+          const protocol::DeltaInstruction* last = instructions.empty() ? nullptr : &instructions.back();
+          if (last && last->op == protocol::DeltaOp::COPY && last->offset + last->length == it->second) {
+            break;
+          }
+        }
+      }
+
+      if (matched_block >= 0) {
+        emit_literal(literal_start, position);
+        emit_copy(static_cast<uint32_t>(matched_block));
+        position += block_size;
+        literal_start = position;
+
+        if (position + block_size > size) {
+          break;
+        }
+        BlockSums(data + position, block_size, a, b);
+        continue;
+      }
+
+      if (position + block_size >= size) {
+        break;
+      }
+
+      // Slide the window one byte: drop data[position], take in data[position + block_size]
+      uint32_t out = data[position];
+      uint32_t in = data[position + block_size];
+      a = (a - out + in) & 0xffff;
+      b = (b - block_size * out + a) & 0xffff;
+      position++;
+    }
+  }
+
+  emit_literal(literal_start, size);
+  return instructions;
+}
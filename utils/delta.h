@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <memory_resource>
+#include <span>
+#include <vector>
+#include "protocol/protocol.h"
+
+// rsync-style delta encoding. The receiver describes the copy it already has
+// as per-block signatures; the sender slides a rolling checksum over its newer
+// file and expresses it as COPY (blocks the receiver has, at any offset) and
+// LITERAL (new bytes) instructions. Inserting bytes near the start of a file,
+// as an ID3 tag edit does, costs only the inserted bytes plus a few blocks.
+
+// Block size for a file of this size: about sqrt(size), clamped to [1 KiB, 64 KiB]
+uint32_t DeltaBlockSize(uint64_t file_size);
+
+// Rolling checksum of one block (rsync's two 16-bit sums)
+uint32_t WeakChecksum(const uint8_t* data, size_t size);
+
+// Signatures of every full block of the file; a trailing partial block is left out
+std::vector<protocol::BlockSignature> ComputeSignatures(const std::filesystem::path& path, uint32_t block_size);
+
+// Instructions rebuilding `data` from the blocks described by `signatures`.
+// LITERAL instructions carry their offset into `data`; adjacent COPY runs are merged.
+// The instructions and the working index are allocated from `resource`.
+std::pmr::vector<protocol::DeltaInstruction> ComputeDelta(const uint8_t* data, size_t size, uint32_t block_size,
+                                                          std::span<const protocol::BlockSignature> signatures,
+                                                          std::pmr::memory_resource* resource = std::pmr::get_default_resource());
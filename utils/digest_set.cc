@@ -0,0 +1,68 @@
+#include "digest_set.h"
+
+#include <cstring>
+
+namespace {
+  constexpr size_t kMinCapacity = 16;
+}
+
+DigestSet::DigestSet(size_t expected_size) {
+  // Keep the load factor at or below 1/2
+  size_t capacity = kMinCapacity;
+  while (capacity < 2 * expected_size) {
+    capacity *= 2;
+  }
+
+  slots_.resize(capacity);
+  occupied_.assign(capacity, 0);
+  mask_ = capacity - 1;
+}
+
+size_t DigestSet::Slot(const protocol::Digest& digest) const {
+  uint64_t hash;
+  std::memcpy(&hash, digest.data(), sizeof(hash));
+  return hash & mask_;
+}
+
+void DigestSet::Insert(const protocol::Digest& digest) {
+  if (2 * (size_ + 1) > slots_.size()) {
+    Grow();
+  }
+
+  for (size_t slot = Slot(digest);; slot = (slot + 1) & mask_) {
+    if (!occupied_[slot]) {
+      slots_[slot] = digest;
+      occupied_[slot] = 1;
+      size_++;
+      return;
+    } else if (slots_[slot] == digest) {
+      return;
+    }
+  }
+}
+
+bool DigestSet::Contains(const protocol::Digest& digest) const {
+  for (size_t slot = Slot(digest);; slot = (slot + 1) & mask_) {
+    if (!occupied_[slot]) {
+      return false;
+    } else if (slots_[slot] == digest) {
+      return true;
+    }
+  }
+}
+
+void DigestSet::Grow() {
+  std::vector<protocol::Digest> old_slots = std::move(slots_);
+  std::vector<uint8_t> old_occupied = std::move(occupied_);
+
+  slots_.assign(old_slots.size() * 2, protocol::Digest{});
+  occupied_.assign(old_slots.size() * 2, 0);
+  mask_ = slots_.size() - 1;
+  size_ = 0;
+
+  for (size_t i = 0; i < old_slots.size(); i++) {
+    if (old_occupied[i]) {
+      Insert(old_slots[i]);
+    }
+  }
+}
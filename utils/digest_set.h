@@ -0,0 +1,74 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include "protocol/protocol.h"
+
+// Hasher for standard containers keyed by digest (see DigestSet on why the leading bytes suffice)
+struct DigestHash {
+  size_t operator()(const protocol::Digest& digest) const {
+    uint64_t hash;
+    std::memcpy(&hash, digest.data(), sizeof(hash));
+    return hash;
+  }
+};
+
+// Open-addressing (linear probing) hash set of SHA-256 digests. Digests are
+// already uniformly distributed, so their leading bytes serve as the hash.
+class DigestSet {
+ public:
+  explicit DigestSet(size_t expected_size = 0);
+
+  void Insert(const protocol::Digest& digest);
+  bool Contains(const protocol::Digest& digest) const;
+  size_t size() const { return size_; }
+
+ private:
+  size_t Slot(const protocol::Digest& digest) const;
+  void Grow();
+
+  std::vector<protocol::Digest> slots_;
+  std::vector<uint8_t> occupied_;
+  size_t mask_ = 0;
+  size_t size_ = 0;
+};
+
+// Files of `source` whose content is not present anywhere in `target`, in
+// `source` order. Runs in linear time: a sorted merge when both lists are
+// ordered by hash, a DigestSet lookup otherwise. Works on any mix of
+// FileHeader and FileHeaderView, so a parsed LIST can be diffed in place.
+template <typename Source, typename Target>
+std::vector<Source> FilesMissingFrom(const std::vector<Source>& source, const std::vector<Target>& target) {
+  auto hash_less = [](const auto& a, const auto& b) { return a.hash < b.hash; };
+  std::vector<Source> missing;
+
+  if (std::is_sorted(source.begin(), source.end(), hash_less) &&
+      std::is_sorted(target.begin(), target.end(), hash_less)) {
+    auto it = target.begin();
+    for (const auto& file : source) {
+      while (it != target.end() && it->hash < file.hash) {
+        ++it;
+      }
+      if (it == target.end() || it->hash != file.hash) {
+        missing.push_back(file);
+      }
+    }
+    return missing;
+  }
+
+  DigestSet target_hashes(target.size());
+  for (const auto& file : target) {
+    target_hashes.Insert(file.hash);
+  }
+
+  for (const auto& file : source) {
+    if (!target_hashes.Contains(file.hash)) {
+      missing.push_back(file);
+    }
+  }
+
+  return missing;
+}
@@ -0,0 +1,139 @@
+#include "digest_set.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+#include "protocol/protocol.h"
+
+// Checks both FilesMissingFrom() paths, the sorted merge and the DigestSet
+// lookup, against a plain quadratic loop on the same input
+
+namespace {
+  int failures = 0;
+
+  void Check(bool condition, const std::string& what) {
+    if (!condition) {
+      std::cerr << "FAILED: " << what << "\n";
+      failures++;
+    }
+  }
+
+  auto hash_less = [](const auto& a, const auto& b) { return a.hash < b.hash; };
+
+  template <typename Source, typename Target>
+  std::vector<Source> NaiveFilesMissingFrom(const std::vector<Source>& source, const std::vector<Target>& target) {
+    std::vector<Source> missing;
+    for (const auto& file : source) {
+      bool found = false;
+      for (const auto& other : target) {
+        found |= other.hash == file.hash;
+      }
+      if (!found) {
+        missing.push_back(file);
+      }
+    }
+    return missing;
+  }
+
+  bool SameFiles(const std::vector<protocol::FileHeader>& a, const std::vector<protocol::FileHeader>& b) {
+    return std::equal(a.begin(), a.end(), b.begin(), b.end(),
+                      [](const auto& x, const auto& y) { return x.name == y.name && x.hash == y.hash; });
+  }
+
+  // `count` files, a few of which share content with each other
+  std::vector<protocol::FileHeader> RandomFiles(std::mt19937_64& rng, size_t count) {
+    std::vector<protocol::FileHeader> files(count);
+    for (size_t i = 0; i < count; i++) {
+      files[i].name = "file" + std::to_string(i);
+      files[i].name_length = static_cast<uint8_t>(files[i].name.size());
+      if (i > 0 && rng() % 16 == 0) {
+        files[i].hash = files[rng() % i].hash;
+        continue;
+      }
+      for (auto& byte : files[i].hash) {
+        byte = static_cast<uint8_t>(rng());
+      }
+    }
+    return files;
+  }
+
+  // Target holding a random part of the source's content, plus content of its own
+  std::vector<protocol::FileHeader> Overlapping(std::mt19937_64& rng, const std::vector<protocol::FileHeader>& source, size_t extra) {
+    std::vector<protocol::FileHeader> target;
+    for (const auto& file : source) {
+      if (rng() % 3 != 0) {
+        target.push_back(file);
+      }
+    }
+    std::vector<protocol::FileHeader> own = RandomFiles(rng, extra);
+    target.insert(target.end(), own.begin(), own.end());
+    return target;
+  }
+
+  void CheckBothPaths(std::mt19937_64& rng, std::vector<protocol::FileHeader> source, std::vector<protocol::FileHeader> target, const std::string& what) {
+    // Hash-set path: at least one side out of order
+    std::shuffle(source.begin(), source.end(), rng);
+    std::shuffle(target.begin(), target.end(), rng);
+    if (source.size() > 1 && std::is_sorted(source.begin(), source.end(), hash_less)) {
+      std::swap(source.front(), source.back());
+    }
+    Check(SameFiles(FilesMissingFrom(source, target), NaiveFilesMissingFrom(source, target)), what + " (hash set)");
+
+    // The same lists through a FileHeaderView, as a parsed LIST is diffed
+    std::vector<protocol::FileHeaderView> views;
+    for (const auto& file : target) {
+      views.push_back({ .name = file.name, .hash = file.hash });
+    }
+    Check(SameFiles(FilesMissingFrom(source, views), NaiveFilesMissingFrom(source, views)), what + " (hash set, views)");
+
+    // Merge path: both sides ordered by hash
+    std::sort(source.begin(), source.end(), hash_less);
+    std::sort(target.begin(), target.end(), hash_less);
+    Check(SameFiles(FilesMissingFrom(source, target), NaiveFilesMissingFrom(source, target)), what + " (merge)");
+  }
+
+  void TestDigestSet(std::mt19937_64& rng) {
+    std::vector<protocol::FileHeader> files = RandomFiles(rng, 5000);
+    // Starts small so the set has to grow several times
+    DigestSet set;
+    for (size_t i = 0; i < files.size(); i += 2) {
+      set.Insert(files[i].hash);
+      set.Insert(files[i].hash);
+    }
+
+    std::vector<protocol::FileHeader> inserted;
+    for (size_t i = 0; i < files.size(); i += 2) {
+      inserted.push_back(files[i]);
+    }
+    for (const auto& file : files) {
+      bool expected = std::any_of(inserted.begin(), inserted.end(), [&](const auto& other) { return other.hash == file.hash; });
+      Check(set.Contains(file.hash) == expected, "DigestSet membership of " + file.name);
+    }
+  }
+}
+
+int main() {
+  std::mt19937_64 rng(2024);
+
+  CheckBothPaths(rng, {}, {}, "both empty");
+  CheckBothPaths(rng, RandomFiles(rng, 100), {}, "empty target");
+  CheckBothPaths(rng, {}, RandomFiles(rng, 100), "empty source");
+
+  for (size_t size : {1, 2, 17, 1000, 3000}) {
+    std::vector<protocol::FileHeader> source = RandomFiles(rng, size);
+    CheckBothPaths(rng, source, Overlapping(rng, source, size / 4), std::to_string(size) + " files");
+    CheckBothPaths(rng, source, source, std::to_string(size) + " identical files");
+  }
+
+  TestDigestSet(rng);
+
+  if (failures > 0) {
+    std::cerr << failures << " checks failed" << "\n";
+    return EXIT_FAILURE;
+  }
+  std::cout << "All FilesMissingFrom checks passed" << "\n";
+  return EXIT_SUCCESS;
+}
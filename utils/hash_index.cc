@@ -0,0 +1,214 @@
+#include "hash_index.h"
+
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <unordered_set>
+#include <sys/stat.h>
+#include "utils.h"
+
+namespace {
+  constexpr const char* kIndexMagic = "# hash index v1";
+}
+
+HashIndex::HashIndex(std::filesystem::path index_path) : index_path_(std::move(index_path)) {}
+
+void HashIndex::Load() {
+  std::ifstream in(index_path_);
+  std::string line;
+
+  if (!in || !std::getline(in, line) || line != kIndexMagic) {
+    std::cout << "No usable hash index at " << index_path_ << ", starting empty" << "\n";
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  // One entry per line: inode size mtime_ns hash name (name last, it may contain spaces)
+  while (std::getline(in, line)) {
+    std::istringstream fields(line);
+    Entry entry;
+    std::string hash;
+    std::string name;
+
+    if (!(fields >> entry.inode >> entry.size >> entry.mtime_ns >> hash) || fields.get() != ' ' ||
+        !std::getline(fields, name) || !DigestFromHex(hash, entry.hash)) {
+      std::cerr << "Skipping malformed hash index line: " << line << "\n";
+      continue;
+    }
+
+    entries_[name] = std::move(entry);
+  }
+
+  std::cout << "Loaded " << entries_.size() << " entries from hash index " << index_path_ << "\n";
+}
+
+void HashIndex::Save() {
+  std::ostringstream out;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!dirty_) {
+      return;
+    }
+
+    out << kIndexMagic << "\n";
+    for (const auto& [name, entry] : entries_) {
+      out << entry.inode << " " << entry.size << " " << entry.mtime_ns << " " << DigestToHex(entry.hash) << " " << name << "\n";
+    }
+    dirty_ = false;
+  }
+
+  // Write next to the index and rename so a crash never leaves a torn index behind
+  std::filesystem::path temp_path = index_path_;
+  temp_path += ".tmp";
+
+  std::ofstream file(temp_path, std::ios::trunc);
+  file << out.str();
+  file.close();
+
+  if (!file) {
+    std::cerr << "Failed to write hash index: " << temp_path << "\n";
+    return;
+  }
+
+  std::error_code ec;
+  std::filesystem::rename(temp_path, index_path_, ec);
+  if (ec) {
+    std::cerr << "Failed to replace hash index: " << ec.message() << "\n";
+  }
+}
+
+std::vector<protocol::FileHeader> HashIndex::ListFilesWithHashes(const std::filesystem::path& dir) {
+  std::vector<protocol::FileHeader> out;
+  std::unordered_set<std::string> seen;
+
+  // Files whose metadata changed, hashed together on all cores after the scan
+  std::vector<std::filesystem::path> stale_paths;
+  std::vector<Entry> stale_entries;
+  std::vector<size_t> stale_slots;
+
+  for (const auto& entry : std::filesystem::directory_iterator(dir)) {
+    if (!entry.is_regular_file()) {
+      continue;
+    }
+
+    auto path = entry.path();
+    std::string file_name = path.filename().string();
+
+    if (IsHiddenFile(file_name)) {
+      continue;
+    }
+    std::optional<Entry> current = Stat(path);
+
+    if (!current) {
+      // Deleted between the directory scan and now
+      continue;
+    }
+
+    protocol::FileHeader file_header;
+    file_header.name_length = static_cast<uint8_t>(file_name.size());
+    file_header.name = file_name;
+    if (!FindCached(file_name, *current)) {
+      stale_paths.push_back(path);
+      stale_entries.push_back(*current);
+      stale_slots.push_back(out.size());
+    }
+    file_header.hash = current->hash;
+    out.push_back(file_header);
+    seen.insert(file_name);
+  }
+
+  std::vector<std::optional<protocol::Digest>> hashes = HashFiles(stale_paths);
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  bool dropped = false;
+  for (size_t i = 0; i < hashes.size(); i++) {
+    protocol::FileHeader& file_header = out[stale_slots[i]];
+    if (!hashes[i]) {
+      // Deleted or unreadable since the scan: neither listed nor remembered
+      seen.erase(file_header.name);
+      file_header.name.clear();
+      dropped = true;
+      continue;
+    }
+    file_header.hash = *hashes[i];
+    stale_entries[i].hash = *hashes[i];
+    entries_[file_header.name] = stale_entries[i];
+    dirty_ = true;
+  }
+  if (dropped) {
+    std::erase_if(out, [](const protocol::FileHeader& file_header) { return file_header.name.empty(); });
+  }
+
+  // Forget files that no longer exist
+  for (auto it = entries_.begin(); it != entries_.end();) {
+    if (seen.count(it->first) == 0) {
+      it = entries_.erase(it);
+      dirty_ = true;
+    } else {
+      ++it;
+    }
+  }
+
+  return out;
+}
+
+std::optional<protocol::Digest> HashIndex::Lookup(const std::filesystem::path& file_path) {
+  std::string file_name = file_path.filename().string();
+  std::optional<Entry> current = Stat(file_path);
+
+  if (!current) {
+    return std::nullopt;
+  } else if (FindCached(file_name, *current)) {
+    return current->hash;
+  }
+
+  // Hash outside the lock so other threads keep using the index meanwhile
+  std::optional<protocol::Digest> hash = HashFile(file_path);
+  if (!hash) {
+    Forget(file_name);
+    return std::nullopt;
+  }
+  current->hash = *hash;
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  entries_[file_name] = *current;
+  dirty_ = true;
+  return current->hash;
+}
+
+// Metadata of a file with no hash yet, or nothing if it no longer exists
+std::optional<HashIndex::Entry> HashIndex::Stat(const std::filesystem::path& file_path) {
+  struct stat st;
+
+  if (stat(file_path.c_str(), &st) < 0) {
+    return std::nullopt;
+  }
+
+  return Entry {
+    .size = static_cast<uint64_t>(st.st_size),
+    .mtime_ns = ModificationTimeNs(st),
+    .inode = static_cast<uint64_t>(st.st_ino),
+    .hash = {}
+  };
+}
+
+// Fills in the recorded hash if the file's metadata still matches the entry
+bool HashIndex::FindCached(const std::string& file_name, Entry& current) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = entries_.find(file_name);
+  if (it == entries_.end() || it->second.size != current.size ||
+      it->second.mtime_ns != current.mtime_ns || it->second.inode != current.inode) {
+    return false;
+  }
+
+  current.hash = it->second.hash;
+  return true;
+}
+
+void HashIndex::Forget(const std::string& file_name) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (entries_.erase(file_name) > 0) {
+    dirty_ = true;
+  }
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "protocol/protocol.h"
+
+// Persistent cache of file hashes. An entry is trusted as long as the file's
+// size, modification time and inode still match what was recorded when it was
+// hashed, so listing an unchanged directory only costs a stat() per file.
+class HashIndex {
+ public:
+  explicit HashIndex(std::filesystem::path index_path);
+
+  // Loads the on-disk index; a missing or unreadable index starts out empty
+  void Load();
+  // Writes the index atomically (temporary file + rename) if anything changed
+  void Save();
+
+  // Same result as ::ListFilesWithHashes(), rehashing only files whose metadata
+  // changed. Those are hashed in parallel with ::HashFiles()
+  std::vector<protocol::FileHeader> ListFilesWithHashes(const std::filesystem::path& dir);
+
+  // Hash of a single file, rehashed only if its metadata changed. Returns
+  // nothing if the file no longer exists or cannot be read.
+  std::optional<protocol::Digest> Lookup(const std::filesystem::path& file_path);
+
+  // Drops the entry for a deleted file
+  void Forget(const std::string& file_name);
+
+ private:
+  struct Entry {
+    uint64_t size;
+    int64_t mtime_ns;
+    uint64_t inode;
+    protocol::Digest hash;
+  };
+
+  static std::optional<Entry> Stat(const std::filesystem::path& file_path);
+  bool FindCached(const std::string& file_name, Entry& current);
+
+  std::filesystem::path index_path_;
+  std::mutex mutex_;
+  std::unordered_map<std::string, Entry> entries_;
+  bool dirty_ = false;
+};
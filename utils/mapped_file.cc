@@ -0,0 +1,133 @@
+#include "mapped_file.h"
+
+#include <algorithm>
+#include <csetjmp>
+#include <csignal>
+#include <mutex>
+#include <tuple>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "utils.h"
+
+namespace {
+  // Where a SIGBUS on this thread jumps back to, null outside GuardMappedReads()
+  thread_local sigjmp_buf* guard_jump = nullptr;
+
+  void HandleSigbus(int, siginfo_t*, void*) {
+    if (guard_jump) {
+      siglongjmp(*guard_jump, 1);
+    }
+    // Any other bus error is a real crash: returning retries the access without a handler
+    signal(SIGBUS, SIG_DFL);
+  }
+}
+
+bool GuardMappedReads(void (*read)(void*), void* context) {
+  static std::once_flag installed;
+  std::call_once(installed, [] {
+    // SA_NODEFER leaves SIGBUS unblocked after a jump, so sigsetjmp() need not save the signal mask
+    struct sigaction action {};
+    action.sa_sigaction = HandleSigbus;
+    action.sa_flags = SA_SIGINFO | SA_NODEFER;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGBUS, &action, nullptr);
+  });
+
+  sigjmp_buf jump;
+  sigjmp_buf* outer = guard_jump;
+  if (sigsetjmp(jump, 0) != 0) {
+    guard_jump = outer;
+    return false;
+  }
+
+  guard_jump = &jump;
+  read(context);
+  guard_jump = outer;
+  return true;
+}
+
+std::shared_ptr<const MappedFile> MappedFile::Map(int fd, uint64_t size, int advice) {
+  if (size == 0) {
+    return nullptr;
+  }
+
+  void* data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED) {
+    return nullptr;
+  }
+
+  if (advice != MADV_NORMAL) {
+    madvise(data, size, advice);
+  }
+  return std::shared_ptr<const MappedFile>(new MappedFile(static_cast<const uint8_t*>(data), size));
+}
+
+MappedFile::~MappedFile() {
+  munmap(const_cast<uint8_t*>(data_), size_);
+}
+
+void MappedFile::WillNeed(uint64_t offset, uint64_t length) const {
+  if (offset >= size_) {
+    return;
+  }
+
+  // madvise() wants a page-aligned start
+  uint64_t page_size = static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+  uint64_t start = offset - offset % page_size;
+  uint64_t end = std::min(size_, offset + length);
+  madvise(const_cast<uint8_t*>(data_) + start, end - start, MADV_WILLNEED);
+}
+
+MappingCache::MappingCache(uint64_t max_bytes, size_t max_files) : max_bytes_(max_bytes), max_files_(max_files) {}
+
+std::shared_ptr<const MappedFile> MappingCache::Get(int fd) {
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    return nullptr;
+  }
+
+  Key key { .device = static_cast<uint64_t>(st.st_dev), .inode = static_cast<uint64_t>(st.st_ino) };
+  uint64_t size = static_cast<uint64_t>(st.st_size);
+  int64_t mtime_ns = ModificationTimeNs(st);
+
+  auto it = entries_.find(key);
+  if (it != entries_.end() && it->second.size == size && it->second.mtime_ns == mtime_ns) {
+    recency_.splice(recency_.begin(), recency_, it->second.recency);
+    return it->second.mapping;
+  }
+
+  std::shared_ptr<const MappedFile> mapping = MappedFile::Map(fd, size);
+  if (!mapping || size > max_bytes_ / 4) {
+    // A file too large to keep is still mapped for this one use
+    return mapping;
+  }
+
+  bool inserted;
+  std::tie(it, inserted) = entries_.try_emplace(key);
+  if (inserted) {
+    recency_.push_front(key);
+    it->second.recency = recency_.begin();
+  } else {
+    bytes_ -= it->second.size;
+    recency_.splice(recency_.begin(), recency_, it->second.recency);
+  }
+
+  it->second.size = size;
+  it->second.mtime_ns = mtime_ns;
+  it->second.mapping = mapping;
+  bytes_ += size;
+
+  Evict();
+  return mapping;
+}
+
+// Unmaps the least recently used files until the cache is within bounds. A
+// mapping still being sent from stays valid until its last user drops it
+void MappingCache::Evict() {
+  while (!recency_.empty() && (bytes_ > max_bytes_ || entries_.size() > max_files_)) {
+    auto it = entries_.find(recency_.back());
+    bytes_ -= it->second.size;
+    entries_.erase(it);
+    recency_.pop_back();
+  }
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <type_traits>
+#include <unordered_map>
+#include <sys/mman.h>
+
+// Read-only mapping of a whole file. Nothing stops another process from
+// rewriting or truncating the file while it is mapped: the contents may change
+// under a reader, and touching a page past a new, shorter end raises SIGBUS.
+// Code reading the pages itself therefore does so inside GuardMappedReads().
+class MappedFile {
+ public:
+  // Maps the first `size` bytes of fd with the given madvise() hint. Null for
+  // an empty file or if mmap() fails; fd may be closed right after
+  static std::shared_ptr<const MappedFile> Map(int fd, uint64_t size, int advice = MADV_NORMAL);
+
+  ~MappedFile();
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  const uint8_t* data() const { return data_; }
+  uint64_t size() const { return size_; }
+
+  // Asks the kernel to start reading [offset, offset + length) in the background
+  void WillNeed(uint64_t offset, uint64_t length) const;
+
+ private:
+  MappedFile(const uint8_t* data, uint64_t size) : data_(data), size_(size) {}
+
+  const uint8_t* data_;
+  uint64_t size_;
+};
+
+// Runs read(context), which reads from mappings, and returns false instead of
+// crashing if one of their files was truncated meanwhile and a page past its
+// new end was touched. A fault abandons `read` without unwinding its stack, so
+// it must not hold locks or own anything whose destructor has to run.
+bool GuardMappedReads(void (*read)(void*), void* context);
+
+template <typename Function>
+bool GuardMappedReads(Function&& read) {
+  return GuardMappedReads([](void* context) { (*static_cast<std::remove_reference_t<Function>*>(context))(); }, &read);
+}
+
+// Bounded LRU of mappings of recently sent files, one per worker so lookups
+// never contend, so repeated requests for a popular file read it straight from
+// memory. Entries are keyed by inode and reused only while size and
+// modification time match. Not thread-safe.
+class MappingCache {
+ public:
+  MappingCache(uint64_t max_bytes, size_t max_files);
+
+  // Mapping of the file open as fd. Null if it cannot be mapped
+  std::shared_ptr<const MappedFile> Get(int fd);
+
+ private:
+  struct Key {
+    uint64_t device;
+    uint64_t inode;
+    bool operator==(const Key& other) const = default;
+  };
+
+  struct KeyHash {
+    size_t operator()(const Key& key) const { return key.inode * 31 + key.device; }
+  };
+
+  struct Entry {
+    uint64_t size;
+    int64_t mtime_ns;
+    std::shared_ptr<const MappedFile> mapping;
+    std::list<Key>::iterator recency;
+  };
+
+  void Evict();
+
+  const uint64_t max_bytes_;
+  const size_t max_files_;
+  // Most recently used first
+  std::list<Key> recency_;
+  std::unordered_map<Key, Entry, KeyHash> entries_;
+  uint64_t bytes_ = 0;
+};
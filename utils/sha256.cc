@@ -6,6 +6,13 @@
 
 #include "sha256.h"
 
+#include <cstring>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#  include <cpuid.h>
+#  include <immintrin.h>
+#endif
+
 // big endian architectures need #define __BYTE_ORDER __BIG_ENDIAN
 #ifndef _MSC_VER
 #  if defined(__APPLE__)
@@ -94,167 +101,536 @@ namespace
     uint32_t term2 = ((a | b) & c) | (a & b); //(a & (b ^ c)) ^ (b & c);
     return term1 + term2;
   }
+
+
+  /// process 64 bytes, portable version
+  void processBlockScalar(uint32_t* hash, const void* data)
+  {
+    // get last hash
+    uint32_t a = hash[0];
+    uint32_t b = hash[1];
+    uint32_t c = hash[2];
+    uint32_t d = hash[3];
+    uint32_t e = hash[4];
+    uint32_t f = hash[5];
+    uint32_t g = hash[6];
+    uint32_t h = hash[7];
+
+    // data represented as 16x 32-bit words
+    const uint32_t* input = (uint32_t*) data;
+    // convert to big endian
+    uint32_t words[64];
+    int i;
+    for (i = 0; i < 16; i++)
+#if defined(__BYTE_ORDER) && (__BYTE_ORDER != 0) && (__BYTE_ORDER == __BIG_ENDIAN)
+      words[i] =      input[i];
+#else
+      words[i] = swap(input[i]);
+#endif
+
+    uint32_t x,y; // temporaries
+
+    // first round
+    x = h + f1(e,f,g) + 0x428a2f98 + words[ 0]; y = f2(a,b,c); d += x; h = x + y;
+    x = g + f1(d,e,f) + 0x71374491 + words[ 1]; y = f2(h,a,b); c += x; g = x + y;
+    x = f + f1(c,d,e) + 0xb5c0fbcf + words[ 2]; y = f2(g,h,a); b += x; f = x + y;
+    x = e + f1(b,c,d) + 0xe9b5dba5 + words[ 3]; y = f2(f,g,h); a += x; e = x + y;
+    x = d + f1(a,b,c) + 0x3956c25b + words[ 4]; y = f2(e,f,g); h += x; d = x + y;
+    x = c + f1(h,a,b) + 0x59f111f1 + words[ 5]; y = f2(d,e,f); g += x; c = x + y;
+    x = b + f1(g,h,a) + 0x923f82a4 + words[ 6]; y = f2(c,d,e); f += x; b = x + y;
+    x = a + f1(f,g,h) + 0xab1c5ed5 + words[ 7]; y = f2(b,c,d); e += x; a = x + y;
+
+    // secound round
+    x = h + f1(e,f,g) + 0xd807aa98 + words[ 8]; y = f2(a,b,c); d += x; h = x + y;
+    x = g + f1(d,e,f) + 0x12835b01 + words[ 9]; y = f2(h,a,b); c += x; g = x + y;
+    x = f + f1(c,d,e) + 0x243185be + words[10]; y = f2(g,h,a); b += x; f = x + y;
+    x = e + f1(b,c,d) + 0x550c7dc3 + words[11]; y = f2(f,g,h); a += x; e = x + y;
+    x = d + f1(a,b,c) + 0x72be5d74 + words[12]; y = f2(e,f,g); h += x; d = x + y;
+    x = c + f1(h,a,b) + 0x80deb1fe + words[13]; y = f2(d,e,f); g += x; c = x + y;
+    x = b + f1(g,h,a) + 0x9bdc06a7 + words[14]; y = f2(c,d,e); f += x; b = x + y;
+    x = a + f1(f,g,h) + 0xc19bf174 + words[15]; y = f2(b,c,d); e += x; a = x + y;
+
+    // extend to 24 words
+    for (; i < 24; i++)
+      words[i] = words[i-16] +
+                 (rotate(words[i-15],  7) ^ rotate(words[i-15], 18) ^ (words[i-15] >>  3)) +
+                 words[i-7] +
+                 (rotate(words[i- 2], 17) ^ rotate(words[i- 2], 19) ^ (words[i- 2] >> 10));
+
+    // third round
+    x = h + f1(e,f,g) + 0xe49b69c1 + words[16]; y = f2(a,b,c); d += x; h = x + y;
+    x = g + f1(d,e,f) + 0xefbe4786 + words[17]; y = f2(h,a,b); c += x; g = x + y;
+    x = f + f1(c,d,e) + 0x0fc19dc6 + words[18]; y = f2(g,h,a); b += x; f = x + y;
+    x = e + f1(b,c,d) + 0x240ca1cc + words[19]; y = f2(f,g,h); a += x; e = x + y;
+    x = d + f1(a,b,c) + 0x2de92c6f + words[20]; y = f2(e,f,g); h += x; d = x + y;
+    x = c + f1(h,a,b) + 0x4a7484aa + words[21]; y = f2(d,e,f); g += x; c = x + y;
+    x = b + f1(g,h,a) + 0x5cb0a9dc + words[22]; y = f2(c,d,e); f += x; b = x + y;
+    x = a + f1(f,g,h) + 0x76f988da + words[23]; y = f2(b,c,d); e += x; a = x + y;
+
+    // extend to 32 words
+    for (; i < 32; i++)
+      words[i] = words[i-16] +
+                 (rotate(words[i-15],  7) ^ rotate(words[i-15], 18) ^ (words[i-15] >>  3)) +
+                 words[i-7] +
+                 (rotate(words[i- 2], 17) ^ rotate(words[i- 2], 19) ^ (words[i- 2] >> 10));
+
+    // fourth round
+    x = h + f1(e,f,g) + 0x983e5152 + words[24]; y = f2(a,b,c); d += x; h = x + y;
+    x = g + f1(d,e,f) + 0xa831c66d + words[25]; y = f2(h,a,b); c += x; g = x + y;
+    x = f + f1(c,d,e) + 0xb00327c8 + words[26]; y = f2(g,h,a); b += x; f = x + y;
+    x = e + f1(b,c,d) + 0xbf597fc7 + words[27]; y = f2(f,g,h); a += x; e = x + y;
+    x = d + f1(a,b,c) + 0xc6e00bf3 + words[28]; y = f2(e,f,g); h += x; d = x + y;
+    x = c + f1(h,a,b) + 0xd5a79147 + words[29]; y = f2(d,e,f); g += x; c = x + y;
+    x = b + f1(g,h,a) + 0x06ca6351 + words[30]; y = f2(c,d,e); f += x; b = x + y;
+    x = a + f1(f,g,h) + 0x14292967 + words[31]; y = f2(b,c,d); e += x; a = x + y;
+
+    // extend to 40 words
+    for (; i < 40; i++)
+      words[i] = words[i-16] +
+                 (rotate(words[i-15],  7) ^ rotate(words[i-15], 18) ^ (words[i-15] >>  3)) +
+                 words[i-7] +
+                 (rotate(words[i- 2], 17) ^ rotate(words[i- 2], 19) ^ (words[i- 2] >> 10));
+
+    // fifth round
+    x = h + f1(e,f,g) + 0x27b70a85 + words[32]; y = f2(a,b,c); d += x; h = x + y;
+    x = g + f1(d,e,f) + 0x2e1b2138 + words[33]; y = f2(h,a,b); c += x; g = x + y;
+    x = f + f1(c,d,e) + 0x4d2c6dfc + words[34]; y = f2(g,h,a); b += x; f = x + y;
+    x = e + f1(b,c,d) + 0x53380d13 + words[35]; y = f2(f,g,h); a += x; e = x + y;
+    x = d + f1(a,b,c) + 0x650a7354 + words[36]; y = f2(e,f,g); h += x; d = x + y;
+    x = c + f1(h,a,b) + 0x766a0abb + words[37]; y = f2(d,e,f); g += x; c = x + y;
+    x = b + f1(g,h,a) + 0x81c2c92e + words[38]; y = f2(c,d,e); f += x; b = x + y;
+    x = a + f1(f,g,h) + 0x92722c85 + words[39]; y = f2(b,c,d); e += x; a = x + y;
+
+    // extend to 48 words
+    for (; i < 48; i++)
+      words[i] = words[i-16] +
+                 (rotate(words[i-15],  7) ^ rotate(words[i-15], 18) ^ (words[i-15] >>  3)) +
+                 words[i-7] +
+                 (rotate(words[i- 2], 17) ^ rotate(words[i- 2], 19) ^ (words[i- 2] >> 10));
+
+    // sixth round
+    x = h + f1(e,f,g) + 0xa2bfe8a1 + words[40]; y = f2(a,b,c); d += x; h = x + y;
+    x = g + f1(d,e,f) + 0xa81a664b + words[41]; y = f2(h,a,b); c += x; g = x + y;
+    x = f + f1(c,d,e) + 0xc24b8b70 + words[42]; y = f2(g,h,a); b += x; f = x + y;
+    x = e + f1(b,c,d) + 0xc76c51a3 + words[43]; y = f2(f,g,h); a += x; e = x + y;
+    x = d + f1(a,b,c) + 0xd192e819 + words[44]; y = f2(e,f,g); h += x; d = x + y;
+    x = c + f1(h,a,b) + 0xd6990624 + words[45]; y = f2(d,e,f); g += x; c = x + y;
+    x = b + f1(g,h,a) + 0xf40e3585 + words[46]; y = f2(c,d,e); f += x; b = x + y;
+    x = a + f1(f,g,h) + 0x106aa070 + words[47]; y = f2(b,c,d); e += x; a = x + y;
+
+    // extend to 56 words
+    for (; i < 56; i++)
+      words[i] = words[i-16] +
+                 (rotate(words[i-15],  7) ^ rotate(words[i-15], 18) ^ (words[i-15] >>  3)) +
+                 words[i-7] +
+                 (rotate(words[i- 2], 17) ^ rotate(words[i- 2], 19) ^ (words[i- 2] >> 10));
+
+    // seventh round
+    x = h + f1(e,f,g) + 0x19a4c116 + words[48]; y = f2(a,b,c); d += x; h = x + y;
+    x = g + f1(d,e,f) + 0x1e376c08 + words[49]; y = f2(h,a,b); c += x; g = x + y;
+    x = f + f1(c,d,e) + 0x2748774c + words[50]; y = f2(g,h,a); b += x; f = x + y;
+    x = e + f1(b,c,d) + 0x34b0bcb5 + words[51]; y = f2(f,g,h); a += x; e = x + y;
+    x = d + f1(a,b,c) + 0x391c0cb3 + words[52]; y = f2(e,f,g); h += x; d = x + y;
+    x = c + f1(h,a,b) + 0x4ed8aa4a + words[53]; y = f2(d,e,f); g += x; c = x + y;
+    x = b + f1(g,h,a) + 0x5b9cca4f + words[54]; y = f2(c,d,e); f += x; b = x + y;
+    x = a + f1(f,g,h) + 0x682e6ff3 + words[55]; y = f2(b,c,d); e += x; a = x + y;
+
+    // extend to 64 words
+    for (; i < 64; i++)
+      words[i] = words[i-16] +
+                 (rotate(words[i-15],  7) ^ rotate(words[i-15], 18) ^ (words[i-15] >>  3)) +
+                 words[i-7] +
+                 (rotate(words[i- 2], 17) ^ rotate(words[i- 2], 19) ^ (words[i- 2] >> 10));
+
+    // eigth round
+    x = h + f1(e,f,g) + 0x748f82ee + words[56]; y = f2(a,b,c); d += x; h = x + y;
+    x = g + f1(d,e,f) + 0x78a5636f + words[57]; y = f2(h,a,b); c += x; g = x + y;
+    x = f + f1(c,d,e) + 0x84c87814 + words[58]; y = f2(g,h,a); b += x; f = x + y;
+    x = e + f1(b,c,d) + 0x8cc70208 + words[59]; y = f2(f,g,h); a += x; e = x + y;
+    x = d + f1(a,b,c) + 0x90befffa + words[60]; y = f2(e,f,g); h += x; d = x + y;
+    x = c + f1(h,a,b) + 0xa4506ceb + words[61]; y = f2(d,e,f); g += x; c = x + y;
+    x = b + f1(g,h,a) + 0xbef9a3f7 + words[62]; y = f2(c,d,e); f += x; b = x + y;
+    x = a + f1(f,g,h) + 0xc67178f2 + words[63]; y = f2(b,c,d); e += x; a = x + y;
+
+    // update hash
+    hash[0] += a;
+    hash[1] += b;
+    hash[2] += c;
+    hash[3] += d;
+    hash[4] += e;
+    hash[5] += f;
+    hash[6] += g;
+    hash[7] += h;
+  }
+
+
+  /// process consecutive 64 byte blocks, portable version
+  void processBlocksScalar(uint32_t* hash, const uint8_t* data, size_t numBlocks)
+  {
+    for (; numBlocks > 0; numBlocks--, data += SHA256::BlockSize)
+      processBlockScalar(hash, data);
+  }
+
+
+  typedef void (*BlocksFunction)(uint32_t* hash, const uint8_t* data, size_t numBlocks);
+  typedef void (*ManyFunction)(const void* const* data, const size_t* numBytes, size_t count, unsigned char* digests);
+
+
+  /// hash each message on its own, for CPUs without a multi-buffer implementation
+  void hashManySequential(const void* const* data, const size_t* numBytes, size_t count, unsigned char* digests)
+  {
+    SHA256 sha256;
+    for (size_t i = 0; i < count; i++)
+    {
+      sha256.reset();
+      sha256.add(data[i], numBytes[i]);
+      sha256.getHash(digests + i * SHA256::HashBytes);
+    }
+  }
+
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define SHA256_X86
+
+  const uint32_t roundConstants[64] =
+  {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+  };
+
+  const uint32_t initialHash[8] =
+  {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+  };
+
+
+  /// process consecutive 64 byte blocks with the SHA extensions (SHA-NI),
+  /// two rounds per sha256rnds2 instruction
+  __attribute__((target("sha,sse4.1")))
+  void processBlocksShaNi(uint32_t* hash, const uint8_t* data, size_t numBlocks)
+  {
+    const __m128i byteSwap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+    // the instructions want the state as ABEF and CDGH
+    __m128i abcd  = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*) &hash[0]), 0xB1);
+    __m128i cdgh  = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*) &hash[4]), 0x1B);
+    __m128i abef  = _mm_alignr_epi8(abcd, cdgh, 8);
+    cdgh = _mm_blend_epi16(cdgh, abcd, 0xF0);
+
+    for (; numBlocks > 0; numBlocks--, data += SHA256::BlockSize)
+    {
+      __m128i abefSaved = abef;
+      __m128i cdghSaved = cdgh;
+      // message schedule, four words per register, the last four groups
+      __m128i message[4];
+
+#pragma GCC unroll 16
+      for (int group = 0; group < 16; group++)
+      {
+        __m128i& current = message[group & 3];
+        if (group < 4)
+          current = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (data + 16 * group)), byteSwap);
+        else
+        {
+          // W[t] = s1(W[t-2]) + W[t-7] + s0(W[t-15]) + W[t-16]
+          __m128i sum = _mm_sha256msg1_epu32(current, message[(group + 1) & 3]);
+          sum = _mm_add_epi32(sum, _mm_alignr_epi8(message[(group + 3) & 3], message[(group + 2) & 3], 4));
+          current = _mm_sha256msg2_epu32(sum, message[(group + 3) & 3]);
+        }
+
+        __m128i words = _mm_add_epi32(current, _mm_loadu_si128((const __m128i*) &roundConstants[4 * group]));
+        cdgh  = _mm_sha256rnds2_epu32(cdgh, abef, words);
+        abef  = _mm_sha256rnds2_epu32(abef, cdgh, _mm_shuffle_epi32(words, 0x0E));
+      }
+
+      abef = _mm_add_epi32(abef, abefSaved);
+      cdgh = _mm_add_epi32(cdgh, cdghSaved);
+    }
+
+    // back to ABCD and EFGH
+    __m128i feba = _mm_shuffle_epi32(abef, 0x1B);
+    __m128i dchg = _mm_shuffle_epi32(cdgh, 0xB1);
+    _mm_storeu_si128((__m128i*) &hash[0], _mm_blend_epi16(feba, dchg, 0xF0));
+    _mm_storeu_si128((__m128i*) &hash[4], _mm_alignr_epi8(dchg, feba, 8));
+  }
+
+
+  // 8-lane helpers for the AVX2 multi-buffer version
+  __attribute__((target("avx2"))) inline __m256i rotate8(__m256i x, int c)
+  {
+    return _mm256_or_si256(_mm256_srli_epi32(x, c), _mm256_slli_epi32(x, 32 - c));
+  }
+
+  __attribute__((target("avx2"))) inline __m256i add8(__m256i a, __m256i b)
+  {
+    return _mm256_add_epi32(a, b);
+  }
+
+
+  /// one message per 32-bit lane: its hash state and where its next block comes from
+  struct Lane
+  {
+    size_t   message;
+    const uint8_t* data;
+    size_t   fullBlocks;
+    size_t   totalBlocks;
+    size_t   block;
+    /// last one or two blocks, padded
+    uint8_t  tail[2 * SHA256::BlockSize];
+  };
+
+
+  /// hash up to eight messages at a time, one per AVX2 lane; a lane that
+  /// finishes picks up the next message, so lengths need not match
+  __attribute__((target("avx2")))
+  void hashManyAvx2(const void* const* data, const size_t* numBytes, size_t count, unsigned char* digests)
+  {
+    enum { Lanes = 8 };
+    Lane lanes[Lanes];
+    // state[word][lane]
+    alignas(32) uint32_t state[8][Lanes];
+    alignas(32) uint32_t words[16][Lanes];
+    static const uint8_t idleBlock[SHA256::BlockSize] = {};
+
+    size_t next = 0;
+    int active = 0;
+
+    auto start = [&](int lane) -> bool
+    {
+      Lane& l = lanes[lane];
+      if (next == count)
+      {
+        l.data = NULL;
+        return false;
+      }
+
+      l.message     = next;
+      l.data        = (const uint8_t*) data[next];
+      l.fullBlocks  = numBytes[next] / SHA256::BlockSize;
+      l.block       = 0;
+
+      // same padding as processBuffer(): 0x80, zeros, length in bits
+      size_t rest = numBytes[next] % SHA256::BlockSize;
+      size_t tailBlocks = rest + 9 <= SHA256::BlockSize ? 1 : 2;
+      std::memset(l.tail, 0, sizeof(l.tail));
+      std::memcpy(l.tail, l.data + l.fullBlocks * SHA256::BlockSize, rest);
+      l.tail[rest] = 0x80;
+      uint64_t numBits = 8 * (uint64_t) numBytes[next];
+      for (int i = 0; i < 8; i++)
+        l.tail[tailBlocks * SHA256::BlockSize - 1 - i] = (uint8_t) (numBits >> (8 * i));
+      l.totalBlocks = l.fullBlocks + tailBlocks;
+
+      for (int i = 0; i < 8; i++)
+        state[i][lane] = initialHash[i];
+      next++;
+      return true;
+    };
+
+    for (int lane = 0; lane < Lanes; lane++)
+      active += start(lane);
+
+    while (active > 0)
+    {
+      // transpose the next block of every lane into words[i][lane]
+      for (int lane = 0; lane < Lanes; lane++)
+      {
+        const Lane& l = lanes[lane];
+        const uint8_t* block = idleBlock;
+        if (l.data)
+          block = l.block < l.fullBlocks ? l.data + l.block * SHA256::BlockSize
+                                         : l.tail + (l.block - l.fullBlocks) * SHA256::BlockSize;
+
+        for (int i = 0; i < 16; i++)
+        {
+          uint32_t word;
+          std::memcpy(&word, block + 4 * i, 4);
+          words[i][lane] = swap(word);
+        }
+      }
+
+      __m256i w[16];
+      for (int i = 0; i < 16; i++)
+        w[i] = _mm256_load_si256((const __m256i*) words[i]);
+
+      __m256i a = _mm256_load_si256((const __m256i*) state[0]);
+      __m256i b = _mm256_load_si256((const __m256i*) state[1]);
+      __m256i c = _mm256_load_si256((const __m256i*) state[2]);
+      __m256i d = _mm256_load_si256((const __m256i*) state[3]);
+      __m256i e = _mm256_load_si256((const __m256i*) state[4]);
+      __m256i f = _mm256_load_si256((const __m256i*) state[5]);
+      __m256i g = _mm256_load_si256((const __m256i*) state[6]);
+      __m256i h = _mm256_load_si256((const __m256i*) state[7]);
+
+      for (int t = 0; t < 64; t++)
+      {
+        if (t >= 16)
+        {
+          __m256i w15 = w[(t - 15) & 15];
+          __m256i w2  = w[(t -  2) & 15];
+          __m256i s0  = _mm256_xor_si256(_mm256_xor_si256(rotate8(w15,  7), rotate8(w15, 18)), _mm256_srli_epi32(w15,  3));
+          __m256i s1  = _mm256_xor_si256(_mm256_xor_si256(rotate8(w2,  17), rotate8(w2,  19)), _mm256_srli_epi32(w2,  10));
+          w[t & 15] = add8(add8(w[t & 15], s0), add8(w[(t - 7) & 15], s1));
+        }
+
+        __m256i sum1   = _mm256_xor_si256(_mm256_xor_si256(rotate8(e, 6), rotate8(e, 11)), rotate8(e, 25));
+        __m256i choose = _mm256_xor_si256(_mm256_and_si256(e, f), _mm256_andnot_si256(e, g));
+        __m256i x      = add8(add8(add8(h, sum1), add8(choose, _mm256_set1_epi32(roundConstants[t]))), w[t & 15]);
+        __m256i sum0   = _mm256_xor_si256(_mm256_xor_si256(rotate8(a, 2), rotate8(a, 13)), rotate8(a, 22));
+        __m256i major  = _mm256_or_si256(_mm256_and_si256(_mm256_or_si256(a, b), c), _mm256_and_si256(a, b));
+
+        h = g; g = f; f = e; e = add8(d, x);
+        d = c; c = b; b = a; a = add8(x, add8(sum0, major));
+      }
+
+      __m256i* s = (__m256i*) state;
+      _mm256_store_si256(s + 0, add8(_mm256_load_si256(s + 0), a));
+      _mm256_store_si256(s + 1, add8(_mm256_load_si256(s + 1), b));
+      _mm256_store_si256(s + 2, add8(_mm256_load_si256(s + 2), c));
+      _mm256_store_si256(s + 3, add8(_mm256_load_si256(s + 3), d));
+      _mm256_store_si256(s + 4, add8(_mm256_load_si256(s + 4), e));
+      _mm256_store_si256(s + 5, add8(_mm256_load_si256(s + 5), f));
+      _mm256_store_si256(s + 6, add8(_mm256_load_si256(s + 6), g));
+      _mm256_store_si256(s + 7, add8(_mm256_load_si256(s + 7), h));
+
+      for (int lane = 0; lane < Lanes; lane++)
+      {
+        Lane& l = lanes[lane];
+        if (!l.data || ++l.block < l.totalBlocks)
+          continue;
+
+        unsigned char* digest = digests + l.message * SHA256::HashBytes;
+        for (int i = 0; i < 8; i++)
+        {
+          uint32_t word = swap(state[i][lane]);
+          std::memcpy(digest + 4 * i, &word, 4);
+        }
+
+        if (!start(lane))
+          active--;
+      }
+    }
+  }
+
+
+  /// CPUID leaf 7: SHA extensions are EBX bit 29
+  bool hasShaNi()
+  {
+    unsigned int eax, ebx, ecx, edx;
+    return __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & (1u << 29)) &&
+           __builtin_cpu_supports("sse4.1");
+  }
+#endif
+
+
+  /// set by SHA256::useImplementation(), null means the fastest one
+  BlocksFunction forcedBlocks = nullptr;
+  ManyFunction   forcedMany   = nullptr;
+
+
+  /// fastest block function this CPU supports, chosen on first use
+  BlocksFunction selectedBlocks()
+  {
+    if (forcedBlocks)
+      return forcedBlocks;
+#ifdef SHA256_X86
+    static const BlocksFunction selected = hasShaNi() ? processBlocksShaNi : processBlocksScalar;
+    return selected;
+#else
+    return processBlocksScalar;
+#endif
+  }
+
+
+  /// with SHA-NI one message at a time is faster than eight AVX2 lanes
+  ManyFunction selectedMany()
+  {
+    if (forcedMany)
+      return forcedMany;
+#ifdef SHA256_X86
+    static const ManyFunction selected = !hasShaNi() && __builtin_cpu_supports("avx2") ? hashManyAvx2 : hashManySequential;
+    return selected;
+#else
+    return hashManySequential;
+#endif
+  }
+}
+
+
+/// false if this CPU (or this build) cannot run an implementation
+bool SHA256::isSupported(Implementation implementation)
+{
+  switch (implementation)
+  {
+    case Fastest:
+    case Scalar:
+      return true;
+#ifdef SHA256_X86
+    case ShaNi:
+      return hasShaNi();
+    case Avx2:
+      return __builtin_cpu_supports("avx2");
+#endif
+    default:
+      return false;
+  }
+}
+
+
+/// hash with one implementation only, returns false if it is not supported
+bool SHA256::useImplementation(Implementation implementation)
+{
+  if (!isSupported(implementation))
+    return false;
+
+  forcedBlocks = nullptr;
+  forcedMany   = nullptr;
+  switch (implementation)
+  {
+    case Scalar:
+      forcedBlocks = processBlocksScalar;
+      forcedMany   = hashManySequential;
+      break;
+#ifdef SHA256_X86
+    case ShaNi:
+      forcedBlocks = processBlocksShaNi;
+      forcedMany   = hashManySequential;
+      break;
+    case Avx2:
+      forcedBlocks = processBlocksScalar;
+      forcedMany   = hashManyAvx2;
+      break;
+#endif
+    default:
+      break;
+  }
+  return true;
 }
 
 
 /// process 64 bytes
 void SHA256::processBlock(const void* data)
 {
-  // get last hash
-  uint32_t a = m_hash[0];
-  uint32_t b = m_hash[1];
-  uint32_t c = m_hash[2];
-  uint32_t d = m_hash[3];
-  uint32_t e = m_hash[4];
-  uint32_t f = m_hash[5];
-  uint32_t g = m_hash[6];
-  uint32_t h = m_hash[7];
-
-  // data represented as 16x 32-bit words
-  const uint32_t* input = (uint32_t*) data;
-  // convert to big endian
-  uint32_t words[64];
-  int i;
-  for (i = 0; i < 16; i++)
-#if defined(__BYTE_ORDER) && (__BYTE_ORDER != 0) && (__BYTE_ORDER == __BIG_ENDIAN)
-    words[i] =      input[i];
-#else
-    words[i] = swap(input[i]);
-#endif
+  processBlocks(data, 1);
+}
 
-  uint32_t x,y; // temporaries
-
-  // first round
-  x = h + f1(e,f,g) + 0x428a2f98 + words[ 0]; y = f2(a,b,c); d += x; h = x + y;
-  x = g + f1(d,e,f) + 0x71374491 + words[ 1]; y = f2(h,a,b); c += x; g = x + y;
-  x = f + f1(c,d,e) + 0xb5c0fbcf + words[ 2]; y = f2(g,h,a); b += x; f = x + y;
-  x = e + f1(b,c,d) + 0xe9b5dba5 + words[ 3]; y = f2(f,g,h); a += x; e = x + y;
-  x = d + f1(a,b,c) + 0x3956c25b + words[ 4]; y = f2(e,f,g); h += x; d = x + y;
-  x = c + f1(h,a,b) + 0x59f111f1 + words[ 5]; y = f2(d,e,f); g += x; c = x + y;
-  x = b + f1(g,h,a) + 0x923f82a4 + words[ 6]; y = f2(c,d,e); f += x; b = x + y;
-  x = a + f1(f,g,h) + 0xab1c5ed5 + words[ 7]; y = f2(b,c,d); e += x; a = x + y;
-
-  // secound round
-  x = h + f1(e,f,g) + 0xd807aa98 + words[ 8]; y = f2(a,b,c); d += x; h = x + y;
-  x = g + f1(d,e,f) + 0x12835b01 + words[ 9]; y = f2(h,a,b); c += x; g = x + y;
-  x = f + f1(c,d,e) + 0x243185be + words[10]; y = f2(g,h,a); b += x; f = x + y;
-  x = e + f1(b,c,d) + 0x550c7dc3 + words[11]; y = f2(f,g,h); a += x; e = x + y;
-  x = d + f1(a,b,c) + 0x72be5d74 + words[12]; y = f2(e,f,g); h += x; d = x + y;
-  x = c + f1(h,a,b) + 0x80deb1fe + words[13]; y = f2(d,e,f); g += x; c = x + y;
-  x = b + f1(g,h,a) + 0x9bdc06a7 + words[14]; y = f2(c,d,e); f += x; b = x + y;
-  x = a + f1(f,g,h) + 0xc19bf174 + words[15]; y = f2(b,c,d); e += x; a = x + y;
-
-  // extend to 24 words
-  for (; i < 24; i++)
-    words[i] = words[i-16] +
-               (rotate(words[i-15],  7) ^ rotate(words[i-15], 18) ^ (words[i-15] >>  3)) +
-               words[i-7] +
-               (rotate(words[i- 2], 17) ^ rotate(words[i- 2], 19) ^ (words[i- 2] >> 10));
-
-  // third round
-  x = h + f1(e,f,g) + 0xe49b69c1 + words[16]; y = f2(a,b,c); d += x; h = x + y;
-  x = g + f1(d,e,f) + 0xefbe4786 + words[17]; y = f2(h,a,b); c += x; g = x + y;
-  x = f + f1(c,d,e) + 0x0fc19dc6 + words[18]; y = f2(g,h,a); b += x; f = x + y;
-  x = e + f1(b,c,d) + 0x240ca1cc + words[19]; y = f2(f,g,h); a += x; e = x + y;
-  x = d + f1(a,b,c) + 0x2de92c6f + words[20]; y = f2(e,f,g); h += x; d = x + y;
-  x = c + f1(h,a,b) + 0x4a7484aa + words[21]; y = f2(d,e,f); g += x; c = x + y;
-  x = b + f1(g,h,a) + 0x5cb0a9dc + words[22]; y = f2(c,d,e); f += x; b = x + y;
-  x = a + f1(f,g,h) + 0x76f988da + words[23]; y = f2(b,c,d); e += x; a = x + y;
-
-  // extend to 32 words
-  for (; i < 32; i++)
-    words[i] = words[i-16] +
-               (rotate(words[i-15],  7) ^ rotate(words[i-15], 18) ^ (words[i-15] >>  3)) +
-               words[i-7] +
-               (rotate(words[i- 2], 17) ^ rotate(words[i- 2], 19) ^ (words[i- 2] >> 10));
-
-  // fourth round
-  x = h + f1(e,f,g) + 0x983e5152 + words[24]; y = f2(a,b,c); d += x; h = x + y;
-  x = g + f1(d,e,f) + 0xa831c66d + words[25]; y = f2(h,a,b); c += x; g = x + y;
-  x = f + f1(c,d,e) + 0xb00327c8 + words[26]; y = f2(g,h,a); b += x; f = x + y;
-  x = e + f1(b,c,d) + 0xbf597fc7 + words[27]; y = f2(f,g,h); a += x; e = x + y;
-  x = d + f1(a,b,c) + 0xc6e00bf3 + words[28]; y = f2(e,f,g); h += x; d = x + y;
-  x = c + f1(h,a,b) + 0xd5a79147 + words[29]; y = f2(d,e,f); g += x; c = x + y;
-  x = b + f1(g,h,a) + 0x06ca6351 + words[30]; y = f2(c,d,e); f += x; b = x + y;
-  x = a + f1(f,g,h) + 0x14292967 + words[31]; y = f2(b,c,d); e += x; a = x + y;
-
-  // extend to 40 words
-  for (; i < 40; i++)
-    words[i] = words[i-16] +
-               (rotate(words[i-15],  7) ^ rotate(words[i-15], 18) ^ (words[i-15] >>  3)) +
-               words[i-7] +
-               (rotate(words[i- 2], 17) ^ rotate(words[i- 2], 19) ^ (words[i- 2] >> 10));
-
-  // fifth round
-  x = h + f1(e,f,g) + 0x27b70a85 + words[32]; y = f2(a,b,c); d += x; h = x + y;
-  x = g + f1(d,e,f) + 0x2e1b2138 + words[33]; y = f2(h,a,b); c += x; g = x + y;
-  x = f + f1(c,d,e) + 0x4d2c6dfc + words[34]; y = f2(g,h,a); b += x; f = x + y;
-  x = e + f1(b,c,d) + 0x53380d13 + words[35]; y = f2(f,g,h); a += x; e = x + y;
-  x = d + f1(a,b,c) + 0x650a7354 + words[36]; y = f2(e,f,g); h += x; d = x + y;
-  x = c + f1(h,a,b) + 0x766a0abb + words[37]; y = f2(d,e,f); g += x; c = x + y;
-  x = b + f1(g,h,a) + 0x81c2c92e + words[38]; y = f2(c,d,e); f += x; b = x + y;
-  x = a + f1(f,g,h) + 0x92722c85 + words[39]; y = f2(b,c,d); e += x; a = x + y;
-
-  // extend to 48 words
-  for (; i < 48; i++)
-    words[i] = words[i-16] +
-               (rotate(words[i-15],  7) ^ rotate(words[i-15], 18) ^ (words[i-15] >>  3)) +
-               words[i-7] +
-               (rotate(words[i- 2], 17) ^ rotate(words[i- 2], 19) ^ (words[i- 2] >> 10));
-
-  // sixth round
-  x = h + f1(e,f,g) + 0xa2bfe8a1 + words[40]; y = f2(a,b,c); d += x; h = x + y;
-  x = g + f1(d,e,f) + 0xa81a664b + words[41]; y = f2(h,a,b); c += x; g = x + y;
-  x = f + f1(c,d,e) + 0xc24b8b70 + words[42]; y = f2(g,h,a); b += x; f = x + y;
-  x = e + f1(b,c,d) + 0xc76c51a3 + words[43]; y = f2(f,g,h); a += x; e = x + y;
-  x = d + f1(a,b,c) + 0xd192e819 + words[44]; y = f2(e,f,g); h += x; d = x + y;
-  x = c + f1(h,a,b) + 0xd6990624 + words[45]; y = f2(d,e,f); g += x; c = x + y;
-  x = b + f1(g,h,a) + 0xf40e3585 + words[46]; y = f2(c,d,e); f += x; b = x + y;
-  x = a + f1(f,g,h) + 0x106aa070 + words[47]; y = f2(b,c,d); e += x; a = x + y;
-
-  // extend to 56 words
-  for (; i < 56; i++)
-    words[i] = words[i-16] +
-               (rotate(words[i-15],  7) ^ rotate(words[i-15], 18) ^ (words[i-15] >>  3)) +
-               words[i-7] +
-               (rotate(words[i- 2], 17) ^ rotate(words[i- 2], 19) ^ (words[i- 2] >> 10));
-
-  // seventh round
-  x = h + f1(e,f,g) + 0x19a4c116 + words[48]; y = f2(a,b,c); d += x; h = x + y;
-  x = g + f1(d,e,f) + 0x1e376c08 + words[49]; y = f2(h,a,b); c += x; g = x + y;
-  x = f + f1(c,d,e) + 0x2748774c + words[50]; y = f2(g,h,a); b += x; f = x + y;
-  x = e + f1(b,c,d) + 0x34b0bcb5 + words[51]; y = f2(f,g,h); a += x; e = x + y;
-  x = d + f1(a,b,c) + 0x391c0cb3 + words[52]; y = f2(e,f,g); h += x; d = x + y;
-  x = c + f1(h,a,b) + 0x4ed8aa4a + words[53]; y = f2(d,e,f); g += x; c = x + y;
-  x = b + f1(g,h,a) + 0x5b9cca4f + words[54]; y = f2(c,d,e); f += x; b = x + y;
-  x = a + f1(f,g,h) + 0x682e6ff3 + words[55]; y = f2(b,c,d); e += x; a = x + y;
-
-  // extend to 64 words
-  for (; i < 64; i++)
-    words[i] = words[i-16] +
-               (rotate(words[i-15],  7) ^ rotate(words[i-15], 18) ^ (words[i-15] >>  3)) +
-               words[i-7] +
-               (rotate(words[i- 2], 17) ^ rotate(words[i- 2], 19) ^ (words[i- 2] >> 10));
-
-  // eigth round
-  x = h + f1(e,f,g) + 0x748f82ee + words[56]; y = f2(a,b,c); d += x; h = x + y;
-  x = g + f1(d,e,f) + 0x78a5636f + words[57]; y = f2(h,a,b); c += x; g = x + y;
-  x = f + f1(c,d,e) + 0x84c87814 + words[58]; y = f2(g,h,a); b += x; f = x + y;
-  x = e + f1(b,c,d) + 0x8cc70208 + words[59]; y = f2(f,g,h); a += x; e = x + y;
-  x = d + f1(a,b,c) + 0x90befffa + words[60]; y = f2(e,f,g); h += x; d = x + y;
-  x = c + f1(h,a,b) + 0xa4506ceb + words[61]; y = f2(d,e,f); g += x; c = x + y;
-  x = b + f1(g,h,a) + 0xbef9a3f7 + words[62]; y = f2(c,d,e); f += x; b = x + y;
-  x = a + f1(f,g,h) + 0xc67178f2 + words[63]; y = f2(b,c,d); e += x; a = x + y;
-
-  // update hash
-  m_hash[0] += a;
-  m_hash[1] += b;
-  m_hash[2] += c;
-  m_hash[3] += d;
-  m_hash[4] += e;
-  m_hash[5] += f;
-  m_hash[6] += g;
-  m_hash[7] += h;
+
+/// process several consecutive 64 byte blocks
+void SHA256::processBlocks(const void* data, size_t numBlocks)
+{
+  selectedBlocks()(m_hash, (const uint8_t*) data, numBlocks);
+}
+
+
+/// hash several independent messages at once
+void SHA256::hashMany(const void* const* data, const size_t* numBytes, size_t count, unsigned char* digests)
+{
+  selectedMany()(data, numBytes, count, digests);
 }
 
 
@@ -285,12 +661,13 @@ void SHA256::add(const void* data, size_t numBytes)
     return;
 
   // process full blocks
-  while (numBytes >= BlockSize)
+  if (numBytes >= BlockSize)
   {
-    processBlock(current);
-    current    += BlockSize;
-    m_numBytes += BlockSize;
-    numBytes   -= BlockSize;
+    size_t numBlocks = numBytes / BlockSize;
+    processBlocks(current, numBlocks);
+    current    += numBlocks * BlockSize;
+    m_numBytes += numBlocks * BlockSize;
+    numBytes   -= numBlocks * BlockSize;
   }
 
   // keep remaining bytes in buffer
@@ -8,6 +8,7 @@
 
 //#include "hash.h"
 #include <string>
+#include <stddef.h>
 
 // define fixed size integer types
 #ifdef _MSC_VER
@@ -33,6 +34,9 @@ typedef unsigned __int64 uint64_t;
     while (more data available)
       sha256.add(pointer to fresh data, number of new bytes);
     std::string myHash3 = sha256.getHash();
+
+    Blocks are processed with the SHA extensions (SHA-NI) when the CPU has them,
+    and hashMany() spreads independent messages over AVX2 lanes otherwise.
   */
 class SHA256 //: public Hash
 {
@@ -59,9 +63,23 @@ public:
   /// restart
   void reset();
 
+  /// hash count independent messages, digest i is stored at digests + i * HashBytes
+  static void hashMany(const void* const* data, const size_t* numBytes, size_t count, unsigned char* digests);
+
+  /// block and multi-message implementations, Avx2 only affects hashMany()
+  enum Implementation { Fastest, Scalar, ShaNi, Avx2 };
+  /// false if this CPU (or this build) cannot run an implementation
+  static bool isSupported(Implementation implementation);
+  /// hash with one implementation only (Fastest restores the automatic choice),
+  /// returns false if it is not supported; meant for tests and benchmarks,
+  /// not thread-safe while other threads are hashing
+  static bool useImplementation(Implementation implementation);
+
 private:
   /// process 64 bytes
   void processBlock(const void* data);
+  /// process several consecutive 64 byte blocks
+  void processBlocks(const void* data, size_t numBlocks);
   /// process everything left in the internal buffer
   void processBuffer();
 
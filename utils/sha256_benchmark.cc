@@ -0,0 +1,74 @@
+#include "sha256.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <vector>
+
+// SHA-256 throughput of each implementation this CPU can run, hashing one
+// large buffer through add() and many chunk-sized messages through
+// hashMany(). Usage: sha256_benchmark [megabytes]
+
+namespace {
+  constexpr size_t kDefaultMegabytes = 256;
+  // kAverageChunkSize, the typical message chunker.cc hands to hashMany()
+  constexpr size_t kMessageSize = 8 * 1024;
+
+  struct Implementation {
+    SHA256::Implementation id;
+    const char* name;
+  };
+
+  constexpr Implementation kImplementations[] = {
+    { SHA256::Scalar, "scalar" },
+    { SHA256::ShaNi, "SHA-NI" },
+    { SHA256::Avx2, "AVX2" },
+  };
+
+  template <typename Function>
+  double GigabytesPerSecond(size_t bytes, Function&& function) {
+    auto start = std::chrono::steady_clock::now();
+    function();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return bytes / seconds / 1e9;
+  }
+}
+
+int main(int argc, char* argv[]) {
+  size_t megabytes = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : kDefaultMegabytes;
+  std::vector<unsigned char> buffer(megabytes * 1024 * 1024);
+  std::mt19937_64 rng(1);
+  for (auto& byte : buffer) {
+    byte = static_cast<unsigned char>(rng());
+  }
+
+  std::vector<const void*> data;
+  std::vector<size_t> lengths;
+  for (size_t offset = 0; offset + kMessageSize <= buffer.size(); offset += kMessageSize) {
+    data.push_back(buffer.data() + offset);
+    lengths.push_back(kMessageSize);
+  }
+  std::vector<unsigned char> digests(data.size() * SHA256::HashBytes);
+
+  for (const auto& implementation : kImplementations) {
+    if (!SHA256::useImplementation(implementation.id)) {
+      std::cout << implementation.name << ": not supported on this CPU" << "\n";
+      continue;
+    }
+
+    unsigned char digest[SHA256::HashBytes];
+    double streaming = GigabytesPerSecond(buffer.size(), [&] {
+      SHA256 sha256;
+      sha256.add(buffer.data(), buffer.size());
+      sha256.getHash(digest);
+    });
+    double many = GigabytesPerSecond(data.size() * kMessageSize, [&] {
+      SHA256::hashMany(data.data(), lengths.data(), data.size(), digests.data());
+    });
+    std::cout << implementation.name << ": " << streaming << " GB/s one buffer, "
+              << many << " GB/s hashMany of " << data.size() << " x " << kMessageSize << " bytes" << "\n";
+  }
+  SHA256::useImplementation(SHA256::Fastest);
+  return EXIT_SUCCESS;
+}
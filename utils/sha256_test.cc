@@ -0,0 +1,151 @@
+#include "sha256.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+// Checks every SHA-256 implementation this CPU can run against the NIST
+// example vectors, then against the scalar one on random messages, through
+// both the streaming interface and hashMany()
+
+namespace {
+  int failures = 0;
+
+  void Check(bool condition, const std::string& what) {
+    if (!condition) {
+      std::cerr << "FAILED: " << what << "\n";
+      failures++;
+    }
+  }
+
+  struct Implementation {
+    SHA256::Implementation id;
+    const char* name;
+  };
+
+  constexpr Implementation kImplementations[] = {
+    { SHA256::Scalar, "scalar" },
+    { SHA256::ShaNi, "SHA-NI" },
+    { SHA256::Avx2, "AVX2" },
+  };
+
+  struct Vector {
+    std::string message;
+    const char* digest;
+  };
+
+  // FIPS 180-2 appendix B plus the empty message
+  std::vector<Vector> NistVectors() {
+    return {
+      { "", "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855" },
+      { "abc", "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad" },
+      { "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq",
+        "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1" },
+      { std::string(1000000, 'a'), "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0" },
+    };
+  }
+
+  std::string Hex(const unsigned char* digest) {
+    static const char digits[] = "0123456789abcdef";
+    std::string hex;
+    for (int i = 0; i < SHA256::HashBytes; i++) {
+      hex += digits[digest[i] >> 4];
+      hex += digits[digest[i] & 15];
+    }
+    return hex;
+  }
+
+  // Digests of all messages through hashMany(), in one call so AVX2 lanes are refilled
+  std::vector<std::string> HashMany(const std::vector<std::string>& messages) {
+    std::vector<const void*> data;
+    std::vector<size_t> lengths;
+    for (const auto& message : messages) {
+      data.push_back(message.data());
+      lengths.push_back(message.size());
+    }
+    std::vector<unsigned char> digests(messages.size() * SHA256::HashBytes);
+    SHA256::hashMany(data.data(), lengths.data(), messages.size(), digests.data());
+
+    std::vector<std::string> hex;
+    for (size_t i = 0; i < messages.size(); i++) {
+      hex.push_back(Hex(digests.data() + i * SHA256::HashBytes));
+    }
+    return hex;
+  }
+
+  // The same digests through add(), fed in uneven pieces to cross block boundaries
+  std::vector<std::string> HashStreaming(const std::vector<std::string>& messages) {
+    std::vector<std::string> hex;
+    SHA256 sha256;
+    for (const auto& message : messages) {
+      sha256.reset();
+      for (size_t offset = 0, piece = 1; offset < message.size(); offset += piece, piece = piece * 3 + 1) {
+        sha256.add(message.data() + offset, std::min(piece, message.size() - offset));
+      }
+      hex.push_back(sha256.getHash());
+    }
+    return hex;
+  }
+
+  // Lengths around the block and padding boundaries, then a few chunk-sized ones
+  std::vector<std::string> RandomMessages(std::mt19937_64& rng) {
+    std::vector<std::string> messages;
+    for (size_t length = 0; length <= 3 * SHA256::BlockSize + 1; length++) {
+      messages.emplace_back(length, '\0');
+    }
+    for (size_t length : { 2048, 4095, 65536, 100000 }) {
+      messages.emplace_back(length, '\0');
+    }
+    for (auto& message : messages) {
+      for (auto& byte : message) {
+        byte = static_cast<char>(rng());
+      }
+    }
+    std::shuffle(messages.begin(), messages.end(), rng);
+    return messages;
+  }
+}
+
+int main() {
+  std::mt19937_64 rng(2024);
+  std::vector<Vector> vectors = NistVectors();
+  std::vector<std::string> vector_messages;
+  for (const auto& vector : vectors) {
+    vector_messages.push_back(vector.message);
+  }
+
+  std::vector<std::string> messages = RandomMessages(rng);
+  SHA256::useImplementation(SHA256::Scalar);
+  std::vector<std::string> expected = HashStreaming(messages);
+
+  for (const auto& implementation : kImplementations) {
+    std::string name = implementation.name;
+    if (!SHA256::useImplementation(implementation.id)) {
+      std::cout << "Skipping " << name << ", not supported on this CPU" << "\n";
+      continue;
+    }
+
+    std::vector<std::string> streamed = HashStreaming(vector_messages);
+    std::vector<std::string> many = HashMany(vector_messages);
+    for (size_t i = 0; i < vectors.size(); i++) {
+      std::string what = name + " NIST vector " + std::to_string(i);
+      Check(streamed[i] == vectors[i].digest, what + " (add)");
+      Check(many[i] == vectors[i].digest, what + " (hashMany)");
+    }
+
+    Check(HashStreaming(messages) == expected, name + " random messages (add)");
+    Check(HashMany(messages) == expected, name + " random messages (hashMany)");
+    Check(HashMany({}).empty(), name + " no messages (hashMany)");
+  }
+  SHA256::useImplementation(SHA256::Fastest);
+
+  if (failures > 0) {
+    std::cerr << failures << " checks failed" << "\n";
+    return EXIT_FAILURE;
+  }
+  std::cout << "All SHA-256 checks passed" << "\n";
+  return EXIT_SUCCESS;
+}
@@ -1,18 +1,51 @@
 #include <iostream>
-#include <fstream>
-#include <array>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
 #include <filesystem>
+#include <memory>
+#include <optional>
+#include <thread>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "utils.h"
+#include "mapped_file.h"
 #include "sha256.h"
 #include "protocol/protocol.h"
 
+namespace {
+  // Large enough that the read() syscalls disappear next to hashing
+  constexpr size_t kHashReadSize = 1 << 20;
+  // How far ahead of the hasher the kernel is asked to read a mapped file
+  constexpr uint64_t kHashWindowSize = 8 << 20;
+  constexpr size_t kHashReadAlignment = 4096;
+}
+
 void FatalError(const std::string& message) {
   std::cerr << "Fatal error: " << message << std::endl;
   exit(EXIT_FAILURE);
 }
 
+bool IsValidFileName(std::string_view name) {
+  return !name.empty() && !IsHiddenFile(name) && name.find('/') == std::string_view::npos;
+}
+
+bool IsHiddenFile(std::string_view name) {
+  return !name.empty() && name[0] == '.';
+}
+
+int64_t ModificationTimeNs(const struct stat& st) {
+#if defined(__APPLE__)
+  return static_cast<int64_t>(st.st_mtimespec.tv_sec) * 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+  return static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+}
+
 std::vector<protocol::FileHeader> ListFilesWithHashes(const std::filesystem::path& dir) {
   std::vector<protocol::FileHeader> out;
+  std::vector<std::filesystem::path> paths;
 
   for (const auto& entry : std::filesystem::directory_iterator(dir)) {
     if (!entry.is_regular_file()) {
@@ -22,68 +55,162 @@ std::vector<protocol::FileHeader> ListFilesWithHashes(const std::filesystem::pat
     auto path = entry.path();
     std::string file_name = path.filename().string();
 
-    // Compute hash
-    SHA256 sha256;
-    std::ifstream in(path, std::ios::binary);
-    if (!in) {
-      FatalError("Failed to open file: " + file_name);
-    }
-
-    std::array<char, 4096> buffer;
-    while (in.read(buffer.data(), buffer.size()) || in.gcount() > 0) {
-      sha256.add(buffer.data(), in.gcount());
+    if (IsHiddenFile(file_name)) {
+      continue;
     }
 
     protocol::FileHeader file_header;
     file_header.name_length = static_cast<uint8_t>(file_name.size());
     file_header.name = file_name;
-    file_header.hash_length = protocol::kSha256HexLen;
-    file_header.hash = sha256.getHash();
     out.push_back(file_header);
+    paths.push_back(path);
+  }
+
+  std::vector<std::optional<protocol::Digest>> hashes = HashFiles(paths);
+  size_t kept = 0;
+  for (size_t i = 0; i < out.size(); i++) {
+    // Files that vanished or became unreadable since the scan are left out
+    if (hashes[i]) {
+      out[i].hash = *hashes[i];
+      if (kept != i) {
+        out[kept] = std::move(out[i]);
+      }
+      kept++;
+    }
   }
+  out.resize(kept);
 
   return out;
 }
 
-std::vector<uint8_t> ReadFileBytes(const std::filesystem::path &file_path) {
-  std::error_code ec;
-  uint32_t size = std::filesystem::file_size(file_path, ec);
+std::optional<protocol::Digest> HashFile(const std::filesystem::path& file_path) {
+  int fd = open(file_path.c_str(), O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (fd < 0) {
+    std::cerr << "Failed to open file: " << file_path.string() << "\n";
+    return std::nullopt;
+  } else if (fstat(fd, &st) < 0) {
+    std::cerr << "Unable to stat file: " << file_path.string() << "\n";
+    close(fd);
+    return std::nullopt;
+  }
 
-  if (ec) {
-    FatalError("Unable to stat file: " + file_path.string() + " : " + ec.message());
+  SHA256 sha256;
+  std::shared_ptr<const MappedFile> mapping = MappedFile::Map(fd, st.st_size, MADV_SEQUENTIAL);
+
+  if (mapping) {
+    // Hash straight from the page cache, with the next window already on its way in
+    close(fd);
+    bool complete = GuardMappedReads([&] {
+      for (uint64_t offset = 0; offset < mapping->size(); offset += kHashWindowSize) {
+        mapping->WillNeed(offset + kHashWindowSize, kHashWindowSize);
+        sha256.add(mapping->data() + offset, std::min(kHashWindowSize, mapping->size() - offset));
+      }
+    });
+    if (!complete) {
+      std::cerr << "File was truncated while being hashed: " << file_path.string() << "\n";
+      return std::nullopt;
+    }
+  } else {
+    // Empty files, and files that cannot be mapped
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+    // One buffer per thread, reused across files
+    thread_local std::unique_ptr<uint8_t, decltype(&free)> buffer(
+        static_cast<uint8_t*>(aligned_alloc(kHashReadAlignment, kHashReadSize)), &free);
+
+    while (true) {
+      ssize_t bytes_read = read(fd, buffer.get(), kHashReadSize);
+      if (bytes_read < 0 && errno == EINTR) {
+        continue;
+      } else if (bytes_read < 0) {
+        std::cerr << "Failed to read file: " << file_path.string() << "\n";
+        close(fd);
+        return std::nullopt;
+      } else if (bytes_read == 0) {
+        break;
+      }
+      sha256.add(buffer.get(), bytes_read);
+    }
+    close(fd);
   }
 
-  std::ifstream in(file_path, std::ios::binary);
+  protocol::Digest digest;
+  sha256.getHash(digest.data());
+  return digest;
+}
 
-  if (!in) {
-    FatalError("Failed to open file: " + file_path.string());
+std::vector<std::optional<protocol::Digest>> HashFiles(const std::vector<std::filesystem::path>& paths) {
+  std::vector<std::optional<protocol::Digest>> hashes(paths.size());
+
+  // Largest first, so a huge file starts right away instead of being the last one left
+  std::vector<std::pair<uintmax_t, size_t>> order;
+  order.reserve(paths.size());
+  for (size_t i = 0; i < paths.size(); i++) {
+    std::error_code ec;
+    uintmax_t size = std::filesystem::file_size(paths[i], ec);
+    order.emplace_back(ec ? 0 : size, i);
   }
+  std::sort(order.begin(), order.end(), std::greater<>());
+
+  // Each thread takes the next file as soon as it is done with its last one
+  std::atomic<size_t> next{0};
+  auto work = [&] {
+    for (size_t i; (i = next.fetch_add(1)) < order.size();) {
+      size_t index = order[i].second;
+      hashes[index] = HashFile(paths[index]);
+    }
+  };
 
-  std::vector<uint8_t> buffer(size);
-  if (!in.read(reinterpret_cast<char *>(buffer.data()), size)) {
-    FatalError("Failed to read file: " + file_path.string());
+  size_t thread_count = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), paths.size());
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < thread_count; i++) {
+    threads.emplace_back(work);
   }
+  work();
 
-  return buffer;
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  return hashes;
 }
 
-void WriteFileBytes(const protocol::FileContents& file, const std::filesystem::path& data_dir) {
-  std::filesystem::path file_path = data_dir / file.header.name;
+std::string DigestToHex(const protocol::Digest& digest) {
+  static const char kHexDigits[] = "0123456789abcdef";
+  std::string hex;
+  hex.reserve(protocol::kSha256HexLen);
+
+  for (uint8_t byte : digest) {
+    hex.push_back(kHexDigits[byte >> 4]);
+    hex.push_back(kHexDigits[byte & 0x0f]);
+  }
 
-  // Ensure the directory exists
-  std::filesystem::create_directories(file_path.parent_path());
+  return hex;
+}
 
-  std::ofstream out(file_path, std::ios::binary);
-  if (!out) {
-    FatalError("Failed to open file for writing: " + file_path.string());
+bool DigestFromHex(std::string_view hex, protocol::Digest& digest) {
+  if (hex.size() != protocol::kSha256HexLen) {
+    return false;
   }
 
-  std::cout << "Number of bytes in file: " << file.bytes.size() << "\n";
-  out.write(reinterpret_cast<const char *>(file.bytes.data()), file.size);
-  if (!out) {
-    FatalError("Failed to write to file: " + file_path.string());
+  auto nibble = [](char c) -> int {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+  };
+
+  for (size_t i = 0; i < digest.size(); i++) {
+    int high = nibble(hex[2 * i]);
+    int low = nibble(hex[2 * i + 1]);
+    if (high < 0 || low < 0) {
+      return false;
+    }
+    digest[i] = static_cast<uint8_t>((high << 4) | low);
   }
 
-  out.close();
-  std::cout << "File written: " << file_path.string() << "\n";
-}
\ No newline at end of file
+  return true;
+}
@@ -1,13 +1,32 @@
+#include <optional>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <filesystem>
+#include <sys/stat.h>
 #include "protocol/protocol.h"
 #include "sha256.h"
 
 void FatalError(const std::string& message);
 
+// Whether a name received from a peer is a plain, visible file name inside the data directory
+bool IsValidFileName(std::string_view name);
+
+// Names starting with '.' are transfers in progress and are never listed
+bool IsHiddenFile(std::string_view name);
+
+// Modification time of a stat() result in nanoseconds, the way the indexes record it
+int64_t ModificationTimeNs(const struct stat& st);
+
 std::vector<protocol::FileHeader> ListFilesWithHashes(const std::filesystem::path& dir);
 
-std::vector<uint8_t> ReadFileBytes(const std::filesystem::path& file_path);
+// Nothing if the file was deleted or cannot be read
+std::optional<protocol::Digest> HashFile(const std::filesystem::path& file_path);
+
+// Hashes of `paths` in the same order, computed on all cores
+std::vector<std::optional<protocol::Digest>> HashFiles(const std::vector<std::filesystem::path>& paths);
+
+std::string DigestToHex(const protocol::Digest& digest);
 
-void WriteFileBytes(const protocol::FileContents& file, const std::filesystem::path& data_dir);
\ No newline at end of file
+// Returns false unless hex is exactly kSha256HexLen hex characters
+bool DigestFromHex(std::string_view hex, protocol::Digest& digest);